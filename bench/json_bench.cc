@@ -0,0 +1,125 @@
+#include "chatroom/protocol.h"
+#include "chatroom/jsonStream.h"
+#include "chatroom/json.hpp"
+#include <benchmark/benchmark.h>
+#include <json/json.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace chat::http;
+
+static const std::string s_chat_request =
+    R"({"type":"chat_request","server":"client","time":"1700000000000",)"
+    R"("from":"alice","name":"alice","avatar":"./static/avatar/avatar_01.jpg",)"
+    R"("to":"group","content":"hello everyone, 大家好"})";
+
+// 旧实现: jsoncpp 解析成 map, 再用 jsoncpp 编码
+static void BM_JsoncppParse(benchmark::State& state) {
+    for (auto _ : state) {
+        Json::Value json;
+        Json::Reader reader;
+        reader.parse(s_chat_request, json);
+        std::map<std::string, std::string> datas;
+        for (auto& i : json.getMemberNames()) {
+            datas[i] = json[i].asString();
+        }
+        benchmark::DoNotOptimize(datas);
+    }
+}
+
+static void BM_ChatMessageParse(benchmark::State& state) {
+    for (auto _ : state) {
+        auto msg = ChatMessage::Create(s_chat_request);
+        benchmark::DoNotOptimize(msg);
+    }
+}
+
+// 与 ChatMessageParse 对应的 JSON 编码, 输出为独立字符串
+static void BM_ChatMessageToString(benchmark::State& state) {
+    auto msg = ChatMessage::Create(s_chat_request);
+    msg->set(ChatMessage::TYPE, "chat_response");
+    msg->set(ChatMessage::RESULT, "200");
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(msg->toString());
+    }
+}
+
+static void BM_JsoncppEncode(benchmark::State& state) {
+    Json::Value json;
+    Json::Reader reader;
+    reader.parse(s_chat_request, json);
+    json["type"] = "chat_response";
+    json["result"] = "200";
+    for (auto _ : state) {
+        Json::FastWriter w;
+        benchmark::DoNotOptimize(w.write(json));
+    }
+}
+
+static void BM_ChatMessageEncode(benchmark::State& state) {
+    auto msg = ChatMessage::Create(s_chat_request);
+    msg->set(ChatMessage::TYPE, "chat_response");
+    msg->set(ChatMessage::RESULT, "200");
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(msg->toFrame(ChatMessage::JSON));
+    }
+}
+
+static std::vector<std::pair<std::string, std::pair<std::string, std::string> > > MakeUsers(size_t n) {
+    std::vector<std::pair<std::string, std::pair<std::string, std::string> > > users;
+    for (size_t i = 0; i < n; ++i) {
+        auto id = "user_" + std::to_string(i);
+        users.push_back(std::make_pair(id, std::make_pair(id, "./static/avatar/avatar_01.jpg")));
+    }
+    return users;
+}
+
+// 旧实现: nlohmann 构建 DOM 再 dump
+static void BM_NlohmannRoster(benchmark::State& state) {
+    auto users = MakeUsers(state.range(0));
+    for (auto _ : state) {
+        nlohmann::json rsp;
+        rsp["type"] = "chat_init_response";
+        rsp["time"] = "2026-10-17 12:00:00";
+        for (auto& i : users) {
+            nlohmann::json user;
+            user["id"] = i.first;
+            user["name"] = i.second.first;
+            user["avatar"] = i.second.second;
+            rsp["data"].push_back(user);
+        }
+        benchmark::DoNotOptimize(WSFrame::Create(rsp.dump()));
+    }
+}
+
+static void BM_JsonWriterRoster(benchmark::State& state) {
+    auto users = MakeUsers(state.range(0));
+    for (auto _ : state) {
+        std::string buf = WSFrame::NewBuffer(64 + users.size() * 64);
+        JsonWriter w(buf);
+        w.startObject()
+            .kv("type", "chat_init_response")
+            .kv("time", "2026-10-17 12:00:00")
+            .key("data").startArray();
+        for (auto& i : users) {
+            w.startObject()
+                .kv("id", i.first)
+                .kv("name", i.second.first)
+                .kv("avatar", i.second.second)
+                .endObject();
+        }
+        w.endArray().endObject();
+        benchmark::DoNotOptimize(WSFrame::CreateFromBuffer(std::move(buf)));
+    }
+}
+
+BENCHMARK(BM_JsoncppParse);
+BENCHMARK(BM_ChatMessageParse);
+BENCHMARK(BM_JsoncppEncode);
+BENCHMARK(BM_ChatMessageEncode);
+BENCHMARK(BM_ChatMessageToString);
+BENCHMARK(BM_NlohmannRoster)->Arg(10)->Arg(1000);
+BENCHMARK(BM_JsonWriterRoster)->Arg(10)->Arg(1000);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,146 @@
+#include "chatroom/chatServlet.h"
+#include <benchmark/benchmark.h>
+#include <chat/iomanager.h>
+#include <chat/log.h>
+#include <chat/mutex.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace chat::http;
+
+// 不持有 socket 的 session, 只用作表中的值
+static WSSession::ptr MockSession() {
+    return std::make_shared<WSSession>(nullptr, false);
+}
+
+// 发送队列的写协程调度到这里, 唯一的线程一直阻塞, 帧只入队不写出
+// 队列满后按 chat.outbound.policy(默认 drop_oldest)丢弃, 入队开销保持稳定
+static chat::IOManager* BlockedIOManager() {
+    static chat::IOManager* s_iom = [](){
+        auto iom = new chat::IOManager(1, false, "bench_blocked");
+        iom->schedule([](){
+            chat::Semaphore sem;
+            sem.wait();
+        });
+        return iom;
+    }();
+    return s_iom;
+}
+
+// 每种规模一个已登录 n 个用户的 servlet, 首次使用时构建, 不释放
+static ChatWSServlet::ptr GetServlet(size_t n) {
+    static std::map<size_t, ChatWSServlet::ptr> s_servlets;
+    auto& v = s_servlets[n];
+    if (!v) {
+        CHAT_LOG_ROOT()->setLevel(chat::LogLevel::ERROR);
+        v = std::make_shared<ChatWSServlet>();
+        auto registry = v->getRegistry();
+        for (size_t i = 0; i < n; ++i) {
+            auto id = "user_" + std::to_string(i);
+            auto session = MockSession();
+            registry->connect(session, BlockedIOManager());
+            v->session_add(id, session);
+            v->addInfo(id, id, "./static/avatar/avatar_01.jpg");
+        }
+    }
+    return v;
+}
+
+// chat_init_request 中的在线用户列表
+static void BM_RosterBuild(benchmark::State& state) {
+    auto servlet = GetServlet(state.range(0));
+    auto enc = (ChatMessage::Encoding)state.range(1);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(servlet->buildRoster(enc, servlet->getRegistry()->getInfoVersion()));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// 用户列表未变化时直接返回缓存的帧
+static void BM_RosterCached(benchmark::State& state) {
+    auto servlet = GetServlet(state.range(0));
+    auto enc = (ChatMessage::Encoding)state.range(1);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(servlet->getRoster(enc));
+    }
+}
+
+// 重连时客户端落后最近 range(1) 次变化
+static void BM_RosterDelta(benchmark::State& state) {
+    auto servlet = GetServlet(state.range(0));
+    uint64_t since = servlet->getRegistry()->getInfoVersion() - state.range(1);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(servlet->buildDelta(ChatMessage::JSON, since));
+    }
+}
+
+// 群聊广播: 编码一次, 入队到除发送者外的全部 session
+static void BM_SessionNotify(benchmark::State& state) {
+    auto servlet = GetServlet(state.range(0));
+    ChatMessage::ptr msg(new ChatMessage);
+    msg->set(ChatMessage::TYPE, "chat_response");
+    msg->set(ChatMessage::FROM, "user_0");
+    msg->set(ChatMessage::TO, "group");
+    msg->set(ChatMessage::CONTENT, "hello everyone, 大家好");
+    msg->set(ChatMessage::TIME, "2026-10-17 12:00:00");
+    for (auto _ : state) {
+        servlet->session_notify(msg);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// 10k 在线用户中 range(0) 人的房间广播, 只与房间人数有关
+static void BM_RoomNotify(benchmark::State& state) {
+    auto servlet = GetServlet(10000);
+    auto name = "room_" + std::to_string(state.range(0));
+    auto room = servlet->getRooms()->get(name);
+    if (!room) {
+        auto registry = servlet->getRegistry();
+        room = servlet->getRooms()->create(name, "user_0", registry->get("user_0"));
+        bool joined = false;
+        for (int64_t i = 1; i < state.range(0); ++i) {
+            auto id = "user_" + std::to_string(i);
+            servlet->getRooms()->join(name, id, registry->get(id), joined);
+        }
+    }
+    ChatMessage::ptr msg(new ChatMessage);
+    msg->set(ChatMessage::TYPE, "chat_response");
+    msg->set(ChatMessage::FROM, "user_0");
+    msg->set(ChatMessage::ROOM, name);
+    msg->set(ChatMessage::CONTENT, "hello room");
+    for (auto _ : state) {
+        servlet->room_notify(room, msg);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// 连接关闭时按 session 反查 id
+static void BM_SessionFind(benchmark::State& state) {
+    size_t n = state.range(0);
+    auto servlet = GetServlet(n);
+    // 均匀取至多 1024 个 session 轮流查找
+    std::vector<WSSession::ptr> sessions;
+    size_t step = n / 1024 + 1;
+    for (size_t i = 0; i < n; i += step) {
+        sessions.push_back(servlet->getRegistry()->get("user_" + std::to_string(i))->getSession());
+    }
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(servlet->session_find(sessions[i++ % sessions.size()]));
+    }
+}
+
+BENCHMARK(BM_RosterBuild)
+    ->Args({10, ChatMessage::JSON})->Args({1000, ChatMessage::JSON})
+    ->Args({10, ChatMessage::BINARY})->Args({1000, ChatMessage::BINARY});
+BENCHMARK(BM_RosterCached)
+    ->Args({10, ChatMessage::JSON})->Args({1000, ChatMessage::JSON})
+    ->Args({10, ChatMessage::BINARY})->Args({1000, ChatMessage::BINARY});
+BENCHMARK(BM_RosterDelta)->Args({1000, 1})->Args({1000, 100})->Args({10000, 1000});
+BENCHMARK(BM_SessionNotify)->Arg(10)->Arg(1000)->Arg(10000);
+BENCHMARK(BM_RoomNotify)->Arg(10)->Arg(100);
+BENCHMARK(BM_SessionFind)->Arg(10)->Arg(1000)->Arg(100000);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,105 @@
+#include "chatroom/sessionRegistry.h"
+#include <benchmark/benchmark.h>
+#include <chat/mutex.h>
+#include <string>
+#include <vector>
+
+using namespace chat::http;
+
+// 分片前的实现: 一把 RWMutex 保护整个 m_sessions/m_users
+// 广播已改由 PubSub 的主题分发, 两边都不再维护 session 快照
+class LockedRegistry {
+public:
+    bool exists(const std::string& id) {
+        chat::RWMutex::ReadLock lock(m_mutex);
+        return m_sessions.find(id) != m_sessions.end();
+    }
+    void add(const std::string& id, WSSession::ptr session) {
+        chat::RWMutex::WriteLock lock(m_mutex);
+        m_sessions[id] = session;
+    }
+    void del(const std::string& id) {
+        chat::RWMutex::WriteLock lock(m_mutex);
+        m_sessions.erase(id);
+        m_users.erase(id);
+    }
+    std::pair<std::string, std::string> getInfo(const std::string& id) {
+        chat::RWMutex::ReadLock lock(m_mutex);
+        auto it = m_users.find(id);
+        return it == m_users.end() ? std::make_pair("", "") : it->second;
+    }
+    void addInfo(const std::string& id, const std::string& name, const std::string& avatar) {
+        chat::RWMutex::WriteLock lock(m_mutex);
+        m_users[id] = std::make_pair(name, avatar);
+    }
+private:
+    chat::RWMutex m_mutex;
+    std::map<std::string, WSSession::ptr> m_sessions;
+    std::unordered_map<std::string, std::pair<std::string, std::string> > m_users;
+};
+
+static const int s_users = 10000;
+
+// 不持有 socket 的 session, 只用作表中的值
+static WSSession::ptr MockSession() {
+    return std::make_shared<WSSession>(nullptr, false);
+}
+
+static const std::vector<std::string>& GetIds() {
+    static std::vector<std::string> s_ids = [](){
+        std::vector<std::string> ids;
+        for (int i = 0; i < s_users; ++i) {
+            ids.push_back("user_" + std::to_string(i));
+        }
+        return ids;
+    }();
+    return s_ids;
+}
+
+template<class T>
+static T& GetRegistry() {
+    static T* s_registry = [](){
+        T* r = new T;
+        for (auto& id : GetIds()) {
+            r->add(id, MockSession());
+            r->addInfo(id, id, "./static/avatar/avatar_01.jpg");
+        }
+        return r;
+    }();
+    return *s_registry;
+}
+
+// 读为主: 登录检查 + 用户信息查询
+template<class T>
+static void BM_Lookup(benchmark::State& state) {
+    auto& r = GetRegistry<T>();
+    auto& ids = GetIds();
+    size_t i = state.thread_index() * 7919;
+    for (auto _ : state) {
+        auto& id = ids[i++ % ids.size()];
+        benchmark::DoNotOptimize(r.exists(id));
+        benchmark::DoNotOptimize(r.getInfo(id));
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+
+// 登录/退出: 每个线程使用自己的 id, 不互相覆盖
+template<class T>
+static void BM_LoginLogout(benchmark::State& state) {
+    auto& r = GetRegistry<T>();
+    std::string id = "churn_" + std::to_string(state.thread_index());
+    auto session = MockSession();
+    for (auto _ : state) {
+        r.add(id, session);
+        r.addInfo(id, id, "./static/avatar/avatar_02.jpg");
+        r.del(id);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_TEMPLATE(BM_Lookup, LockedRegistry)->Threads(1)->Threads(4)->Threads(16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Lookup, SessionRegistry)->Threads(1)->Threads(4)->Threads(16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_LoginLogout, LockedRegistry)->Threads(1)->Threads(4)->Threads(16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_LoginLogout, SessionRegistry)->Threads(1)->Threads(4)->Threads(16)->UseRealTime();
+
+BENCHMARK_MAIN();
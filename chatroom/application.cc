@@ -1,6 +1,7 @@
 #include "application.h"
 #include <unistd.h>
 #include <signal.h>
+#include <string.h>
 #include <chat/tcp_server.h>
 #include <chat/daemon.h>
 #include <chat/config.h>
@@ -12,6 +13,9 @@
 #include <chat/util.h>
 #include "resServlet.h"
 #include "chatServlet.h"
+#include "asyncLog.h"
+#include "binLog.h"
+#include "metricsServlet.h"
 
 namespace chat {
 
@@ -102,11 +106,48 @@ bool Application::run() {
                                                   std::placeholders::_2), is_daemon);
 }
 
+// 信号处理函数里只做异步信号安全的事, 停止流程由主 IOManager 上的定时器执行
+static volatile sig_atomic_t s_stop_signal = 0;
+
+static void OnStopSignal(int sig) {
+    s_stop_signal = sig;
+}
+
+void Application::InstallSignalHandler() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnStopSignal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGTERM, &sa, nullptr);
+    sigaction(SIGINT, &sa, nullptr);
+}
+
+bool Application::IsStopping() {
+    return s_stop_signal != 0;
+}
+
+void Application::WatchStop(IOManager* iom, std::function<void()> cb, uint64_t interval_ms) {
+    // 每次只设一次性定时器, 收到信号后不再续设, iom 上不会留下定时器
+    iom->addTimer(interval_ms, [iom, cb, interval_ms]() {
+        if (!IsStopping()) {
+            WatchStop(iom, cb, interval_ms);
+            return;
+        }
+        CHAT_LOG_INFO(g_logger) << "signal " << s_stop_signal << " received, stopping";
+        cb();
+    });
+}
+
 int Application::main(int argc, char** argv) {
     signal(SIGPIPE, SIG_IGN);
+    InstallSignalHandler();
     CHAT_LOG_INFO(g_logger) << "main";
     std::string conf_path = chat::EnvMgr::GetInstance()->getConfigPath();
     chat::Config::LoadFromConfDir(conf_path, true);
+    // daemon 模式下 fork 之后才启动日志后台线程
+    chat::AsyncLogMgr::GetInstance()->start();
+    chat::BinLog::Start();
     {
         std::string pidfile = g_server_work_path->getValue() + "/" + g_server_pid_file->getValue();
         std::ofstream ofs(pidfile);
@@ -119,12 +160,27 @@ int Application::main(int argc, char** argv) {
 
     m_mainIOManager.reset(new chat::IOManager(1, true, "main"));
     m_mainIOManager->schedule(std::bind(&Application::run_fiber, this));
-    m_mainIOManager->addTimer(2000, [](){
-    }, true);
+    // 检查停止信号的定时器同时让主 IOManager 在没有其他事件时也不退出
+    WatchStop(m_mainIOManager.get(), std::bind(&Application::shutdown, this));
+    // 收到信号并关闭全部连接后返回
     m_mainIOManager->stop();
+    m_module->onUnload();
+    chat::WorkerMgr::GetInstance()->stop();
+    chat::BinLog::Stop();
+    chat::AsyncLogMgr::GetInstance()->stop();
+    // 正常返回, PGO 插桩构建在退出时写出 profile
     return 0;
 }
 
+void Application::shutdown() {
+    for (auto& i : m_servers) {
+        for (auto& server : i.second) {
+            server->stop();
+        }
+    }
+    m_module->onServerDown();
+}
+
 int Application::run_fiber() {
     bool has_error = false;
     if (!m_module->onLoad()) {
@@ -296,6 +352,11 @@ bool Module::onLoad() {
 
 bool Module::onUnload() {
     CHAT_LOG_INFO(g_logger) << "on unload";
+    for (auto& i : m_chatServlets) {
+        if (i->getHistory()) {
+            i->getHistory()->stop();
+        }
+    }
     return true;
 }
 
@@ -310,20 +371,20 @@ bool Module::onDisconnect(chat::Stream::ptr stream) {
 bool Module::onServerReady() {
     CHAT_LOG_INFO(g_logger) << "on Server Ready";
     std::vector<chat::TcpServer::ptr> svrs;
-    // if (!chat::Application::GetInstance()->getServer("http", svrs)) {
-    //     CHAT_LOG_INFO(g_logger) << "no httpserver alive";
-    //     return false;
-    // }
-
-    // for(auto& i : svrs) {
-    //     chat::http::HttpServer::ptr http_server = std::dynamic_pointer_cast<chat::http::HttpServer>(i);
-    //     chat::http::ServletDispatch::ptr slt_dispatch = http_server->getServletDispatch();
-    //     chat::http::ResourceServlet::ptr slt(new chat::http::ResourceServlet(chat::EnvMgr::GetInstance()->getCwd()));
-    //     slt_dispatch->addGlobServlet("/html/*", slt);
-    //     CHAT_LOG_INFO(g_logger) << "add HTTP Servlet";
-    // }
-
-    // svrs.clear();
+    if (!chat::Application::GetInstance()->getServer("http", svrs)) {
+        CHAT_LOG_INFO(g_logger) << "no httpserver alive, metrics disabled";
+    }
+
+    for(auto& i : svrs) {
+        chat::http::HttpServer::ptr http_server = std::dynamic_pointer_cast<chat::http::HttpServer>(i);
+        chat::http::ServletDispatch::ptr slt_dispatch = http_server->getServletDispatch();
+        // chat::http::ResourceServlet::ptr slt(new chat::http::ResourceServlet(chat::EnvMgr::GetInstance()->getCwd()));
+        // slt_dispatch->addGlobServlet("/html/*", slt);
+        slt_dispatch->addServlet("/metrics", chat::http::MetricsServlet::ptr(new chat::http::MetricsServlet));
+        CHAT_LOG_INFO(g_logger) << "add HTTP Servlet";
+    }
+
+    svrs.clear();
     if (!chat::Application::GetInstance()->getServer("ws", svrs)) {
         CHAT_LOG_INFO(g_logger) << "no ws alive";
         return false;
@@ -334,6 +395,7 @@ bool Module::onServerReady() {
         chat::http::ServletDispatch::ptr slt_dispatch = ws_server->getWSServletDispatch();
         chat::http::ChatWSServlet::ptr slt(new chat::http::ChatWSServlet);
         slt_dispatch->addServlet("/chat", slt);
+        m_chatServlets.push_back(slt);
         CHAT_LOG_INFO(g_logger) << "add WS Servlet";
     }
 
@@ -345,6 +407,14 @@ bool Module::onServerUp() {
     return true;
 }
 
+bool Module::onServerDown() {
+    CHAT_LOG_INFO(g_logger) << "on Server Down";
+    for (auto& i : m_chatServlets) {
+        i->closeAll();
+    }
+    return true;
+}
+
 
 
 
@@ -39,6 +39,8 @@ public:
     
     virtual bool onServerReady();
     virtual bool onServerUp();
+    /// 收到停止信号, 已停止监听, 在此关闭仍在线的连接
+    virtual bool onServerDown();
 
     virtual bool handleRequest(chat::Message::ptr req
                                ,chat::Message::ptr rsp
@@ -64,6 +66,8 @@ protected:
     std::string m_filename;
     std::string m_id;
     uint32_t m_type;
+    // onServerReady 创建的聊天 servlet, onServerDown 时关闭连接, onUnload 时落盘消息历史
+    std::vector<chat::http::ChatWSServlet::ptr> m_chatServlets;
 };
 
 class Application {
@@ -78,9 +82,19 @@ public:
     bool getServer(const std::string& type, std::vector<TcpServer::ptr>& svrs);
     void listAllServer(std::map<std::string, std::vector<TcpServer::ptr> >& servers);
 
+    /// 安装 SIGTERM/SIGINT 处理函数, 处理函数只记下收到了信号
+    static void InstallSignalHandler();
+    /// 是否收到过 SIGTERM/SIGINT
+    static bool IsStopping();
+    /// 在 iom 上每 interval_ms 检查一次停止信号, 收到后在 iom 上调用一次 cb 并不再设定时器,
+    /// 之后 iom 上的任务和事件结束时 iom->stop() 即可返回
+    static void WatchStop(IOManager* iom, std::function<void()> cb, uint64_t interval_ms = 200);
+
 private:
     int main(int argc, char** argv);
     int run_fiber();
+    /// 停止监听并关闭全部连接, 让主 IOManager 可以退出
+    void shutdown();
 private:
     int m_argc = 0;
     char** m_argv = nullptr;
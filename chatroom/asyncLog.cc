@@ -0,0 +1,445 @@
+#include "asyncLog.h"
+#include <chat/config.h>
+#include <chat/util.h>
+#include <iostream>
+#include <sched.h>
+#include <sstream>
+#include <unistd.h>
+
+namespace chat {
+
+static chat::Logger::ptr g_logger = CHAT_LOG_NAME("system");
+
+struct AsyncLogAppenderDefine {
+    int type = 0;   //1 File, 2 Stdout
+    std::string file;
+    std::string formatter;
+
+    bool operator==(const AsyncLogAppenderDefine& oth) const {
+        return type == oth.type
+            && file == oth.file
+            && formatter == oth.formatter;
+    }
+};
+
+struct AsyncLogDefine {
+    std::string name;
+    uint32_t capacity = 65536;
+    uint32_t flush_ms = 10;
+    std::vector<AsyncLogAppenderDefine> appenders;
+
+    bool operator==(const AsyncLogDefine& oth) const {
+        return name == oth.name
+            && capacity == oth.capacity
+            && flush_ms == oth.flush_ms
+            && appenders == oth.appenders;
+    }
+};
+
+struct LogSampleDefine {
+    uint32_t every = 1;
+    uint32_t rate = 0;
+
+    bool operator==(const LogSampleDefine& oth) const {
+        return every == oth.every && rate == oth.rate;
+    }
+};
+
+template<>
+class LexicalCast<std::string, AsyncLogDefine> {
+public:
+    AsyncLogDefine operator()(const std::string& v) {
+        YAML::Node n = YAML::Load(v);
+        AsyncLogDefine ld;
+        if (!n["name"].IsDefined()) {
+            std::cout << "async log config error: name is null, " << n << std::endl;
+            throw std::logic_error("async log name is null");
+        }
+        ld.name = n["name"].as<std::string>();
+        if (n["capacity"].IsDefined()) {
+            ld.capacity = n["capacity"].as<uint32_t>();
+        }
+        if (n["flush_ms"].IsDefined()) {
+            ld.flush_ms = n["flush_ms"].as<uint32_t>();
+        }
+        if (n["appenders"].IsDefined()) {
+            for (size_t x = 0; x < n["appenders"].size(); ++x) {
+                auto a = n["appenders"][x];
+                if (!a["type"].IsDefined()) {
+                    std::cout << "async log config error: appender type is null, " << a << std::endl;
+                    continue;
+                }
+                std::string type = a["type"].as<std::string>();
+                AsyncLogAppenderDefine lad;
+                if (type == "FileLogAppender") {
+                    lad.type = 1;
+                    if (!a["file"].IsDefined()) {
+                        std::cout << "async log config error: fileappender file is null, " << a << std::endl;
+                        continue;
+                    }
+                    lad.file = a["file"].as<std::string>();
+                } else if (type == "StdoutLogAppender") {
+                    lad.type = 2;
+                } else {
+                    std::cout << "async log config error: appender type is invalid, " << a << std::endl;
+                    continue;
+                }
+                if (a["formatter"].IsDefined()) {
+                    lad.formatter = a["formatter"].as<std::string>();
+                }
+                ld.appenders.push_back(lad);
+            }
+        }
+        return ld;
+    }
+};
+
+template<>
+class LexicalCast<AsyncLogDefine, std::string> {
+public:
+    std::string operator()(const AsyncLogDefine& i) {
+        YAML::Node n;
+        n["name"] = i.name;
+        n["capacity"] = i.capacity;
+        n["flush_ms"] = i.flush_ms;
+        for (auto& a : i.appenders) {
+            YAML::Node na;
+            if (a.type == 1) {
+                na["type"] = "FileLogAppender";
+                na["file"] = a.file;
+            } else if (a.type == 2) {
+                na["type"] = "StdoutLogAppender";
+            }
+            if (!a.formatter.empty()) {
+                na["formatter"] = a.formatter;
+            }
+            n["appenders"].push_back(na);
+        }
+        std::stringstream ss;
+        ss << n;
+        return ss.str();
+    }
+};
+
+template<>
+class LexicalCast<std::string, LogSampleDefine> {
+public:
+    LogSampleDefine operator()(const std::string& v) {
+        YAML::Node n = YAML::Load(v);
+        LogSampleDefine sd;
+        if (n["every"].IsDefined()) {
+            sd.every = n["every"].as<uint32_t>();
+        }
+        if (n["rate"].IsDefined()) {
+            sd.rate = n["rate"].as<uint32_t>();
+        }
+        return sd;
+    }
+};
+
+template<>
+class LexicalCast<LogSampleDefine, std::string> {
+public:
+    std::string operator()(const LogSampleDefine& i) {
+        YAML::Node n;
+        n["every"] = i.every;
+        n["rate"] = i.rate;
+        std::stringstream ss;
+        ss << n;
+        return ss.str();
+    }
+};
+
+static chat::ConfigVar<std::vector<AsyncLogDefine> >::ptr g_async_log_defines =
+    chat::Config::Lookup("async_logs", std::vector<AsyncLogDefine>(), "async logs config");
+
+static chat::ConfigVar<std::map<std::string, LogSampleDefine> >::ptr g_log_sample_defines =
+    chat::Config::Lookup("log_samples", std::map<std::string, LogSampleDefine>(), "log sample config");
+
+static chat::Mutex s_sampler_mutex;
+
+static std::map<std::string, LogSampler*>& GetSamplers() {
+    static std::map<std::string, LogSampler*> s_samplers;
+    return s_samplers;
+}
+
+struct _AsyncLogIniter {
+    _AsyncLogIniter() {
+        g_async_log_defines->addListener([](const std::vector<AsyncLogDefine>& old_value
+                    ,const std::vector<AsyncLogDefine>& new_value){
+            AsyncLogMgr::GetInstance()->apply();
+        });
+        g_log_sample_defines->addListener([](const std::map<std::string, LogSampleDefine>& old_value
+                    ,const std::map<std::string, LogSampleDefine>& new_value){
+            chat::Mutex::Lock lock(s_sampler_mutex);
+            for (auto& i : GetSamplers()) {
+                auto it = new_value.find(i.first);
+                if (it == new_value.end()) {
+                    i.second->set(1, 0);
+                } else {
+                    i.second->set(it->second.every, it->second.rate);
+                }
+            }
+        });
+    }
+};
+
+static _AsyncLogIniter s_async_log_initer;
+
+LogSampler::LogSampler(const std::string& name)
+    :m_name(name) {
+}
+
+LogSampler* LogSampler::Get(const std::string& name) {
+    chat::Mutex::Lock lock(s_sampler_mutex);
+    auto& samplers = GetSamplers();
+    auto it = samplers.find(name);
+    if (it != samplers.end()) {
+        return it->second;
+    }
+    LogSampler* s = new LogSampler(name);
+    auto defines = g_log_sample_defines->getValue();
+    auto dit = defines.find(name);
+    if (dit != defines.end()) {
+        s->set(dit->second.every, dit->second.rate);
+    }
+    samplers[name] = s;
+    return s;
+}
+
+void LogSampler::set(uint32_t every, uint32_t rate) {
+    m_every.store(every ? every : 1, std::memory_order_relaxed);
+    m_rate.store(rate, std::memory_order_relaxed);
+}
+
+bool LogSampler::hit() {
+    uint32_t every = m_every.load(std::memory_order_relaxed);
+    if (every > 1 && m_count.fetch_add(1, std::memory_order_relaxed) % every != 0) {
+        m_suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    uint32_t rate = m_rate.load(std::memory_order_relaxed);
+    if (rate) {
+        uint64_t sec = chat::GetCurrentMS() / 1000;
+        uint64_t window = m_window.load(std::memory_order_relaxed);
+        if (window != sec && m_window.compare_exchange_strong(window, sec)) {
+            m_windowCount.store(0, std::memory_order_relaxed);
+        }
+        if (m_windowCount.fetch_add(1, std::memory_order_relaxed) >= rate) {
+            m_suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    return true;
+}
+
+AsyncLogAppender::AsyncLogAppender(size_t capacity, uint32_t flush_ms)
+    :m_flushMs(flush_ms ? flush_ms : 1) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    m_mask = size - 1;
+    m_slots.reset(new Slot[size]);
+    for (size_t i = 0; i < size; ++i) {
+        m_slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+AsyncLogAppender::~AsyncLogAppender() {
+    stop();
+}
+
+void AsyncLogAppender::addAppender(LogAppender::ptr appender) {
+    m_appenders.push_back(appender);
+}
+
+void AsyncLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
+    if (level < m_level) {
+        return;
+    }
+    // 先登记再检查 m_running, 与 stop 的先置标志再等待配对:
+    // 要么这里看到已停止而同步写出, 要么 stop 等到本次入队后再做最后一次 drain
+    m_writers.fetch_add(1);
+    if (!m_running.load()) {
+        m_writers.fetch_sub(1, std::memory_order_release);
+        write(logger, level, event);
+        return;
+    }
+    if (!push(logger, level, event)) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_writers.fetch_sub(1, std::memory_order_release);
+}
+
+// 有界 MPSC 环形队列, 每个槽位的 seq 标记其状态:
+// seq == pos 可写, seq == pos + 1 可读, 读完置为 pos + 容量
+bool AsyncLogAppender::push(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
+    size_t pos = m_head.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &m_slots[pos & m_mask];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return false;
+        } else {
+            pos = m_head.load(std::memory_order_relaxed);
+        }
+    }
+    slot->logger = std::move(logger);
+    slot->level = level;
+    slot->event = std::move(event);
+    slot->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+size_t AsyncLogAppender::drain() {
+    size_t n = 0;
+    while (true) {
+        Slot& slot = m_slots[m_tail & m_mask];
+        if (slot.seq.load(std::memory_order_acquire) != m_tail + 1) {
+            break;
+        }
+        auto logger = std::move(slot.logger);
+        auto event = std::move(slot.event);
+        auto level = slot.level;
+        slot.seq.store(m_tail + m_mask + 1, std::memory_order_release);
+        ++m_tail;
+        write(logger, level, event);
+        ++n;
+    }
+    return n;
+}
+
+void AsyncLogAppender::write(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
+    for (auto& i : m_appenders) {
+        i->log(logger, level, event);
+    }
+}
+
+void AsyncLogAppender::run() {
+    uint64_t reported = 0;
+    while (m_running.load(std::memory_order_acquire)) {
+        if (drain() == 0) {
+            usleep(m_flushMs * 1000);
+        }
+        uint64_t dropped = getDropped();
+        if (dropped != reported) {
+            CHAT_LOG_WARN(g_logger) << "async log queue full, dropped "
+                << (dropped - reported) << " events, total " << dropped;
+            reported = dropped;
+        }
+    }
+}
+
+void AsyncLogAppender::start(const std::string& name) {
+    if (m_running.exchange(true)) {
+        return;
+    }
+    m_thread.reset(new chat::Thread(std::bind(&AsyncLogAppender::run, this), "log_" + name));
+}
+
+void AsyncLogAppender::stop() {
+    if (!m_running.exchange(false)) {
+        return;
+    }
+    if (m_thread) {
+        m_thread->join();
+        m_thread.reset();
+    }
+    // 等待已通过 m_running 检查的写入方入队完成, 期间持续 drain, 避免队列满时丢弃
+    while (m_writers.load(std::memory_order_acquire)) {
+        if (drain() == 0) {
+            sched_yield();
+        }
+    }
+    drain();
+}
+
+std::string AsyncLogAppender::toYamlString() {
+    YAML::Node node;
+    node["type"] = "AsyncLogAppender";
+    node["capacity"] = m_mask + 1;
+    node["flush_ms"] = m_flushMs;
+    for (auto& i : m_appenders) {
+        node["appenders"].push_back(YAML::Load(i->toYamlString()));
+    }
+    std::stringstream ss;
+    ss << node;
+    return ss.str();
+}
+
+AsyncLogManager::AsyncLogManager() {
+}
+
+void AsyncLogManager::apply() {
+    auto defines = g_async_log_defines->getValue();
+    std::map<std::string, AsyncLogAppender::ptr> appenders;
+    for (auto& i : defines) {
+        auto logger = CHAT_LOG_NAME(i.name);
+        AsyncLogAppender::ptr ap(new AsyncLogAppender(i.capacity, i.flush_ms));
+        for (auto& a : i.appenders) {
+            LogAppender::ptr inner;
+            if (a.type == 1) {
+                inner.reset(new FileLogAppender(a.file));
+            } else if (a.type == 2) {
+                inner.reset(new StdoutLogAppender);
+            } else {
+                continue;
+            }
+            LogFormatter::ptr fmt = logger->getFormatter();
+            if (!a.formatter.empty()) {
+                LogFormatter::ptr f(new LogFormatter(a.formatter));
+                if (f->isError()) {
+                    std::cout << "async log name=" << i.name << " appender formatter="
+                        << a.formatter << " is invalid" << std::endl;
+                } else {
+                    fmt = f;
+                }
+            }
+            inner->setFormatter(fmt);
+            ap->addAppender(inner);
+        }
+        logger->clearAppenders();
+        logger->addAppender(ap);
+        appenders[i.name] = ap;
+    }
+
+    chat::Mutex::Lock lock(m_mutex);
+    m_appenders.swap(appenders);
+    if (m_started) {
+        for (auto& i : m_appenders) {
+            i.second->start(i.first);
+        }
+    }
+    lock.unlock();
+    // 旧的 appender 已从 logger 摘下, 写完剩余日志后释放
+    for (auto& i : appenders) {
+        i.second->stop();
+    }
+}
+
+void AsyncLogManager::start() {
+    // logs 与 async_logs 的监听顺序不确定, 启动前重新安装一次
+    apply();
+    chat::Mutex::Lock lock(m_mutex);
+    m_started = true;
+    for (auto& i : m_appenders) {
+        i.second->start(i.first);
+    }
+}
+
+void AsyncLogManager::stop() {
+    chat::Mutex::Lock lock(m_mutex);
+    m_started = false;
+    for (auto& i : m_appenders) {
+        i.second->stop();
+    }
+}
+
+}
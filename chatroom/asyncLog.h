@@ -0,0 +1,122 @@
+#ifndef __CHAT_ASYNC_LOG_H__
+#define __CHAT_ASYNC_LOG_H__
+
+#include <chat/log.h>
+#include <chat/thread.h>
+#include <chat/mutex.h>
+#include <chat/singleton.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace chat {
+
+// 按调用点采样/限流, 参数来自 log.yml 的 log_samples
+// every: 每 every 条只输出 1 条; rate: 每秒最多输出 rate 条, 0 不限制
+class LogSampler {
+public:
+    LogSampler(const std::string& name);
+
+    /// 本次是否输出, 无锁
+    bool hit();
+    void set(uint32_t every, uint32_t rate);
+
+    const std::string& getName() const { return m_name;}
+    uint64_t getSuppressed() const { return m_suppressed.load(std::memory_order_relaxed);}
+
+    /// 按名字取采样器, 同名返回同一个, 生命周期与进程相同
+    static LogSampler* Get(const std::string& name);
+private:
+    std::string m_name;
+    std::atomic<uint32_t> m_every{1};
+    std::atomic<uint32_t> m_rate{0};
+    std::atomic<uint64_t> m_count{0};
+    // 当前限流窗口(秒)及窗口内已输出条数
+    std::atomic<uint64_t> m_window{0};
+    std::atomic<uint32_t> m_windowCount{0};
+    std::atomic<uint64_t> m_suppressed{0};
+};
+
+// 带采样的日志, site 为字符串字面量, 每个调用点只查找一次采样器
+#define CHAT_LOG_SAMPLE(logger, level, site) \
+    if (logger->getLevel() <= level && []() { \
+            static chat::LogSampler* s_sampler = chat::LogSampler::Get(site); \
+            return s_sampler; \
+        }()->hit()) \
+        CHAT_LOG_LEVEL(logger, level)
+
+#define CHAT_LOG_SAMPLE_DEBUG(logger, site) CHAT_LOG_SAMPLE(logger, chat::LogLevel::DEBUG, site)
+#define CHAT_LOG_SAMPLE_INFO(logger, site) CHAT_LOG_SAMPLE(logger, chat::LogLevel::INFO, site)
+#define CHAT_LOG_SAMPLE_WARN(logger, site) CHAT_LOG_SAMPLE(logger, chat::LogLevel::WARN, site)
+
+// 异步日志输出: 调用线程只把 LogEvent 放入无锁环形队列, 格式化和写文件由后台线程完成
+// 队列满时丢弃并计数, 不阻塞调用方; start 之前同步写出
+class AsyncLogAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<AsyncLogAppender> ptr;
+
+    /// capacity 向上取整为 2 的幂
+    AsyncLogAppender(size_t capacity, uint32_t flush_ms);
+    ~AsyncLogAppender();
+
+    /// 实际的输出目标, 需在 start 之前添加
+    void addAppender(LogAppender::ptr appender);
+
+    void log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override;
+    std::string toYamlString() override;
+
+    void start(const std::string& name);
+    /// 停止后台线程并写出队列中剩余的日志
+    void stop();
+
+    uint64_t getDropped() const { return m_dropped.load(std::memory_order_relaxed);}
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        std::shared_ptr<Logger> logger;
+        LogLevel::Level level;
+        LogEvent::ptr event;
+    };
+
+    bool push(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
+    /// 单消费者, 只在后台线程或 stop 中调用
+    size_t drain();
+    void write(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
+    void run();
+private:
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask;
+    uint32_t m_flushMs;
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) size_t m_tail = 0;
+    std::atomic<uint64_t> m_dropped{0};
+    std::atomic<bool> m_running{false};
+    // 已通过 m_running 检查, 尚未完成入队的写入方数量
+    std::atomic<uint32_t> m_writers{0};
+    std::vector<LogAppender::ptr> m_appenders;
+    chat::Thread::ptr m_thread;
+};
+
+// 按 async_logs 配置为 logger 安装 AsyncLogAppender
+// 配置加载时即安装(同步写出), Application::main 中 start 后切换为异步
+class AsyncLogManager {
+public:
+    AsyncLogManager();
+
+    /// 按当前配置重新安装, 已启动时同时启动新的 appender
+    void apply();
+    void start();
+    void stop();
+private:
+    chat::Mutex m_mutex;
+    bool m_started = false;
+    std::map<std::string, AsyncLogAppender::ptr> m_appenders;
+};
+
+typedef chat::Singleton<AsyncLogManager> AsyncLogMgr;
+
+}
+
+#endif
@@ -0,0 +1,392 @@
+#include "binLog.h"
+#include <chat/config.h>
+#include <chat/mutex.h>
+#include <chat/thread.h>
+#include <fstream>
+#include <unistd.h>
+
+namespace chat {
+
+static chat::Logger::ptr g_logger = CHAT_LOG_NAME("system");
+
+static chat::ConfigVar<bool>::ptr g_binlog_enable =
+    chat::Config::Lookup("binlog.enable"
+            ,false
+            , "write hot path logs in binary format");
+
+static chat::ConfigVar<std::string>::ptr g_binlog_path =
+    chat::Config::Lookup("binlog.path"
+            ,std::string("/apps/logs/chatroom/chat.blog")
+            , "binary log file path");
+
+static chat::ConfigVar<uint32_t>::ptr g_binlog_buffer_bytes =
+    chat::Config::Lookup("binlog.buffer_bytes"
+            ,(uint32_t)(1024 * 1024)
+            , "per thread binary log buffer bytes");
+
+static chat::ConfigVar<uint32_t>::ptr g_binlog_flush_ms =
+    chat::Config::Lookup("binlog.flush_ms"
+            ,(uint32_t)50
+            , "binary log flush interval ms");
+
+const char BinLog::MAGIC[8] = {'C', 'H', 'A', 'T', 'B', 'L', 'G', '1'};
+std::atomic<bool> BinLog::s_enabled{false};
+
+namespace {
+
+// 每个线程一块缓冲, 写入方与后台线程只在交换缓冲时竞争同一把锁
+struct ThreadBuffer {
+    typedef std::shared_ptr<ThreadBuffer> ptr;
+    chat::Spinlock mutex;
+    std::string buf;
+    uint64_t dropped = 0;
+    uint32_t tid = 0;
+};
+
+struct BinLogContext {
+    chat::Mutex mutex;
+    std::vector<BinLogFormat> formats;
+    std::vector<ThreadBuffer::ptr> buffers;
+    size_t capacity = 0;
+    uint32_t flush_ms = 50;
+
+    // 以下只由后台线程和 Stop 访问
+    std::ofstream ofs;
+    size_t written_formats = 0;
+    std::atomic<bool> running{false};
+    chat::Thread::ptr thread;
+};
+
+}
+
+static BinLogContext& GetContext() {
+    static BinLogContext s_ctx;
+    return s_ctx;
+}
+
+static thread_local ThreadBuffer::ptr t_buffer;
+
+static ThreadBuffer* GetThreadBuffer() {
+    if (!t_buffer) {
+        auto& ctx = GetContext();
+        t_buffer = std::make_shared<ThreadBuffer>();
+        t_buffer->tid = chat::GetThreadId();
+        chat::Mutex::Lock lock(ctx.mutex);
+        t_buffer->buf.reserve(ctx.capacity);
+        ctx.buffers.push_back(t_buffer);
+    }
+    return t_buffer.get();
+}
+
+uint16_t BinLog::Register(LogLevel::Level level, const char* file, int32_t line, const char* fmt) {
+    auto& ctx = GetContext();
+    chat::Mutex::Lock lock(ctx.mutex);
+    BinLogFormat f;
+    f.id = ctx.formats.size() + 1;
+    f.level = level;
+    f.line = line;
+    f.file = file;
+    f.fmt = fmt;
+    ctx.formats.push_back(f);
+    return f.id;
+}
+
+char* BinLog::Reserve(size_t size) {
+    auto tb = GetThreadBuffer();
+    tb->mutex.lock();
+    size_t used = tb->buf.size();
+    if (used + size > GetContext().capacity) {
+        ++tb->dropped;
+        tb->mutex.unlock();
+        return nullptr;
+    }
+    tb->buf.resize(used + size);
+    return &tb->buf[used];
+}
+
+void BinLog::Commit() {
+    t_buffer->mutex.unlock();
+}
+
+template<class T>
+static void WriteInt(std::ostream& os, T v) {
+    os.write((const char*)&v, sizeof(v));
+}
+
+static void WriteStr(std::ostream& os, const std::string& v) {
+    WriteInt(os, (uint16_t)v.size());
+    os.write(v.data(), v.size());
+}
+
+static void WriteFormat(std::ostream& os, const BinLogFormat& f) {
+    WriteInt(os, (uint8_t)BinLog::FORMAT);
+    WriteInt(os, f.id);
+    WriteInt(os, (uint8_t)f.level);
+    WriteInt(os, (uint32_t)f.line);
+    WriteStr(os, f.file);
+    WriteStr(os, f.fmt);
+}
+
+static void Flush() {
+    auto& ctx = GetContext();
+    std::vector<ThreadBuffer::ptr> buffers;
+    {
+        chat::Mutex::Lock lock(ctx.mutex);
+        // 线程退出后只剩这里持有缓冲, 写完最后一次即移除
+        buffers = ctx.buffers;
+        for (auto it = ctx.buffers.begin(); it != ctx.buffers.end();) {
+            if (it->use_count() == 2) {
+                it = ctx.buffers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // 先换出缓冲再取格式: 缓冲中的记录在写入前已注册格式, 之后取到的格式一定覆盖它们
+    std::vector<std::pair<std::string, uint64_t> > datas(buffers.size());
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        auto& b = buffers[i];
+        datas[i].first.reserve(ctx.capacity);
+        b->mutex.lock();
+        datas[i].first.swap(b->buf);
+        datas[i].second = b->dropped;
+        b->dropped = 0;
+        b->mutex.unlock();
+    }
+
+    std::vector<BinLogFormat> formats;
+    {
+        chat::Mutex::Lock lock(ctx.mutex);
+        formats.assign(ctx.formats.begin() + ctx.written_formats, ctx.formats.end());
+        ctx.written_formats = ctx.formats.size();
+    }
+    for (auto& f : formats) {
+        WriteFormat(ctx.ofs, f);
+    }
+
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        auto& data = datas[i].first;
+        ctx.ofs.write(data.data(), data.size());
+        if (datas[i].second) {
+            WriteInt(ctx.ofs, (uint8_t)BinLog::DROPPED);
+            WriteInt(ctx.ofs, buffers[i]->tid);
+            WriteInt(ctx.ofs, datas[i].second);
+        }
+    }
+    ctx.ofs.flush();
+}
+
+static void Run() {
+    auto& ctx = GetContext();
+    while (ctx.running.load(std::memory_order_acquire)) {
+        Flush();
+        usleep(ctx.flush_ms * 1000);
+    }
+}
+
+void BinLog::Start() {
+    auto& ctx = GetContext();
+    if (!g_binlog_enable->getValue() || ctx.running) {
+        return;
+    }
+    {
+        chat::Mutex::Lock lock(ctx.mutex);
+        ctx.capacity = g_binlog_buffer_bytes->getValue();
+        ctx.flush_ms = g_binlog_flush_ms->getValue() ? g_binlog_flush_ms->getValue() : 1;
+        for (auto& b : ctx.buffers) {
+            b->buf.reserve(ctx.capacity);
+        }
+    }
+    // 每次启动追加一个文件头, 格式 id 只在同一段内有效
+    ctx.ofs.open(g_binlog_path->getValue(), std::ios::app | std::ios::binary);
+    if (!ctx.ofs) {
+        CHAT_LOG_ERROR(g_logger) << "open binlog file " << g_binlog_path->getValue()
+            << " failed, use text log";
+        return;
+    }
+    ctx.ofs.write(MAGIC, sizeof(MAGIC));
+    ctx.written_formats = 0;
+    ctx.running = true;
+    ctx.thread.reset(new chat::Thread(&Run, "binlog"));
+    s_enabled = true;
+    CHAT_LOG_INFO(g_logger) << "binlog started, path=" << g_binlog_path->getValue();
+}
+
+void BinLog::Stop() {
+    auto& ctx = GetContext();
+    if (!ctx.running.exchange(false)) {
+        return;
+    }
+    s_enabled = false;
+    ctx.thread->join();
+    ctx.thread.reset();
+    Flush();
+    ctx.ofs.close();
+}
+
+BinLogReader::BinLogReader(std::istream& is)
+    :m_is(is) {
+}
+
+template<class T>
+static bool ReadInt(std::istream& is, T& v) {
+    return (bool)is.read((char*)&v, sizeof(v));
+}
+
+static bool ReadStr(std::istream& is, std::string& v) {
+    uint16_t len = 0;
+    if (!ReadInt(is, len)) {
+        return false;
+    }
+    v.resize(len);
+    return (bool)is.read(&v[0], len);
+}
+
+bool BinLogReader::readFormat() {
+    BinLogFormat f;
+    uint8_t level = 0;
+    uint32_t line = 0;
+    if (!ReadInt(m_is, f.id) || !ReadInt(m_is, level) || !ReadInt(m_is, line)
+            || !ReadStr(m_is, f.file) || !ReadStr(m_is, f.fmt)) {
+        m_error = "truncated format";
+        return false;
+    }
+    f.level = (LogLevel::Level)level;
+    f.line = line;
+    if (m_formats.size() < (size_t)f.id + 1) {
+        m_formats.resize(f.id + 1);
+    }
+    m_formats[f.id] = f;
+    return true;
+}
+
+bool BinLogReader::next(std::string& out) {
+    while (true) {
+        uint8_t kind = 0;
+        if (!ReadInt(m_is, kind)) {
+            return false;
+        }
+        if (kind == (uint8_t)BinLog::MAGIC[0]) {
+            char magic[sizeof(BinLog::MAGIC)] = {(char)kind};
+            if (!m_is.read(magic + 1, sizeof(magic) - 1)
+                    || memcmp(magic, BinLog::MAGIC, sizeof(magic))) {
+                m_error = "invalid file header";
+                return false;
+            }
+            m_formats.clear();
+            m_header = true;
+            continue;
+        }
+        if (!m_header) {
+            m_error = "invalid file header";
+            return false;
+        }
+        if (kind == BinLog::FORMAT) {
+            if (!readFormat()) {
+                return false;
+            }
+            continue;
+        }
+        if (kind == BinLog::DROPPED) {
+            uint32_t tid = 0;
+            uint64_t count = 0;
+            if (!ReadInt(m_is, tid) || !ReadInt(m_is, count)) {
+                m_error = "truncated dropped record";
+                return false;
+            }
+            out = "thread " + std::to_string(tid) + " dropped " + std::to_string(count) + " records";
+            return true;
+        }
+        if (kind != BinLog::RECORD) {
+            m_error = "unknown record kind " + std::to_string(kind);
+            return false;
+        }
+
+        uint16_t id = 0;
+        uint64_t ts = 0;
+        uint32_t tid = 0;
+        uint32_t len = 0;
+        if (!ReadInt(m_is, id) || !ReadInt(m_is, ts) || !ReadInt(m_is, tid) || !ReadInt(m_is, len)) {
+            m_error = "truncated record";
+            return false;
+        }
+        std::string args(len, '\0');
+        if (!m_is.read(&args[0], len)) {
+            m_error = "truncated record";
+            return false;
+        }
+        if (id >= m_formats.size() || m_formats[id].id != id) {
+            m_error = "unknown format id " + std::to_string(id);
+            return false;
+        }
+        return render(m_formats[id], ts, tid, args, out);
+    }
+}
+
+bool BinLogReader::render(const BinLogFormat& fmt, uint64_t ts, uint32_t tid
+                          ,std::string_view args, std::string& out) {
+    char us[8];
+    snprintf(us, sizeof(us), ".%06u", (uint32_t)(ts % 1000000));
+    std::stringstream ss;
+    ss << chat::Time2Str(ts / 1000000) << us
+       << "\t" << tid
+       << "\t[" << LogLevel::ToString(fmt.level) << "]"
+       << "\t" << fmt.file << ":" << fmt.line << "\t";
+
+    size_t pos = 0;
+    std::string_view f = fmt.fmt;
+    while (true) {
+        size_t holder = f.find("{}");
+        if (holder == std::string_view::npos || pos >= args.size()) {
+            ss << f;
+            break;
+        }
+        ss << f.substr(0, holder);
+        f.remove_prefix(holder + 2);
+
+        uint8_t tag = args[pos++];
+        if (tag == BinLog::STR) {
+            uint32_t len = 0;
+            if (pos + sizeof(len) > args.size()) {
+                break;
+            }
+            memcpy(&len, args.data() + pos, sizeof(len));
+            pos += sizeof(len);
+            if (pos + len > args.size()) {
+                break;
+            }
+            ss << args.substr(pos, len);
+            pos += len;
+            continue;
+        }
+        if (pos + 8 > args.size()) {
+            break;
+        }
+        if (tag == BinLog::I64) {
+            int64_t v;
+            memcpy(&v, args.data() + pos, 8);
+            ss << v;
+        } else if (tag == BinLog::U64) {
+            uint64_t v;
+            memcpy(&v, args.data() + pos, 8);
+            ss << v;
+        } else if (tag == BinLog::F64) {
+            double v;
+            memcpy(&v, args.data() + pos, 8);
+            ss << v;
+        } else if (tag == BinLog::PTR) {
+            uint64_t v;
+            memcpy(&v, args.data() + pos, 8);
+            ss << (void*)(uintptr_t)v;
+        } else {
+            m_error = "unknown argument tag " + std::to_string(tag);
+            return false;
+        }
+        pos += 8;
+    }
+    out = ss.str();
+    return true;
+}
+
+}
@@ -0,0 +1,205 @@
+#ifndef __CHAT_BIN_LOG_H__
+#define __CHAT_BIN_LOG_H__
+
+#include "asyncLog.h"
+#include <chat/log.h>
+#include <chat/util.h>
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include <string.h>
+
+namespace chat {
+
+// 二进制日志, 调用点只记录格式 id 和原始参数, 文本由 logdecode 离线还原
+// 文件格式(本机字节序, 只在同一架构上解码):
+//   "CHATBLG1"
+//   格式定义: u8 1 | u16 id | u8 level | u32 line | u16 len | file | u16 len | fmt
+//   日志记录: u8 2 | u16 id | u64 time_us | u32 tid | u32 len | args
+//   丢弃计数: u8 3 | u32 tid | u64 count
+// 参数: u8 tag | 值, 字符串为 u32 len | bytes
+class BinLog {
+public:
+    enum Kind {
+        FORMAT = 1,
+        RECORD = 2,
+        DROPPED = 3
+    };
+
+    enum Tag {
+        I64 = 1,
+        U64 = 2,
+        F64 = 3,
+        STR = 4,
+        PTR = 5
+    };
+
+    static const char MAGIC[8];
+
+    /// 注册调用点的格式串, fmt 中每个 {} 对应一个参数, 返回格式 id
+    static uint16_t Register(LogLevel::Level level, const char* file, int32_t line, const char* fmt);
+    /// start 之后且 binlog.enable 为 true 时返回 true
+    static bool IsEnabled() { return s_enabled.load(std::memory_order_acquire);}
+
+    template<class... Args>
+    static void Write(uint16_t id, const Args&... args) {
+        size_t len = (0 + ... + ArgSize(args));
+        char* p = Reserve(1 + 2 + 8 + 4 + 4 + len);
+        if (!p) {
+            return;
+        }
+        uint8_t kind = RECORD;
+        uint64_t ts = chat::GetCurrentUS();
+        uint32_t tid = chat::GetThreadId();
+        uint32_t args_len = len;
+        p = Put(p, kind);
+        p = Put(p, id);
+        p = Put(p, ts);
+        p = Put(p, tid);
+        p = Put(p, args_len);
+        ((p = PutArg(p, args)), ...);
+        Commit();
+    }
+
+    /// 文本模式下按同一格式串渲染, {} 依次替换为参数
+    template<class... Args>
+    static std::string Format(const char* fmt, const Args&... args) {
+        std::stringstream ss;
+        const char* p = fmt;
+        ((p = FormatNext(ss, p, args)), ...);
+        ss << p;
+        return ss.str();
+    }
+
+    /// 启动后台写文件线程, 在 daemon fork 之后调用
+    static void Start();
+    /// 停止并写出所有线程缓冲中剩余的日志
+    static void Stop();
+private:
+    template<class T>
+    static char* Put(char* p, const T& v) {
+        memcpy(p, &v, sizeof(v));
+        return p + sizeof(v);
+    }
+
+    static size_t ArgSize(std::string_view v) { return 1 + 4 + v.size();}
+    static size_t ArgSize(const std::string& v) { return 1 + 4 + v.size();}
+    static size_t ArgSize(const char* v) { return 1 + 4 + strlen(v);}
+    template<class T>
+    static size_t ArgSize(const std::shared_ptr<T>& v) { return 1 + 8;}
+    template<class T>
+    static size_t ArgSize(const T& v) {
+        static_assert(std::is_arithmetic<T>::value || std::is_pointer<T>::value
+                      || std::is_enum<T>::value, "unsupported binlog argument type");
+        return 1 + 8;
+    }
+
+    static char* PutStr(char* p, std::string_view v) {
+        uint8_t tag = STR;
+        uint32_t len = v.size();
+        p = Put(p, tag);
+        p = Put(p, len);
+        memcpy(p, v.data(), v.size());
+        return p + v.size();
+    }
+    static char* PutArg(char* p, std::string_view v) { return PutStr(p, v);}
+    static char* PutArg(char* p, const std::string& v) { return PutStr(p, v);}
+    static char* PutArg(char* p, const char* v) { return PutStr(p, v);}
+    template<class T>
+    static char* PutArg(char* p, const std::shared_ptr<T>& v) {
+        uint8_t tag = PTR;
+        uint64_t val = (uintptr_t)v.get();
+        return Put(Put(p, tag), val);
+    }
+    template<class T>
+    static char* PutArg(char* p, const T& v) {
+        if constexpr (std::is_pointer<T>::value) {
+            uint8_t tag = PTR;
+            uint64_t val = (uintptr_t)v;
+            return Put(Put(p, tag), val);
+        } else if constexpr (std::is_floating_point<T>::value) {
+            uint8_t tag = F64;
+            double val = v;
+            return Put(Put(p, tag), val);
+        } else if constexpr (std::is_signed<T>::value) {
+            uint8_t tag = I64;
+            int64_t val = v;
+            return Put(Put(p, tag), val);
+        } else {
+            uint8_t tag = U64;
+            uint64_t val = (uint64_t)v;
+            return Put(Put(p, tag), val);
+        }
+    }
+
+    template<class T>
+    static const char* FormatNext(std::stringstream& ss, const char* p, const T& v) {
+        const char* pos = strstr(p, "{}");
+        if (!pos) {
+            return p;
+        }
+        ss.write(p, pos - p);
+        ss << v;
+        return pos + 2;
+    }
+
+    /// 在当前线程缓冲中预留 size 字节, 缓冲满时计入丢弃并返回 nullptr
+    static char* Reserve(size_t size);
+    static void Commit();
+private:
+    static std::atomic<bool> s_enabled;
+};
+
+// 单条格式定义, logdecode 用
+struct BinLogFormat {
+    uint16_t id = 0;
+    LogLevel::Level level = LogLevel::INFO;
+    int32_t line = 0;
+    std::string file;
+    std::string fmt;
+};
+
+// 顺序读取二进制日志文件, 逐条渲染为文本
+class BinLogReader {
+public:
+    BinLogReader(std::istream& is);
+
+    /// 读入下一条日志并渲染到 out, 文件结束或格式错误返回 false
+    bool next(std::string& out);
+    const std::string& getError() const { return m_error;}
+private:
+    bool readFormat();
+    bool render(const BinLogFormat& fmt, uint64_t ts, uint32_t tid
+                ,std::string_view args, std::string& out);
+private:
+    std::istream& m_is;
+    std::vector<BinLogFormat> m_formats;
+    std::string m_error;
+    bool m_header = false;
+};
+
+}
+
+// 调用点: 二进制模式下记录格式 id 和参数; 否则渲染成文本, 按 site 采样后交给 logger
+#define CHAT_BINLOG(logger, level, site, fmt, ...) \
+    do { \
+        if (!(logger->getLevel() <= level)) { \
+            break; \
+        } \
+        if (chat::BinLog::IsEnabled()) { \
+            static const uint16_t s_binlog_id = chat::BinLog::Register(level, __FILE__, __LINE__, fmt); \
+            chat::BinLog::Write(s_binlog_id, ##__VA_ARGS__); \
+        } else { \
+            CHAT_LOG_SAMPLE(logger, level, site) << chat::BinLog::Format(fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define CHAT_BINLOG_DEBUG(logger, site, fmt, ...) CHAT_BINLOG(logger, chat::LogLevel::DEBUG, site, fmt, ##__VA_ARGS__)
+#define CHAT_BINLOG_INFO(logger, site, fmt, ...) CHAT_BINLOG(logger, chat::LogLevel::INFO, site, fmt, ##__VA_ARGS__)
+#define CHAT_BINLOG_WARN(logger, site, fmt, ...) CHAT_BINLOG(logger, chat::LogLevel::WARN, site, fmt, ##__VA_ARGS__)
+
+#endif
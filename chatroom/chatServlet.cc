@@ -1,202 +1,819 @@
 #include "chatServlet.h"
 #include <chat/log.h>
 #include <chat/util.h>
-#include "json.hpp"
+#include <chat/config.h>
+#include "jsonStream.h"
+#include "binLog.h"
+#include "metrics.h"
+#include "messageTrace.h"
 
 namespace chat {
 namespace http {
 
 static chat::Logger::ptr g_logger = CHAT_LOG_ROOT();
 
+static chat::ConfigVar<uint32_t>::ptr g_session_shards =
+    chat::Config::Lookup("chat.session_shards"
+            ,(uint32_t)16
+            , "session registry shard count");
+
+static chat::ConfigVar<uint32_t>::ptr g_presence_batch_ms =
+    chat::Config::Lookup("chat.presence.batch_ms"
+            ,(uint32_t)50
+            , "merge presence changes within ms into one user_change_batch, 0 send each immediately");
+
+static chat::ConfigVar<bool>::ptr g_history_enable =
+    chat::Config::Lookup("chat.history.enable"
+            ,true
+            , "persist chat messages and serve history_request");
+
+static chat::ConfigVar<std::string>::ptr g_history_path =
+    chat::Config::Lookup("chat.history.path"
+            ,std::string("history")
+            , "message history directory, relative to the working directory");
+
+static chat::ConfigVar<bool>::ptr g_history_private =
+    chat::Config::Lookup("chat.history.private"
+            ,false
+            , "persist and serve private chat history, only safe when login names are authenticated");
+
+static chat::ConfigVar<uint32_t>::ptr g_history_page =
+    chat::Config::Lookup("chat.history.page_size"
+            ,(uint32_t)50
+            , "messages per history_response when the request has no limit");
+
+static chat::ConfigVar<uint32_t>::ptr g_history_max_page =
+    chat::Config::Lookup("chat.history.max_page_size"
+            ,(uint32_t)200
+            , "max messages per history_response");
+
+static chat::Gauge::ptr s_sessions_connected = chat::MetricsMgr::GetInstance()->getGauge(
+        "chat_sessions_connected", "open websocket connections");
+static chat::Gauge::ptr s_users_online = chat::MetricsMgr::GetInstance()->getGauge(
+        "chat_users_online", "logged in users");
+static chat::Counter::ptr s_send_failures = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_send_failures_total", "SendMessage calls on closed sessions or failed writes");
+static chat::Counter::ptr s_roster_rebuilds = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_roster_rebuilds_total", "chat_init_response roster cache rebuilds");
+static chat::Counter::ptr s_roster_full = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_roster_sync_total", "chat_init_request replies by kind", "kind=\"full\"");
+static chat::Counter::ptr s_roster_delta = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_roster_sync_total", "chat_init_request replies by kind", "kind=\"delta\"");
+static chat::Histogram::ptr s_presence_batch = chat::MetricsMgr::GetInstance()->getHistogram(
+        "chat_presence_batch_size", "presence changes per user_change_batch");
+static chat::Gauge::ptr s_rooms = chat::MetricsMgr::GetInstance()->getGauge(
+        "chat_rooms", "rooms with at least one member");
+
+// 按 MessageType 下标, 0 为无法识别的类型
+static std::vector<chat::Counter::ptr> s_messages = [](){
+    std::vector<chat::Counter::ptr> v(MessageType::TYPE_COUNT);
+    for (int i = 0; i < MessageType::TYPE_COUNT; ++i) {
+        std::string name = i == MessageType::UNKNOWN ? "unknown" : MessageType::ToString((MessageType::Type)i);
+        v[i] = chat::MetricsMgr::GetInstance()->getCounter("chat_messages_received_total"
+                , "inbound messages by type", "type=\"" + name + "\"");
+    }
+    return v;
+}();
+
+
+// 私聊主题, 只有该用户自己订阅
+static std::string UserTopic(std::string_view id) {
+    return "user:" + std::string(id);
+}
 
 bool ChatWSServlet::session_exists(const std::string& id) {
-    CHAT_LOG_INFO(g_logger) << "session_exists id=" << id;
-    chat::RWMutex::ReadLock lock(m_mutex);
-    auto it = m_sessions.find(id);
-    return it != m_sessions.end();
+    CHAT_BINLOG_INFO(g_logger, "chat.session", "session_exists id={}", id);
+    return m_registry->exists(id);
+}
+
+void ChatWSServlet::closeAll() {
+    std::vector<ChatSession::ptr> conns;
+    m_registry->listConns(conns);
+    CHAT_LOG_INFO(g_logger) << "close all connections, count=" << conns.size();
+    for (auto& conn : conns) {
+        // 关闭 socket 唤醒等待读的协程, 读失败后连接照常结束
+        conn->close();
+        conn->getSession()->close();
+    }
 }
 
 void ChatWSServlet::session_add(const std::string& id, WSSession::ptr session) {
-    CHAT_LOG_INFO(g_logger) << "session_add id=" << id;
-    chat::RWMutex::WriteLock lock(m_mutex);
-    m_sessions[id] = session;
+    CHAT_BINLOG_INFO(g_logger, "chat.session", "session_add id={}", id);
+    m_registry->add(id, session);
+    s_users_online->set(m_registry->size());
+    auto conn = m_registry->get(id);
+    m_pubsub->subscribe("all", id, conn);
+    m_pubsub->subscribe("presence", id, conn);
+    m_pubsub->subscribe(UserTopic(id), id, conn);
 }
 
 std::string ChatWSServlet::session_find(WSSession::ptr session) {
-    CHAT_LOG_INFO(g_logger) << "session_find session=" << session;
-    chat::RWMutex::ReadLock lock(m_mutex);
-    for (auto& c : m_sessions) {
-        if (c.second == session) {
-            return c.first;
-        }
-    }
-    return "";
+    CHAT_BINLOG_INFO(g_logger, "chat.session", "session_find session={}", session);
+    return m_registry->find(session);
 }
 
 void ChatWSServlet::session_del(const std::string& id) {
-    CHAT_LOG_INFO(g_logger) << "session_del del=" << id;
-    chat::RWMutex::WriteLock lock(m_mutex);
-    m_sessions.erase(id);
-    m_users.erase(id);
+    CHAT_BINLOG_INFO(g_logger, "chat.session", "session_del del={}", id);
+    m_registry->del(id);
+    s_users_online->set(m_registry->size());
+    m_pubsub->unsubscribeAll(id);
 }
 
 int32_t ChatWSServlet::SendMessage(WSSession::ptr session, ChatMessage::ptr msg) {
-    CHAT_LOG_INFO(g_logger) << msg->toString() << " - " << session;
-    return session->sendMessage(msg->toString()) > 0 ? 0 : 1;
+    auto conn = m_registry->getConn(session);
+    if (!conn) {
+        auto frame = msg->toFrame(ChatMessage::JSON);
+        CHAT_BINLOG_INFO(g_logger, "chat.send", "{} - {}", frame->getPayload(), session);
+        if (frame->writeTo(session) <= 0) {
+            s_send_failures->inc();
+            return 1;
+        }
+        if (frame->getTrace()) {
+            frame->getTrace()->onWrite(chat::MonotonicNs());
+        }
+        return 0;
+    }
+    return SendMessage(conn, msg);
+}
+
+int32_t ChatWSServlet::SendMessage(ChatSession::ptr conn, ChatMessage::ptr msg) {
+    auto frame = msg->toFrame(conn->getEncoding());
+    if (conn->getEncoding() == ChatMessage::JSON) {
+        CHAT_BINLOG_INFO(g_logger, "chat.send", "{} - {}", frame->getPayload(), conn->getSession());
+    }
+    return SendMessage(conn, frame);
 }
 
 int32_t ChatWSServlet::SendMessage(WSSession::ptr session, WSFrameMessage::ptr msg) {
-    CHAT_LOG_INFO(g_logger) << msg->getData() << " - " << session;
-    return session->sendMessage(msg) > 0 ? 0 : 1;
+    CHAT_BINLOG_INFO(g_logger, "chat.send", "{} - {}", msg->getData(), session);
+    return SendMessage(session, WSFrame::Create(msg->getData(), msg->getOpcode()));
 }
 
-void ChatWSServlet::session_notify(ChatMessage::ptr msg, WSSession::ptr session) {
-    chat::RWMutex::ReadLock lock(m_mutex);
-    auto sessions = m_sessions;
-    lock.unlock();
+int32_t ChatWSServlet::SendMessage(WSSession::ptr session, WSFrame::ptr frame) {
+    auto conn = m_registry->getConn(session);
+    if (!conn) {
+        CHAT_BINLOG_INFO(g_logger, "chat.send", "send frame size={} - {}", frame->size(), session);
+        if (frame->writeTo(session) <= 0) {
+            s_send_failures->inc();
+            return 1;
+        }
+        return 0;
+    }
+    return SendMessage(conn, frame);
+}
+
+int32_t ChatWSServlet::SendMessage(ChatSession::ptr conn, WSFrame::ptr frame) {
+    CHAT_BINLOG_DEBUG(g_logger, "chat.send", "send frame size={} - {}", frame->size(), conn->getSession());
+    // 队列满只丢弃该帧, 连接已关闭才返回失败
+    if (conn->send(frame) == -1) {
+        s_send_failures->inc();
+        return 1;
+    }
+    return 0;
+}
+
+void ChatWSServlet::session_notify(ChatMessage::ptr msg, WSSession::ptr session
+                                   ,const std::string& key) {
+    CHAT_BINLOG_INFO(g_logger, "chat.notify", "session_notify type={}", msg->get(ChatMessage::TYPE));
+    m_pubsub->publish(m_allTopic, msg, session, key);
+}
+
+void ChatWSServlet::session_notify(const WSFrame::ptr (&frames)[2], WSSession::ptr session) {
+    m_pubsub->publish(m_allTopic, frames, session);
+}
 
-    for(auto& i : sessions) {
-        if(i.second == session) {
-            continue;
+void ChatWSServlet::room_notify(Room::ptr room, ChatMessage::ptr msg, WSSession::ptr session) {
+    // 只遍历房间成员, 与在线总人数无关
+    m_pubsub->publish(room->getTopic(), msg, session);
+}
+
+// 用户变化列表编码成一帧, version 为 0 时不带版本号
+static WSFrame::ptr EncodeChanges(const char* type, ChatMessage::Encoding enc, uint64_t version
+                                  ,const std::vector<RosterChange>& changes
+                                  ,std::shared_ptr<MessageTrace> trace = nullptr) {
+    if (enc == ChatMessage::BINARY) {
+        ChatMessage rsp_bin;
+        rsp_bin.set(ChatMessage::TYPE, type);
+        rsp_bin.set(ChatMessage::TIME, chat::Time2Str());
+        if (version) {
+            rsp_bin.set(ChatMessage::VERSION, std::to_string(version));
         }
-        SendMessage(i.second, msg);
+        rsp_bin.set(ChatMessage::DATA, BinaryProtocol::EncodeChanges(changes));
+        rsp_bin.setTrace(trace);
+        return rsp_bin.toFrame(ChatMessage::BINARY);
+    }
+
+    std::string buf = WSFrame::NewBuffer(96 + changes.size() * 80);
+    JsonWriter w(buf);
+    w.startObject()
+        .kv("type", type)
+        .kv("time", chat::Time2Str());
+    if (version) {
+        w.kv("version", std::to_string(version));
+    }
+    w.key("data").startArray();
+    for (const auto& i : changes) {
+        w.startObject()
+            .kv("id", i.id)
+            .kv("name", i.name)
+            .kv("avatar", i.avatar)
+            .kv("code", i.code == 1 ? "1" : "2")
+            .endObject();
     }
+    w.endArray().endObject();
+    return WSFrame::CreateFromBuffer(std::move(buf), WSFrameHead::TEXT_FRAME, "", trace);
 }
 
-ChatWSServlet::ChatWSServlet(): WSServlet("chat_servlet") {
-    m_users["group"] = std::make_pair("聊天室", "./static/avatar/group.png");
+void ChatWSServlet::presence_notify(const std::string& id, uint8_t code, const std::string& name
+                                    ,const std::string& avatar, WSSession::ptr session) {
+    uint32_t batch_ms = g_presence_batch_ms->getValue();
+    auto iom = chat::IOManager::GetThis();
+    if (batch_ms == 0 || !iom) {
+        ChatMessage::ptr nty(new ChatMessage);
+        nty->set(ChatMessage::TYPE, "user_change_response");
+        nty->set(ChatMessage::TIME, chat::Time2Str());
+        nty->set(ChatMessage::CODE, code == 1 ? "1" : "2");
+        nty->set(ChatMessage::ID, id);
+        nty->set(ChatMessage::NAME, name);
+        if (!avatar.empty()) {
+            nty->set(ChatMessage::AVATAR, avatar);
+        }
+        m_pubsub->publish(m_presenceTopic, nty, session, "presence:" + id);
+        return;
+    }
+
+    // 批量模式下上线者自己也会收到包含自己的变化, 由客户端按 id 忽略
+    if (m_presence.add(id, code, name, avatar)) {
+        iom->addTimer(batch_ms, std::bind(&ChatWSServlet::presence_flush, this));
+    }
+}
+
+void ChatWSServlet::presence_flush() {
+    std::vector<RosterChange> changes;
+    m_presence.take(changes);
+    if (changes.empty()) {
+        return;
+    }
+    s_presence_batch->record(changes.size());
+
+    WSFrame::ptr frames[2];
+    frames[ChatMessage::JSON] = EncodeChanges("user_change_batch", ChatMessage::JSON, 0, changes);
+    frames[ChatMessage::BINARY] = EncodeChanges("user_change_batch", ChatMessage::BINARY, 0, changes);
+    CHAT_BINLOG_INFO(g_logger, "chat.notify", "presence batch size={}", changes.size());
+    m_pubsub->publish(m_presenceTopic, frames);
+}
+
+ChatWSServlet::ChatWSServlet()
+    :WSServlet("chat_servlet")
+    ,m_registry(std::make_shared<SessionRegistry>(g_session_shards->getValue()))
+    ,m_pubsub(std::make_shared<PubSub>(g_session_shards->getValue()))
+    ,m_rooms(std::make_shared<RoomManager>(m_pubsub))
+    ,m_history(g_history_enable->getValue() ? std::make_shared<MessageStore>(g_history_path->getValue()) : nullptr)
+    ,m_allTopic(m_pubsub->getTopic("all", true, true))
+    ,m_presenceTopic(m_pubsub->getTopic("presence", true, true)) {
+    m_registry->addInfo("group", "聊天室", "./static/avatar/group.png");
+
+#define XX(type, fun) \
+    registerHandler(MessageType::type, std::bind(&ChatWSServlet::fun, this \
+                ,std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+    XX(LOGIN_REQUEST, login_request);
+    XX(CHAT_INIT_REQUEST, chat_init_request);
+    XX(CHAT_REQUEST, chat_request);
+    XX(ROOM_CREATE_REQUEST, room_create_request);
+    XX(ROOM_JOIN_REQUEST, room_join_request);
+    XX(ROOM_LEAVE_REQUEST, room_leave_request);
+    XX(ROOM_LIST_REQUEST, room_list_request);
+    XX(HISTORY_REQUEST, history_request);
+#undef XX
+}
+
+void ChatWSServlet::registerHandler(MessageType::Type type, MessageHandler cb) {
+    if (type <= MessageType::UNKNOWN || type >= MessageType::TYPE_COUNT) {
+        CHAT_LOG_ERROR(g_logger) << "registerHandler invalid type=" << (int)type;
+        return;
+    }
+    m_handlers[type] = std::move(cb);
+    MessageTrace::Enable(type);
 }
 
 int32_t ChatWSServlet::onConnect(HttpRequest::ptr header, WSSession::ptr session) {
     CHAT_LOG_INFO(g_logger) << "on Connect " << session;
+    auto conn = m_registry->connect(session, chat::IOManager::GetThis());
+    s_sessions_connected->add(1);
+    // 客户端在 Sec-WebSocket-Protocol 中声明支持二进制协议时使用二进制编码
+    auto protocols = header->getHeader("Sec-WebSocket-Protocol");
+    if (protocols.find(BinaryProtocol::SUBPROTOCOL) != std::string::npos) {
+        conn->setEncoding(ChatMessage::BINARY);
+        CHAT_LOG_INFO(g_logger) << "use binary protocol " << session;
+    }
     return 0;
 }
 
 int32_t ChatWSServlet::onClose(HttpRequest::ptr header, WSSession::ptr session) {
-    auto id = header->getHeader("$id");
+    // 通过反向索引取 id, 被同名新连接顶替的旧 session 查不到, 不会误删新连接
+    auto id = session_find(session);
     CHAT_LOG_INFO(g_logger) << "on Close " << session << " id=" << id;
     if (!id.empty()) {
+        // 先离开房间, 再由 session_del 取消其余订阅
+        auto rooms = m_rooms->leaveAll(id);
+        for (auto& room : rooms) {
+            room_member_notify(room, id, 2, session);
+        }
+        if (!rooms.empty()) {
+            s_rooms->set(m_rooms->size());
+        }
         session_del(id);
-        ChatMessage::ptr nty(new ChatMessage);
-        nty->set("type", "user_change_response");
-        nty->set("time", chat::Time2Str());
-        nty->set("name", id);
-        nty->set("id", id);
-        nty->set("code", "2");
-        session_notify(nty);
+        presence_notify(id, 2, id, "");
+    }
+    auto conn = m_registry->disconnect(session);
+    if (conn) {
+        s_sessions_connected->add(-1);
+        auto stats = conn->getStats();
+        CHAT_LOG_INFO(g_logger) << "outbound stats " << session
+            << " enqueued=" << stats.enqueued
+            << " sent_frames=" << stats.sent_frames
+            << " sent_bytes=" << stats.sent_bytes
+            << " dropped_frames=" << stats.dropped_frames
+            << " dropped_bytes=" << stats.dropped_bytes
+            << " coalesced=" << stats.coalesced
+            << " backlog_peak_bytes=" << stats.backlog_peak_bytes;
     }
     return 0;
 }
 
 int32_t ChatWSServlet::handle(HttpRequest::ptr header, WSFrameMessage::ptr msgx, WSSession::ptr session) {
-    CHAT_LOG_INFO(g_logger) << "handle " << session
-            << " opcode=" << msgx->getOpcode()
-            << " data=" << msgx->getData();
+    uint64_t start_ns = chat::MonotonicNs();
+    CHAT_BINLOG_INFO(g_logger, "chat.handle", "handle {} opcode={} data={}"
+            ,session, msgx->getOpcode(), msgx->getData());
 
-    auto msg = ChatMessage::Create(msgx->getData());
-    auto id = header->getHeader("$id");
+    // 按帧类型解码, 二进制帧走二进制协议, 文本帧走 JSON
+    // 先只取类型查表, 没有处理函数的消息不做完整解码
+    auto enc = msgx->getOpcode() == WSFrameHead::BIN_FRAME ? ChatMessage::BINARY : ChatMessage::JSON;
+    auto type = ChatMessage::PeekType(msgx->getData(), enc);
+    s_messages[type]->inc();
+    auto& cb = m_handlers[type];
+    if (!cb) {
+        CHAT_BINLOG_INFO(g_logger, "chat.handle", "unhandled message type {}", session);
+        return 0;
+    }
+
+    // 帧缓冲直接移交给 ChatMessage, 字段值都是指向它的视图
+    auto msg = ChatMessage::Create(std::move(msgx->getData()), enc);
     if(!msg) {
-        if(!id.empty()) {
-            chat::RWMutex::WriteLock lock(m_mutex);
-            m_sessions.erase(id);
-        }
+        // 返回非 0 后连接关闭, 由 onClose 统一清理 session
         return 1;
     }
+    auto trace = MessageTrace::Create(type, start_ns);
+    if (trace) {
+        trace->mark(MessageTrace::PARSE);
+        msg->setTrace(trace);
+    }
+    return cb(header, msg, session);
+}
 
+int32_t ChatWSServlet::login_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session) {
+    auto id = header->getHeader("$id");
     ChatMessage::ptr rsp(new ChatMessage);
-    auto type = msg->get("type");
-    if (type == "login_request") {
-        rsp->set("type", "login_response");
-        auto name = msg->get("name");
-        auto avatar = msg->get("avatar");
-        if (name.empty()) {
-            rsp->set("result", "400");
-            rsp->set("msg", "name is null");
-            return SendMessage(session, rsp);
+    rsp->set(ChatMessage::TYPE, "login_response");
+    auto name = msg->get(ChatMessage::NAME);
+    auto avatar = msg->get(ChatMessage::AVATAR);
+    if (name.empty()) {
+        rsp->set(ChatMessage::RESULT, "400");
+        rsp->set(ChatMessage::MSG, "name is null");
+        return SendMessage(session, rsp);
+    }
+    // 用户列表的二进制编码中名字/头像为 u16 长度
+    if (name.size() > BinaryProtocol::MAX_STRING_SIZE || avatar.size() > BinaryProtocol::MAX_STRING_SIZE) {
+        rsp->set(ChatMessage::RESULT, "400");
+        rsp->set(ChatMessage::MSG, "name too long");
+        return SendMessage(session, rsp);
+    }
+    if (!id.empty()) {
+        rsp->set(ChatMessage::RESULT, "401");
+        rsp->set(ChatMessage::MSG, "logined");
+        return SendMessage(session, rsp);
+    }
+    if (session_exists(id)) {
+        rsp->set(ChatMessage::RESULT, "402");
+        rsp->set(ChatMessage::MSG, "name exists");
+        return SendMessage(session, rsp);
+    }
+    id = std::string(name);
+    header->setHeader("$id", id);
+    rsp->set(ChatMessage::ID, id);
+    rsp->set(ChatMessage::RESULT, "200");
+    rsp->set(ChatMessage::MSG, "ok");
+    rsp->set(ChatMessage::TIME, chat::Time2Str());
+    rsp->set(ChatMessage::NAME, name);
+    rsp->set(ChatMessage::AVATAR, avatar);
+    session_add(id, session);
+
+    addInfo(id, id, std::string(avatar));
+    rsp->setTrace(msg->getTrace());
+    return SendMessage(session, rsp);
+}
+
+WSFrame::ptr ChatWSServlet::buildRoster(ChatMessage::Encoding enc, uint64_t version
+                                        ,std::shared_ptr<MessageTrace> trace) {
+    std::vector<std::pair<std::string, SessionRegistry::UserInfo> > infos;
+    m_registry->listInfos(infos);
+    for (auto it = infos.begin(); it != infos.end(); ++it) {
+        if (it->first == "group") {
+            infos.erase(it);
+            break;
+        }
+    }
+
+    if (enc == ChatMessage::BINARY) {
+        ChatMessage rsp_bin;
+        rsp_bin.set(ChatMessage::TYPE, "chat_init_response");
+        rsp_bin.set(ChatMessage::TIME, chat::Time2Str());
+        rsp_bin.set(ChatMessage::VERSION, std::to_string(version));
+        rsp_bin.set(ChatMessage::DATA, BinaryProtocol::EncodeUsers(infos));
+        rsp_bin.setTrace(trace);
+        return rsp_bin.toFrame(ChatMessage::BINARY);
+    }
+
+    // 直接写进帧缓冲, 不构建 DOM
+    std::string buf = WSFrame::NewBuffer(64 + infos.size() * 64);
+    JsonWriter w(buf);
+    w.startObject()
+        .kv("type", "chat_init_response")
+        .kv("time", chat::Time2Str())
+        .kv("version", std::to_string(version))
+        .key("data").startArray();
+    for (const auto& info : infos) {
+        w.startObject()
+            .kv("id", info.first)
+            .kv("name", info.second.first)
+            .kv("avatar", info.second.second)
+            .endObject();
+    }
+    w.endArray().endObject();
+    return WSFrame::CreateFromBuffer(std::move(buf), WSFrameHead::TEXT_FRAME, "", trace);
+}
+
+WSFrame::ptr ChatWSServlet::buildDelta(ChatMessage::Encoding enc, uint64_t since
+                                       ,std::shared_ptr<MessageTrace> trace) {
+    std::vector<RosterChange> changes;
+    uint64_t version = 0;
+    if (!m_registry->getChanges(since, changes, version)) {
+        return nullptr;
+    }
+    for (auto it = changes.begin(); it != changes.end(); ++it) {
+        if (it->id == "group") {
+            changes.erase(it);
+            break;
+        }
+    }
+
+    return EncodeChanges("roster_delta_response", enc, version, changes, trace);
+}
+
+WSFrame::ptr ChatWSServlet::getRoster(ChatMessage::Encoding enc) {
+    uint64_t version = m_registry->getInfoVersion();
+    auto cache = std::atomic_load(&m_roster);
+    if (cache && cache->version == version && cache->frames[enc]) {
+        return cache->frames[enc];
+    }
+
+    chat::Mutex::Lock lock(m_rosterMutex);
+    // 版本号在读取用户列表之前取得, 重建期间发生的增删会让下一次请求再次重建
+    version = m_registry->getInfoVersion();
+    cache = std::atomic_load(&m_roster);
+    if (cache && cache->version == version && cache->frames[enc]) {
+        return cache->frames[enc];
+    }
+    std::shared_ptr<RosterCache> next = std::make_shared<RosterCache>();
+    next->version = version;
+    if (cache && cache->version == version) {
+        next->frames[0] = cache->frames[0];
+        next->frames[1] = cache->frames[1];
+    }
+    next->frames[enc] = buildRoster(enc, version);
+    s_roster_rebuilds->inc();
+    std::atomic_store(&m_roster, RosterCache::ptr(next));
+    return next->frames[enc];
+}
+
+int32_t ChatWSServlet::chat_init_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session) {
+    auto id = header->getHeader("$id");
+    int32_t rt = 0;
+    auto conn = m_registry->getConn(session);
+    auto enc = conn ? conn->getEncoding() : ChatMessage::JSON;
+    // 客户端带上次收到的版本号时只发送之后的变化, 版本过旧再退回全量
+    WSFrame::ptr frame;
+    auto since = msg->get(ChatMessage::VERSION);
+    if (!since.empty()) {
+        frame = buildDelta(enc, strtoull(std::string(since).c_str(), nullptr, 10), msg->getTrace());
+    }
+    if (frame) {
+        s_roster_delta->inc();
+    } else {
+        s_roster_full->inc();
+        frame = getRoster(enc);
+        if (msg->getTrace()) {
+            frame = WSFrame::WithTrace(frame, msg->getTrace());
         }
-        if (!id.empty()) {
-            rsp->set("result", "401");
-            rsp->set("msg", "logined");
+    }
+    if (conn) {
+        rt = SendMessage(conn, frame);
+    } else {
+        rt = SendMessage(session, frame);
+    }
+
+    // 未登录的连接只取用户列表, 不广播上线
+    if (!id.empty()) {
+        auto info = getInfo(id);
+        presence_notify(id, 1, info.first, info.second, session);
+    }
+
+    return rt;
+}
+
+int32_t ChatWSServlet::chat_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session) {
+    auto id = header->getHeader("$id");
+    auto rsp = msg;
+    rsp->set(ChatMessage::TYPE, "chat_response");
+    rsp->set(ChatMessage::SERVER, "server");
+    if (id.empty()) {
+        rsp->set(ChatMessage::RESULT, "501");
+        rsp->set(ChatMessage::MSG, "not login");
+        return SendMessage(session, rsp);
+    }
+    rsp->set(ChatMessage::RESULT, "200");
+
+    auto trace = msg->getTrace();
+    if (trace) {
+        trace->mark(MessageTrace::DISPATCH);
+    }
+    auto to = msg->get(ChatMessage::TO);
+    auto room_name = msg->get(ChatMessage::ROOM);
+    std::string history_key;
+    if (!room_name.empty()) {
+        // 只有房间成员可以发言
+        auto room = m_rooms->get(std::string(room_name));
+        if (!room || !room->has(id)) {
+            rsp->set(ChatMessage::RESULT, room ? "403" : "404");
+            rsp->set(ChatMessage::MSG, room ? "not in room" : "room not exists");
             return SendMessage(session, rsp);
         }
-        if (session_exists(id)) {
-            rsp->set("result", "402");
-            rsp->set("msg", "name exists");
+        room_notify(room, rsp, session);
+        history_key = MessageStore::RoomKey(room->getName(), room->getIncarnation());
+    } else if (to == "group") {
+        session_notify(rsp, session);
+        history_key = MessageStore::GroupKey();
+    } else {
+        // 对方没有订阅(不在线或不存在)时告知发送方, 消息不转发也不记录
+        if (m_pubsub->publish(UserTopic(to), rsp) == 0) {
+            rsp->set(ChatMessage::RESULT, "404");
+            rsp->set(ChatMessage::MSG, "user not online");
             return SendMessage(session, rsp);
         }
-        id = name;
-        header->setHeader("$id", id);
-        rsp->set("id", id);
-        rsp->set("result", "200");
-        rsp->set("msg", "ok");
-        rsp->set("time", chat::Time2Str());
-        rsp->set("name", name);
-        rsp->set("avatar", avatar);
-        session_add(name, session);
-
-        addInfo(id, name, avatar);
-        return SendMessage(session, rsp);
-    } else if (type == "chat_init_request") {
-        nlohmann::json rsp_new;
-        rsp_new["type"] = "chat_init_response";
-        rsp_new["time"] = chat::Time2Str();
-        
-        for (const auto& info : m_users) {
-            if (info.first == "group") {
-                continue;
-            }
-            nlohmann::json user;
-            user["id"] = info.first;
-            user["name"] = info.second.first;
-            user["avatar"] = info.second.second;
-            rsp_new["data"].push_back(user);
+        // 登录名未经认证, 退出后可被他人重用, 私聊历史按名字保存会被冒名读取
+        if (g_history_private->getValue()) {
+            history_key = MessageStore::PairKey(id, std::string(to));
         }
-        int32_t rt = SendMessage(session, std::make_shared<http::WSFrameMessage>(msgx->getOpcode(), rsp_new.dump()));
+    }
+    if (trace) {
+        trace->mark(MessageTrace::FANOUT);
+    }
+    // 转发之后再入队, 落盘由提交协程完成, 不增加转发延迟
+    if (m_history && !history_key.empty()) {
+        m_history->append(history_key, rsp->toString());
+    }
+    return 0;
+}
 
-        ChatMessage::ptr nty(new ChatMessage);
-        auto info = getInfo(id);
-        auto name = info.first;
-        auto avatar = info.second;
-        nty->set("type", "user_change_response");
-        nty->set("time", chat::Time2Str());
-        nty->set("code", "1");
-        nty->set("id", id);
-        nty->set("name", name);
-        nty->set("avatar", avatar);
-        session_notify(nty, session);
-
-        return rt;
-    } else if(type == "chat_request") {
-        rsp = msg;
-        std::cout << msg->toString() << std::endl;
-        rsp->set("type", "chat_response");
-        rsp->set("server", "server");
-        if (id.empty()) {
-            rsp->set("result", "501");
-            rsp->set("msg", "not login");
+// 房间请求的应答, 带上请求中的房间名
+static ChatMessage::ptr RoomResponse(const char* type, ChatMessage::ptr msg) {
+    ChatMessage::ptr rsp(new ChatMessage);
+    rsp->set(ChatMessage::TYPE, type);
+    rsp->set(ChatMessage::TIME, chat::Time2Str());
+    rsp->set(ChatMessage::ROOM, msg->get(ChatMessage::ROOM));
+    return rsp;
+}
+
+void ChatWSServlet::room_member_notify(Room::ptr room, const std::string& id, uint8_t code, WSSession::ptr session) {
+    ChatMessage::ptr nty(new ChatMessage);
+    auto info = getInfo(id);
+    nty->set(ChatMessage::TYPE, "room_member_response");
+    nty->set(ChatMessage::TIME, chat::Time2Str());
+    nty->set(ChatMessage::ROOM, room->getName());
+    nty->set(ChatMessage::CODE, code == 1 ? "1" : "2");
+    nty->set(ChatMessage::ID, id);
+    nty->set(ChatMessage::NAME, info.first.empty() ? id : info.first);
+    if (!info.second.empty()) {
+        nty->set(ChatMessage::AVATAR, info.second);
+    }
+    room_notify(room, nty, session);
+}
+
+int32_t ChatWSServlet::room_create_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session) {
+    auto id = header->getHeader("$id");
+    auto rsp = RoomResponse("room_create_response", msg);
+    auto name = std::string(msg->get(ChatMessage::ROOM));
+    auto conn = m_registry->getConn(session);
+    if (id.empty() || !conn) {
+        rsp->set(ChatMessage::RESULT, "501");
+        rsp->set(ChatMessage::MSG, "not login");
+        return SendMessage(session, rsp);
+    }
+    if (name.empty() || name == "group" || name.size() > BinaryProtocol::MAX_STRING_SIZE) {
+        rsp->set(ChatMessage::RESULT, "400");
+        rsp->set(ChatMessage::MSG, "invalid room");
+        return SendMessage(session, rsp);
+    }
+    if (!m_rooms->create(name, id, conn)) {
+        rsp->set(ChatMessage::RESULT, "409");
+        rsp->set(ChatMessage::MSG, "room exists");
+        return SendMessage(session, rsp);
+    }
+    s_rooms->set(m_rooms->size());
+    rsp->set(ChatMessage::RESULT, "200");
+    return SendMessage(session, rsp);
+}
+
+int32_t ChatWSServlet::room_join_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session) {
+    auto id = header->getHeader("$id");
+    auto rsp = RoomResponse("room_join_response", msg);
+    auto name = std::string(msg->get(ChatMessage::ROOM));
+    auto conn = m_registry->getConn(session);
+    if (id.empty() || !conn) {
+        rsp->set(ChatMessage::RESULT, "501");
+        rsp->set(ChatMessage::MSG, "not login");
+        return SendMessage(session, rsp);
+    }
+    bool joined = false;
+    auto room = m_rooms->join(name, id, conn, joined);
+    if (!room) {
+        rsp->set(ChatMessage::RESULT, "404");
+        rsp->set(ChatMessage::MSG, "room not exists");
+        return SendMessage(session, rsp);
+    }
+    rsp->set(ChatMessage::RESULT, "200");
+    int32_t rt = SendMessage(session, rsp);
+    if (joined) {
+        room_member_notify(room, id, 1, session);
+    }
+    return rt;
+}
+
+int32_t ChatWSServlet::room_leave_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session) {
+    auto id = header->getHeader("$id");
+    auto rsp = RoomResponse("room_leave_response", msg);
+    auto name = std::string(msg->get(ChatMessage::ROOM));
+    if (id.empty()) {
+        rsp->set(ChatMessage::RESULT, "501");
+        rsp->set(ChatMessage::MSG, "not login");
+        return SendMessage(session, rsp);
+    }
+    auto room = m_rooms->leave(name, id);
+    if (!room) {
+        rsp->set(ChatMessage::RESULT, "404");
+        rsp->set(ChatMessage::MSG, "not in room");
+        return SendMessage(session, rsp);
+    }
+    s_rooms->set(m_rooms->size());
+    rsp->set(ChatMessage::RESULT, "200");
+    int32_t rt = SendMessage(session, rsp);
+    room_member_notify(room, id, 2, session);
+    return rt;
+}
+
+int32_t ChatWSServlet::room_list_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session) {
+    std::vector<Room::ptr> rooms;
+    m_rooms->list(rooms);
+    std::vector<RoomInfo> infos;
+    infos.reserve(rooms.size());
+    for (auto& i : rooms) {
+        infos.push_back({i->getName(), i->getOwner(), (uint32_t)i->size()});
+    }
+
+    auto conn = m_registry->getConn(session);
+    if (conn && conn->getEncoding() == ChatMessage::BINARY) {
+        ChatMessage::ptr rsp(new ChatMessage);
+        rsp->set(ChatMessage::TYPE, "room_list_response");
+        rsp->set(ChatMessage::TIME, chat::Time2Str());
+        rsp->set(ChatMessage::DATA, BinaryProtocol::EncodeRooms(infos));
+        return SendMessage(conn, rsp);
+    }
+
+    std::string buf = WSFrame::NewBuffer(64 + infos.size() * 64);
+    JsonWriter w(buf);
+    w.startObject()
+        .kv("type", "room_list_response")
+        .kv("time", chat::Time2Str())
+        .key("data").startArray();
+    for (auto& i : infos) {
+        w.startObject()
+            .kv("room", i.name)
+            .kv("owner", i.owner)
+            .kv("members", std::to_string(i.members))
+            .endObject();
+    }
+    w.endArray().endObject();
+    return SendMessage(session, WSFrame::CreateFromBuffer(std::move(buf)));
+}
+
+int32_t ChatWSServlet::history_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session) {
+    auto id = header->getHeader("$id");
+    auto rsp = RoomResponse("history_response", msg);
+    auto to = std::string(msg->get(ChatMessage::TO));
+    auto room_name = std::string(msg->get(ChatMessage::ROOM));
+    if (!to.empty()) {
+        rsp->set(ChatMessage::TO, to);
+    }
+    auto conn = m_registry->getConn(session);
+    if (id.empty() || !conn) {
+        rsp->set(ChatMessage::RESULT, "501");
+        rsp->set(ChatMessage::MSG, "not login");
+        return SendMessage(session, rsp);
+    }
+    if (!m_history) {
+        rsp->set(ChatMessage::RESULT, "503");
+        rsp->set(ChatMessage::MSG, "history disabled");
+        return SendMessage(session, rsp);
+    }
+
+    // 与发言的权限一致: 房间只对成员开放, 私聊只能查自己参与的
+    std::string key;
+    if (!room_name.empty()) {
+        auto room = m_rooms->get(room_name);
+        if (!room || !room->has(id)) {
+            rsp->set(ChatMessage::RESULT, room ? "403" : "404");
+            rsp->set(ChatMessage::MSG, room ? "not in room" : "room not exists");
             return SendMessage(session, rsp);
         }
-        rsp->set("result", "200");
-
-        if (msg->get("to") == "group") {
-            session_notify(rsp, session);
-        } else {
-            auto to_conn = m_sessions[msg->get("to")];
-            return SendMessage(to_conn, rsp);
+        key = MessageStore::RoomKey(room_name, room->getIncarnation());
+    } else if (to == "group") {
+        key = MessageStore::GroupKey();
+    } else if (!to.empty()) {
+        if (!g_history_private->getValue()) {
+            rsp->set(ChatMessage::RESULT, "403");
+            rsp->set(ChatMessage::MSG, "private history disabled");
+            return SendMessage(session, rsp);
         }
+        key = MessageStore::PairKey(id, to);
+    } else {
+        rsp->set(ChatMessage::RESULT, "400");
+        rsp->set(ChatMessage::MSG, "invalid conversation");
+        return SendMessage(session, rsp);
     }
-    return 0;
+
+    // before 为上一页最早一条的 offset, 不带时从最新一条开始
+    uint64_t before = strtoull(std::string(msg->get("before")).c_str(), nullptr, 10);
+    uint32_t limit = strtoul(std::string(msg->get("limit")).c_str(), nullptr, 10);
+    if (limit == 0) {
+        limit = g_history_page->getValue();
+    }
+    limit = std::min(limit, g_history_max_page->getValue());
+    std::vector<HistoryRecord> records;
+    if (!m_history->read(key, before, limit, records)) {
+        rsp->set(ChatMessage::RESULT, "500");
+        rsp->set(ChatMessage::MSG, "read history fail");
+        return SendMessage(session, rsp);
+    }
+
+    if (conn->getEncoding() == ChatMessage::BINARY) {
+        rsp->set(ChatMessage::RESULT, "200");
+        rsp->set(ChatMessage::DATA, BinaryProtocol::EncodeHistory(records));
+        return SendMessage(conn, rsp);
+    }
+
+    size_t size = 128;
+    for (auto& i : records) {
+        size += 64 + i.data.size();
+    }
+    std::string buf = WSFrame::NewBuffer(size);
+    JsonWriter w(buf);
+    w.startObject()
+        .kv("type", "history_response")
+        .kv("time", rsp->get(ChatMessage::TIME))
+        .kv("result", "200");
+    if (!room_name.empty()) {
+        w.kv("room", room_name);
+    } else {
+        w.kv("to", to);
+    }
+    w.key("data").startArray();
+    for (auto& i : records) {
+        w.startObject()
+            .kv("offset", std::to_string(i.offset))
+            .kv("time", std::to_string(i.time))
+            .key("message").raw(i.data)
+            .endObject();
+    }
+    w.endArray().endObject();
+    return SendMessage(conn, WSFrame::CreateFromBuffer(std::move(buf)));
 }
 
 std::pair<std::string, std::string> ChatWSServlet::getInfo(const std::string &id) {
-    RWMutex::ReadLock lock(m_mutex);
-    auto it = m_users.find(id);
-    return it == m_users.end() ? std::make_pair("", "") : it->second;
+    return m_registry->getInfo(id);
 }
 
 void ChatWSServlet::addInfo(const std::string &id, const std::string &name, const std::string &avatar) {
-    RWMutex::WriteLock lock(m_mutex);
-    m_users[id] = std::make_pair(name, avatar);
+    m_registry->addInfo(id, name, avatar);
 }
 
 }
@@ -2,9 +2,16 @@
 #define __CHAT_CHAT_SERVLET_H__
 
 #include "protocol.h"
+#include "wsFrame.h"
+#include "sessionRegistry.h"
+#include "roomManager.h"
+#include "messageStore.h"
+#include "presenceBatch.h"
 #include <chat/http/ws_servlet.h>
+#include <functional>
 #include <map>
 #include <string>
+#include <unordered_map>
 
 
 namespace chat {
@@ -13,6 +20,9 @@ namespace http {
 class ChatWSServlet : public WSServlet {
 public:
     typedef std::shared_ptr<ChatWSServlet> ptr;
+    typedef std::function<int32_t (HttpRequest::ptr header
+                                   ,ChatMessage::ptr msg
+                                   ,WSSession::ptr session)> MessageHandler;
     ChatWSServlet();
     virtual int32_t onConnect(HttpRequest::ptr header
                               ,WSSession::ptr session) override;
@@ -24,18 +34,80 @@ public:
 
     std::pair<std::string, std::string> getInfo(const std::string &id);
     void addInfo(const std::string &id, const std::string &name, const std::string &avatar);
-    void session_notify(ChatMessage::ptr msg, WSSession::ptr session = nullptr);
+    /// 发布到主题 all(全部在线用户)
+    /// key 非空时同一接收者积压的同 key 旧帧可被合并, 如用户上下线通知
+    void session_notify(ChatMessage::ptr msg, WSSession::ptr session = nullptr
+                        ,const std::string& key = "");
+    /// 广播已编码好的帧, frames 按 ChatMessage::Encoding 下标, 两种编码都不能为空
+    void session_notify(const WSFrame::ptr (&frames)[2], WSSession::ptr session = nullptr);
+    /// 广播给房间成员
+    void room_notify(Room::ptr room, ChatMessage::ptr msg, WSSession::ptr session = nullptr);
+    /// 用户上下线通知, code 1 上线 2 下线
+    /// chat.presence.batch_ms 为 0 时立即广播 user_change_response,
+    /// 否则窗口内的变化合并为一条 user_change_batch, 同一用户只保留最后一次
+    void presence_notify(const std::string& id, uint8_t code, const std::string& name
+                         ,const std::string& avatar, WSSession::ptr session = nullptr);
     int32_t SendMessage(WSSession::ptr session, WSFrameMessage::ptr msg);
     int32_t SendMessage(WSSession::ptr session, ChatMessage::ptr msg);
+    int32_t SendMessage(WSSession::ptr session, WSFrame::ptr frame);
+    int32_t SendMessage(ChatSession::ptr conn, ChatMessage::ptr msg);
+    int32_t SendMessage(ChatSession::ptr conn, WSFrame::ptr frame);
     void session_del(const std::string& id);
     std::string session_find(WSSession::ptr session);
     void session_add(const std::string& id, WSSession::ptr session);
     bool session_exists(const std::string& id);
+    /// 停止服务时关闭全部连接, 各连接随后照常经 onClose 清理
+    void closeAll();
+    SessionRegistry::ptr getRegistry() const { return m_registry;}
+    RoomManager::ptr getRooms() const { return m_rooms;}
+    PubSub::ptr getPubSub() const { return m_pubsub;}
+    /// chat.history.enable 关闭时为 nullptr
+    MessageStore::ptr getHistory() const { return m_history;}
+    /// chat_init_response 帧, 包含除 group 外的全部用户, version 为读取用户列表之前的版本号
+    WSFrame::ptr buildRoster(ChatMessage::Encoding enc, uint64_t version
+                             ,std::shared_ptr<MessageTrace> trace = nullptr);
+    /// roster_delta_response 帧, 包含版本 since 之后的用户变化, 变更日志已不包含 since 时返回 nullptr
+    WSFrame::ptr buildDelta(ChatMessage::Encoding enc, uint64_t since
+                            ,std::shared_ptr<MessageTrace> trace = nullptr);
+    /// 缓存的 chat_init_response 帧, 用户增删后首次请求时重建, time 为重建时间
+    WSFrame::ptr getRoster(ChatMessage::Encoding enc);
+    /// 注册消息处理函数, 同一类型重复注册时覆盖
+    void registerHandler(MessageType::Type type, MessageHandler cb);
 
 private:
-    chat::RWMutex m_mutex;
-    std::map<std::string, WSSession::ptr> m_sessions;
-    std::unordered_map<std::string, std::pair<std::string, std::string>> m_users;
+    void presence_flush();
+    int32_t login_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session);
+    int32_t chat_init_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session);
+    int32_t chat_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session);
+    int32_t room_create_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session);
+    int32_t room_join_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session);
+    int32_t room_leave_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session);
+    int32_t room_list_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session);
+    int32_t history_request(HttpRequest::ptr header, ChatMessage::ptr msg, WSSession::ptr session);
+    void room_member_notify(Room::ptr room, const std::string& id, uint8_t code, WSSession::ptr session);
+
+private:
+    // 按编码各缓存一帧, 整体替换, 读取只需一次原子加载
+    struct RosterCache {
+        typedef std::shared_ptr<const RosterCache> ptr;
+        uint64_t version = 0;
+        WSFrame::ptr frames[2];
+    };
+
+    SessionRegistry::ptr m_registry;
+    PubSub::ptr m_pubsub;
+    RoomManager::ptr m_rooms;
+    MessageStore::ptr m_history;
+    // 常驻主题, 广播时不必查表
+    Topic::ptr m_allTopic;
+    Topic::ptr m_presenceTopic;
+    // 串行化用户列表重建, 同时到达的请求只重建一次
+    chat::Mutex m_rosterMutex;
+    RosterCache::ptr m_roster;
+    // 当前窗口内待广播的上下线变化
+    PresenceBatch m_presence;
+    // 按 MessageType 下标索引, 未注册的类型不解码直接忽略
+    MessageHandler m_handlers[MessageType::TYPE_COUNT];
 
 };
 
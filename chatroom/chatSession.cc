@@ -0,0 +1,437 @@
+#include "chatSession.h"
+#include "metrics.h"
+#include "messageTrace.h"
+#include <chat/config.h>
+#include <chat/log.h>
+#include <chat/util.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <map>
+
+namespace chat {
+namespace http {
+
+static chat::Logger::ptr g_logger = CHAT_LOG_ROOT();
+
+static chat::ConfigVar<uint32_t>::ptr g_outbound_max_frames =
+    chat::Config::Lookup("chat.outbound.max_frames"
+            ,(uint32_t)1024
+            , "max queued frames per session");
+
+static chat::ConfigVar<uint64_t>::ptr g_outbound_max_bytes =
+    chat::Config::Lookup("chat.outbound.max_bytes"
+            ,(uint64_t)(4 * 1024 * 1024)
+            , "max queued bytes per session");
+
+static chat::ConfigVar<uint32_t>::ptr g_outbound_batch_frames =
+    chat::Config::Lookup("chat.outbound.batch_frames"
+            ,(uint32_t)64
+            , "max frames merged into one writev");
+
+static chat::ConfigVar<std::string>::ptr g_outbound_policy =
+    chat::Config::Lookup("chat.outbound.policy"
+            ,std::string("drop_oldest")
+            , "slow consumer policy: drop_oldest, drop_newest, coalesce, disconnect");
+
+static chat::ConfigVar<uint64_t>::ptr g_outbound_disconnect_bytes =
+    chat::Config::Lookup("chat.outbound.disconnect_bytes"
+            ,(uint64_t)0
+            , "disconnect when backlog exceeds bytes, 0 disable");
+
+static chat::ConfigVar<uint64_t>::ptr g_outbound_disconnect_ms =
+    chat::Config::Lookup("chat.outbound.disconnect_ms"
+            ,(uint64_t)0
+            , "disconnect when oldest queued frame exceeds ms, 0 disable");
+
+static chat::ConfigVar<bool>::ptr g_outbound_pin_thread =
+    chat::Config::Lookup("chat.outbound.pin_thread"
+            ,true
+            , "run each session's writer only on the io thread that accepted it");
+
+static chat::Counter::ptr s_sent_frames = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_outbound_frames_total", "frames written to sockets");
+static chat::Counter::ptr s_sent_bytes = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_outbound_bytes_total", "bytes written to sockets");
+static chat::Counter::ptr s_dropped_frames = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_outbound_dropped_frames_total", "frames dropped by the slow consumer policy or on close");
+static chat::Counter::ptr s_coalesced = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_outbound_coalesced_total", "queued frames replaced by a newer frame with the same key");
+
+// 配置监听器与发送方并发读写, 各项独立, relaxed 即可
+static std::atomic<uint32_t> s_max_frames{0};
+static std::atomic<uint64_t> s_max_bytes{0};
+static std::atomic<uint32_t> s_batch_frames{0};
+static std::atomic<OutboundPolicy::Type> s_policy{OutboundPolicy::DROP_OLDEST};
+static std::atomic<uint64_t> s_disconnect_bytes{0};
+static std::atomic<uint64_t> s_disconnect_ms{0};
+static std::atomic<bool> s_pin_thread{true};
+
+// 配置缓存到静态变量, 入队路径不再每次读 ConfigVar
+struct _OutboundIniter {
+    _OutboundIniter() {
+        s_max_frames.store(g_outbound_max_frames->getValue(), std::memory_order_relaxed);
+        s_max_bytes.store(g_outbound_max_bytes->getValue(), std::memory_order_relaxed);
+        s_batch_frames.store(std::max(g_outbound_batch_frames->getValue(), 1u), std::memory_order_relaxed);
+        s_policy.store(OutboundPolicy::FromString(g_outbound_policy->getValue()), std::memory_order_relaxed);
+        s_disconnect_bytes.store(g_outbound_disconnect_bytes->getValue(), std::memory_order_relaxed);
+        s_disconnect_ms.store(g_outbound_disconnect_ms->getValue(), std::memory_order_relaxed);
+        s_pin_thread.store(g_outbound_pin_thread->getValue(), std::memory_order_relaxed);
+
+        g_outbound_max_frames->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            s_max_frames.store(new_value, std::memory_order_relaxed);
+        });
+        g_outbound_max_bytes->addListener([](const uint64_t& old_value, const uint64_t& new_value){
+            s_max_bytes.store(new_value, std::memory_order_relaxed);
+        });
+        g_outbound_batch_frames->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            s_batch_frames.store(new_value ? new_value : 1, std::memory_order_relaxed);
+        });
+        g_outbound_policy->addListener([](const std::string& old_value, const std::string& new_value){
+            CHAT_LOG_INFO(g_logger) << "outbound policy changed from " << old_value << " to " << new_value;
+            s_policy.store(OutboundPolicy::FromString(new_value), std::memory_order_relaxed);
+        });
+        g_outbound_disconnect_bytes->addListener([](const uint64_t& old_value, const uint64_t& new_value){
+            s_disconnect_bytes.store(new_value, std::memory_order_relaxed);
+        });
+        g_outbound_disconnect_ms->addListener([](const uint64_t& old_value, const uint64_t& new_value){
+            s_disconnect_ms.store(new_value, std::memory_order_relaxed);
+        });
+        // 只影响之后建立的连接
+        g_outbound_pin_thread->addListener([](const bool& old_value, const bool& new_value){
+            s_pin_thread.store(new_value, std::memory_order_relaxed);
+        });
+    }
+};
+
+static _OutboundIniter s_outbound_initer;
+
+OutboundPolicy::Type OutboundPolicy::FromString(const std::string& v) {
+#define XX(name, str) \
+    if (v == #str) { \
+        return name; \
+    }
+    XX(DROP_OLDEST, drop_oldest);
+    XX(DROP_NEWEST, drop_newest);
+    XX(COALESCE, coalesce);
+    XX(DISCONNECT, disconnect);
+#undef XX
+    CHAT_LOG_ERROR(g_logger) << "invalid outbound policy: " << v << ", use drop_oldest";
+    return DROP_OLDEST;
+}
+
+const char* OutboundPolicy::ToString(Type v) {
+    switch (v) {
+#define XX(name, str) \
+        case name: \
+            return #str;
+        XX(DROP_OLDEST, drop_oldest);
+        XX(DROP_NEWEST, drop_newest);
+        XX(COALESCE, coalesce);
+        XX(DISCONNECT, disconnect);
+#undef XX
+        default:
+            return "unknown";
+    }
+}
+
+OwnerQueue::OwnerQueue(chat::IOManager* iom, int thread)
+    :m_iom(iom)
+    ,m_thread(thread) {
+}
+
+OwnerQueue* OwnerQueue::Get(chat::IOManager* iom, int thread) {
+    static chat::Mutex s_mutex;
+    static std::map<std::pair<chat::IOManager*, int>, OwnerQueue*> s_queues;
+    chat::Mutex::Lock lock(s_mutex);
+    auto& v = s_queues[std::make_pair(iom, thread)];
+    if (!v) {
+        v = new OwnerQueue(iom, thread);
+    }
+    return v;
+}
+
+void OwnerQueue::post(std::function<void()> cb) {
+    // 先计数再入队, 同一线程随后的 send 一定能看到队列不空
+    m_pending.fetch_add(1);
+    m_tasks.push(std::move(cb));
+    if (!m_scheduled.exchange(true)) {
+        m_iom->schedule(std::bind(&OwnerQueue::run, this), m_thread);
+    }
+}
+
+void OwnerQueue::run() {
+    std::function<void()> cb;
+    while (true) {
+        while (m_tasks.pop(cb)) {
+            cb();
+            cb = nullptr;
+            // 任务中的入队对之后看到计数归零的发送方可见
+            m_pending.fetch_sub(1, std::memory_order_release);
+        }
+        // 清标记后新的执行协程可能已在取任务, 这里只看计数, 不再碰队列
+        m_scheduled = false;
+        if (m_pending.load() == 0 || m_scheduled.exchange(true)) {
+            return;
+        }
+    }
+}
+
+ChatSession::ChatSession(WSSession::ptr session, chat::IOManager* iom)
+    :m_session(session)
+    ,m_iom(iom)
+    ,m_thread(s_pin_thread.load(std::memory_order_relaxed) && iom && chat::IOManager::GetThis() == iom ? chat::GetThreadId() : -1)
+    ,m_owner(iom ? OwnerQueue::Get(iom, m_thread) : nullptr) {
+}
+
+int32_t ChatSession::send(WSFrame::ptr frame) {
+    if (m_closed) {
+        return -1;
+    }
+    // 排在已投递到归属线程的分发任务之后, 不插队
+    if (m_owner && m_owner->getPending()) {
+        m_owner->post(std::bind(&ChatSession::enqueue, shared_from_this(), frame));
+        return 0;
+    }
+    return enqueue(frame);
+}
+
+int32_t ChatSession::enqueue(WSFrame::ptr frame) {
+    uint64_t now = chat::GetCurrentMS();
+    if (m_closed) {
+        return -1;
+    }
+
+    uint64_t max_frames = s_max_frames.load(std::memory_order_relaxed);
+    uint64_t max_bytes = s_max_bytes.load(std::memory_order_relaxed);
+    OutboundPolicy::Type policy = s_policy.load(std::memory_order_relaxed);
+    uint64_t disconnect_bytes = s_disconnect_bytes.load(std::memory_order_relaxed);
+    uint64_t disconnect_ms = s_disconnect_ms.load(std::memory_order_relaxed);
+
+    uint64_t frames = m_backlogFrames.load(std::memory_order_relaxed);
+    uint64_t bytes = m_backlogBytes.load(std::memory_order_relaxed);
+    uint64_t oldest = m_oldestTs.load(std::memory_order_relaxed);
+    if ((disconnect_bytes && bytes + frame->size() > disconnect_bytes)
+            || (disconnect_ms && oldest && now > oldest + disconnect_ms)) {
+        CHAT_LOG_WARN(g_logger) << "slow consumer disconnect, backlog_frames=" << frames
+            << " backlog_bytes=" << bytes << " - " << m_session;
+        close();
+        m_session->close();
+        return -1;
+    }
+
+    if (frames + 1 > max_frames || bytes + frame->size() > max_bytes) {
+        if (policy == OutboundPolicy::DISCONNECT) {
+            CHAT_LOG_WARN(g_logger) << "outbound queue full, disconnect - " << m_session;
+            close();
+            m_session->close();
+            return -1;
+        }
+        // 旧帧在写协程手里, 发送方丢不掉, 只能给写协程留出一倍余量
+        if (policy == OutboundPolicy::DROP_NEWEST
+                || frames + 1 > 2 * max_frames
+                || bytes + frame->size() > 2 * max_bytes) {
+            dropped(1, frame->size());
+            return -2;
+        }
+    }
+
+    bytes = m_backlogBytes.fetch_add(frame->size(), std::memory_order_relaxed) + frame->size();
+    // 写协程清掉 m_scheduled 后据此判断是否还有新帧, 与那边的检查都用 seq_cst
+    m_backlogFrames.fetch_add(1);
+    // 积压从空变为非空时记下入队时间, 写协程没有运行时 disconnect_ms 也能生效
+    if (!oldest) {
+        m_oldestTs.compare_exchange_strong(oldest, now, std::memory_order_relaxed);
+    }
+    m_stats.enqueued.fetch_add(1, std::memory_order_relaxed);
+    uint64_t peak = m_stats.backlog_peak_bytes.load(std::memory_order_relaxed);
+    while (bytes > peak && !m_stats.backlog_peak_bytes.compare_exchange_weak(peak, bytes
+                , std::memory_order_relaxed)) {
+    }
+    m_inbox.push({frame, now});
+    if (!m_scheduled.exchange(true)) {
+        schedule();
+    }
+    return 0;
+}
+
+void ChatSession::close() {
+    if (m_closed.exchange(true)) {
+        return;
+    }
+    // 积压交给写协程丢弃, 发送方不碰发送队列
+    if (!m_scheduled.exchange(true)) {
+        schedule();
+    }
+}
+
+void ChatSession::schedule() {
+    if (m_iom) {
+        m_iom->schedule(std::bind(&ChatSession::drain, shared_from_this()), m_thread);
+    } else {
+        drain();
+    }
+}
+
+void ChatSession::dropped(uint64_t frames, uint64_t bytes) {
+    m_stats.dropped_frames.fetch_add(frames, std::memory_order_relaxed);
+    m_stats.dropped_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    s_dropped_frames->inc(frames);
+}
+
+void ChatSession::pull() {
+    bool coalesce_key = s_policy.load(std::memory_order_relaxed) == OutboundPolicy::COALESCE;
+    uint64_t max_frames = s_max_frames.load(std::memory_order_relaxed);
+    uint64_t max_bytes = s_max_bytes.load(std::memory_order_relaxed);
+    Item item;
+    while (m_inbox.pop(item)) {
+        if (coalesce_key) {
+            coalesce(item.frame);
+        }
+        m_queueBytes += item.frame->size();
+        m_queue.push_back(std::move(item));
+    }
+    while (m_queue.size() > max_frames || m_queueBytes > max_bytes) {
+        dropFront();
+    }
+}
+
+void ChatSession::dropFront() {
+    auto& item = m_queue.front();
+    dropped(1, item.frame->size());
+    m_queueBytes -= item.frame->size();
+    m_backlogFrames.fetch_sub(1, std::memory_order_relaxed);
+    m_backlogBytes.fetch_sub(item.frame->size(), std::memory_order_relaxed);
+    m_queue.pop_front();
+}
+
+// 用新帧替换队列中 key 相同的旧帧, 旧状态已经过时, 不必再发
+bool ChatSession::coalesce(WSFrame::ptr frame) {
+    if (frame->getKey().empty()) {
+        return false;
+    }
+    for (auto it = m_queue.begin(); it != m_queue.end(); ++it) {
+        if (it->frame->getKey() == frame->getKey()) {
+            m_stats.coalesced.fetch_add(1, std::memory_order_relaxed);
+            s_coalesced->inc();
+            m_queueBytes -= it->frame->size();
+            m_backlogFrames.fetch_sub(1, std::memory_order_relaxed);
+            m_backlogBytes.fetch_sub(it->frame->size(), std::memory_order_relaxed);
+            m_queue.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ChatSession::discard() {
+    if (m_queue.empty()) {
+        return;
+    }
+    dropped(m_queue.size(), m_queueBytes);
+    m_backlogFrames.fetch_sub(m_queue.size(), std::memory_order_relaxed);
+    m_backlogBytes.fetch_sub(m_queueBytes, std::memory_order_relaxed);
+    m_queue.clear();
+    m_queueBytes = 0;
+}
+
+OutboundStats ChatSession::getStats() {
+    uint64_t now = chat::GetCurrentMS();
+    OutboundStats stats;
+    stats.enqueued = m_stats.enqueued.load(std::memory_order_relaxed);
+    stats.sent_frames = m_stats.sent_frames.load(std::memory_order_relaxed);
+    stats.sent_bytes = m_stats.sent_bytes.load(std::memory_order_relaxed);
+    stats.dropped_frames = m_stats.dropped_frames.load(std::memory_order_relaxed);
+    stats.dropped_bytes = m_stats.dropped_bytes.load(std::memory_order_relaxed);
+    stats.coalesced = m_stats.coalesced.load(std::memory_order_relaxed);
+    stats.backlog_peak_bytes = m_stats.backlog_peak_bytes.load(std::memory_order_relaxed);
+    stats.backlog_frames = m_backlogFrames.load(std::memory_order_relaxed);
+    stats.backlog_bytes = m_backlogBytes.load(std::memory_order_relaxed);
+    uint64_t oldest = m_oldestTs.load(std::memory_order_relaxed);
+    stats.backlog_age_ms = oldest && now > oldest ? now - oldest : 0;
+    return stats;
+}
+
+// 同一时刻只有一个写协程(m_scheduled), 发送队列无需加锁
+void ChatSession::drain() {
+    std::vector<WSFrame::ptr> batch;
+    while (true) {
+        pull();
+        if (m_closed) {
+            discard();
+        }
+        if (m_queue.empty()) {
+            m_oldestTs.store(0, std::memory_order_relaxed);
+            m_scheduled = false;
+            // 发送方先计数再检查 m_scheduled, 这里先清标记再检查计数, 不会漏掉
+            // 清标记后新的写协程可能已在取收件箱, 这里不能再碰收件箱
+            if (m_backlogFrames.load() == 0 || m_scheduled.exchange(true)) {
+                return;
+            }
+            continue;
+        }
+
+        m_oldestTs.store(m_queue.front().ts, std::memory_order_relaxed);
+        size_t n = std::min<size_t>(m_queue.size(), s_batch_frames.load(std::memory_order_relaxed));
+        uint64_t bytes = 0;
+        for (size_t i = 0; i < n; ++i) {
+            bytes += m_queue.front().frame->size();
+            batch.push_back(m_queue.front().frame);
+            m_queue.pop_front();
+        }
+        m_queueBytes -= bytes;
+        bool ok = writeBatch(batch);
+        m_backlogFrames.fetch_sub(batch.size(), std::memory_order_relaxed);
+        m_backlogBytes.fetch_sub(bytes, std::memory_order_relaxed);
+        if (!ok) {
+            CHAT_LOG_INFO(g_logger) << "outbound write fail, close - " << m_session;
+            dropped(batch.size(), bytes);
+            batch.clear();
+            m_closed = true;
+            m_session->close();
+            continue;
+        }
+        uint64_t now_ns = chat::MonotonicNs();
+        for (auto& i : batch) {
+            if (i->getTrace()) {
+                i->getTrace()->onWrite(now_ns);
+            }
+        }
+        m_stats.sent_frames.fetch_add(batch.size(), std::memory_order_relaxed);
+        m_stats.sent_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        s_sent_frames->inc(batch.size());
+        s_sent_bytes->inc(bytes);
+        batch.clear();
+    }
+}
+
+bool ChatSession::writeBatch(const std::vector<WSFrame::ptr>& frames) {
+    auto sock = m_session->getSocket();
+    if (!sock) {
+        return false;
+    }
+    std::vector<iovec> iovs(frames.size());
+    for (size_t i = 0; i < frames.size(); ++i) {
+        iovs[i].iov_base = (void*)frames[i]->data();
+        iovs[i].iov_len = frames[i]->size();
+    }
+    size_t idx = 0;
+    while (idx < iovs.size()) {
+        int rt = sock->send(&iovs[idx], iovs.size() - idx);
+        if (rt <= 0) {
+            return false;
+        }
+        size_t n = rt;
+        while (idx < iovs.size() && n >= iovs[idx].iov_len) {
+            n -= iovs[idx].iov_len;
+            ++idx;
+        }
+        if (n > 0) {
+            iovs[idx].iov_base = (char*)iovs[idx].iov_base + n;
+            iovs[idx].iov_len -= n;
+        }
+    }
+    return true;
+}
+
+}
+}
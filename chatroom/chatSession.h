@@ -0,0 +1,157 @@
+#ifndef __CHAT_CHAT_SESSION_H__
+#define __CHAT_CHAT_SESSION_H__
+
+#include "wsFrame.h"
+#include "protocol.h"
+#include "mpscQueue.h"
+#include <chat/iomanager.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace chat {
+namespace http {
+
+// 发送队列积压时的处理策略, 对应 chat.outbound.policy
+class OutboundPolicy {
+public:
+    enum Type {
+        DROP_OLDEST = 0,
+        DROP_NEWEST = 1,
+        COALESCE = 2,
+        DISCONNECT = 3
+    };
+    static Type FromString(const std::string& v);
+    static const char* ToString(Type v);
+};
+
+// 单个连接的发送统计
+struct OutboundStats {
+    uint64_t enqueued = 0;
+    uint64_t sent_frames = 0;
+    uint64_t sent_bytes = 0;
+    uint64_t dropped_frames = 0;
+    uint64_t dropped_bytes = 0;
+    uint64_t coalesced = 0;
+    uint64_t backlog_frames = 0;
+    uint64_t backlog_bytes = 0;
+    uint64_t backlog_peak_bytes = 0;
+    uint64_t backlog_age_ms = 0;
+};
+
+// 一个 IO 线程上的串行任务队列, 任务按提交顺序在该线程上执行
+// 大主题的分发按接收者的归属线程分块投递到这里; 队列中还有任务时, 发往该线程连接的帧也排到队尾,
+// 每个接收者只有一个顺序点, 同一发送方的消息不会因走了不同路径而乱序
+class OwnerQueue {
+public:
+    OwnerQueue(chat::IOManager* iom, int thread);
+
+    /// 同一 iom 和线程总是返回同一个队列, 队列不释放
+    static OwnerQueue* Get(chat::IOManager* iom, int thread);
+
+    /// 可在任意线程调用
+    void post(std::function<void()> cb);
+    /// 已提交但还未执行完的任务数
+    uint64_t getPending() const { return m_pending.load(std::memory_order_acquire);}
+private:
+    void run();
+private:
+    chat::IOManager* m_iom;
+    int m_thread;
+    MpscQueue<std::function<void()> > m_tasks;
+    std::atomic<uint64_t> m_pending{0};
+    // 执行协程已调度或正在运行
+    std::atomic<bool> m_scheduled{false};
+};
+
+// 一条 WebSocket 连接在聊天服务中的状态
+// 发送走有界队列, 由该连接自己的写协程合并成一次 writev 写出,
+// 广播方只负责入队, 不会被慢连接阻塞
+// 连接归属于建立它的 IO 线程(chat.outbound.pin_thread), 写协程只调度到该线程;
+// 其他线程的发送经无锁收件箱交给写协程, 发送队列只由写协程访问, 不加锁
+class ChatSession : public std::enable_shared_from_this<ChatSession> {
+public:
+    typedef std::shared_ptr<ChatSession> ptr;
+
+    /// 在 iom 的线程内构造时归属当前线程, 否则不绑定线程
+    ChatSession(WSSession::ptr session, chat::IOManager* iom);
+
+    WSSession::ptr getSession() const { return m_session;}
+    chat::IOManager* getIOManager() const { return m_iom;}
+    /// 归属线程 id, -1 表示写协程可在 iom 的任意线程运行
+    int getThread() const { return m_thread;}
+    /// 归属线程的任务队列, 没有 iom 时为空
+    OwnerQueue* getOwner() const { return m_owner;}
+
+    /// 握手时协商, 之后只读
+    ChatMessage::Encoding getEncoding() const { return m_encoding;}
+    void setEncoding(ChatMessage::Encoding v) { m_encoding = v;}
+    int32_t getOpcode() const {
+        return m_encoding == ChatMessage::BINARY ? WSFrameHead::BIN_FRAME : WSFrameHead::TEXT_FRAME;
+    }
+
+    /// 发送, 可在任意线程调用, 成功返回 0, 连接已关闭返回 -1, 按策略丢弃返回 -2
+    /// 归属线程的任务队列不空时排到队尾再入队, 此时返回 0, 丢弃只计入统计
+    int32_t send(WSFrame::ptr frame);
+    /// 直接入队, 只能在归属线程的任务队列中或队列为空时调用, 返回值同 send
+    /// drop_oldest/coalesce 的旧帧由写协程丢弃, 写协程阻塞时积压超过上限一倍后丢弃新帧
+    int32_t enqueue(WSFrame::ptr frame);
+    /// 关闭发送队列, 未发送的帧由写协程丢弃
+    void close();
+    bool isClosed() const { return m_closed;}
+
+    OutboundStats getStats();
+private:
+    struct Item {
+        WSFrame::ptr frame;
+        uint64_t ts = 0;
+    };
+
+    // 发送方与写协程都会更新, 统计允许略有滞后
+    struct Counters {
+        std::atomic<uint64_t> enqueued{0};
+        std::atomic<uint64_t> sent_frames{0};
+        std::atomic<uint64_t> sent_bytes{0};
+        std::atomic<uint64_t> dropped_frames{0};
+        std::atomic<uint64_t> dropped_bytes{0};
+        std::atomic<uint64_t> coalesced{0};
+        std::atomic<uint64_t> backlog_peak_bytes{0};
+    };
+
+    void schedule();
+    void drain();
+    bool writeBatch(const std::vector<WSFrame::ptr>& frames);
+    void dropped(uint64_t frames, uint64_t bytes);
+    // 以下只在写协程中调用
+    void pull();
+    void dropFront();
+    bool coalesce(WSFrame::ptr frame);
+    void discard();
+private:
+    WSSession::ptr m_session;
+    chat::IOManager* m_iom;
+    int m_thread;
+    OwnerQueue* m_owner;
+    ChatMessage::Encoding m_encoding = ChatMessage::JSON;
+    // 其他线程 -> 写协程
+    MpscQueue<Item> m_inbox;
+    // 以下两项只由写协程访问
+    std::deque<Item> m_queue;
+    uint64_t m_queueBytes = 0;
+    // 收件箱加发送队列中的积压, 发送方据此做上限检查
+    std::atomic<uint64_t> m_backlogFrames{0};
+    std::atomic<uint64_t> m_backlogBytes{0};
+    // 最旧未写出帧的入队时间, 0 表示无积压
+    std::atomic<uint64_t> m_oldestTs{0};
+    // 写协程已调度或正在运行
+    std::atomic<bool> m_scheduled{false};
+    std::atomic<bool> m_closed{false};
+    Counters m_stats;
+};
+
+}
+}
+
+#endif
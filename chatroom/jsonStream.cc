@@ -0,0 +1,471 @@
+#include "jsonStream.h"
+#include <string.h>
+
+namespace chat {
+namespace http {
+
+static void SkipWs(const char*& p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        ++p;
+    }
+}
+
+static int HexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool ReadHex4(const char*& p, const char* end, uint32_t& v) {
+    if (end - p < 4) {
+        return false;
+    }
+    v = 0;
+    for (int i = 0; i < 4; ++i) {
+        int h = HexValue(*p++);
+        if (h < 0) {
+            return false;
+        }
+        v = (v << 4) | h;
+    }
+    return true;
+}
+
+static void AppendUtf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out.push_back((char)cp);
+    } else if (cp < 0x800) {
+        out.push_back((char)(0xC0 | (cp >> 6)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back((char)(0xE0 | (cp >> 12)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back((char)(0xF0 | (cp >> 18)));
+        out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+static bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// -?(0|[1-9]\d*)(\.\d+)?([eE][+-]?\d+)?
+static bool IsNumber(std::string_view v) {
+    size_t i = 0;
+    size_t n = v.size();
+    if (i < n && v[i] == '-') {
+        ++i;
+    }
+    if (i == n) {
+        return false;
+    }
+    if (v[i] == '0') {
+        ++i;
+    } else if (IsDigit(v[i])) {
+        while (i < n && IsDigit(v[i])) {
+            ++i;
+        }
+    } else {
+        return false;
+    }
+    if (i < n && v[i] == '.') {
+        if (++i == n || !IsDigit(v[i])) {
+            return false;
+        }
+        while (i < n && IsDigit(v[i])) {
+            ++i;
+        }
+    }
+    if (i < n && (v[i] == 'e' || v[i] == 'E')) {
+        ++i;
+        if (i < n && (v[i] == '+' || v[i] == '-')) {
+            ++i;
+        }
+        if (i == n || !IsDigit(v[i])) {
+            return false;
+        }
+        while (i < n && IsDigit(v[i])) {
+            ++i;
+        }
+    }
+    return i == n;
+}
+
+namespace {
+
+class JsonParser {
+public:
+    JsonParser(std::string_view in, std::string& scratch, JsonHandler& handler, int max_depth)
+        :m_p(in.data())
+        ,m_end(in.data() + in.size())
+        ,m_scratch(scratch)
+        ,m_handler(handler)
+        ,m_maxDepth(max_depth) {
+    }
+
+    bool parse() {
+        if (!parseValue(0)) {
+            return false;
+        }
+        SkipWs(m_p, m_end);
+        return m_p == m_end;
+    }
+private:
+    bool parseValue(int depth) {
+        SkipWs(m_p, m_end);
+        if (m_p == m_end) {
+            return false;
+        }
+        char c = *m_p;
+        if (c == '"') {
+            std::string_view v;
+            return parseString(v) && m_handler.onValue(v, JsonHandler::STRING);
+        }
+        if (c == '{' || c == '[') {
+            if (depth >= m_maxDepth) {
+                const char* start = m_p;
+                if (!skipComposite()) {
+                    return false;
+                }
+                return m_handler.onValue(std::string_view(start, m_p - start), JsonHandler::RAW);
+            }
+            return c == '{' ? parseObject(depth + 1) : parseArray(depth + 1);
+        }
+
+        const char* start = m_p;
+        while (m_p < m_end && *m_p != ',' && *m_p != '}' && *m_p != ']' && *m_p != ' '
+                && *m_p != '\t' && *m_p != '\n' && *m_p != '\r') {
+            ++m_p;
+        }
+        std::string_view v(start, m_p - start);
+        if (v == "true" || v == "false") {
+            return m_handler.onValue(v, JsonHandler::BOOL);
+        }
+        if (v == "null") {
+            return m_handler.onValue(v, JsonHandler::NULLVAL);
+        }
+        if (IsNumber(v)) {
+            return m_handler.onValue(v, JsonHandler::NUMBER);
+        }
+        return false;
+    }
+
+    bool parseObject(int depth) {
+        ++m_p;
+        if (!m_handler.onStartObject()) {
+            return false;
+        }
+        SkipWs(m_p, m_end);
+        if (m_p < m_end && *m_p == '}') {
+            ++m_p;
+            return m_handler.onEndObject();
+        }
+        while (true) {
+            std::string_view key;
+            SkipWs(m_p, m_end);
+            if (m_p == m_end || *m_p != '"' || !parseString(key)
+                    || !m_handler.onKey(key)) {
+                return false;
+            }
+            SkipWs(m_p, m_end);
+            if (m_p == m_end || *m_p != ':') {
+                return false;
+            }
+            ++m_p;
+            if (!parseValue(depth)) {
+                return false;
+            }
+            SkipWs(m_p, m_end);
+            if (m_p == m_end) {
+                return false;
+            }
+            if (*m_p == ',') {
+                ++m_p;
+                continue;
+            }
+            if (*m_p == '}') {
+                ++m_p;
+                return m_handler.onEndObject();
+            }
+            return false;
+        }
+    }
+
+    bool parseArray(int depth) {
+        ++m_p;
+        if (!m_handler.onStartArray()) {
+            return false;
+        }
+        SkipWs(m_p, m_end);
+        if (m_p < m_end && *m_p == ']') {
+            ++m_p;
+            return m_handler.onEndArray();
+        }
+        while (true) {
+            if (!parseValue(depth)) {
+                return false;
+            }
+            SkipWs(m_p, m_end);
+            if (m_p == m_end) {
+                return false;
+            }
+            if (*m_p == ',') {
+                ++m_p;
+                continue;
+            }
+            if (*m_p == ']') {
+                ++m_p;
+                return m_handler.onEndArray();
+            }
+            return false;
+        }
+    }
+
+    // m_p 指向起始引号; 无转义时直接返回原文视图, 否则反转义到 m_scratch
+    // 未转义的控制字符(< 0x20)不是合法的 JSON 字符串
+    bool parseString(std::string_view& out) {
+        ++m_p;
+        const char* start = m_p;
+        while (m_p < m_end && *m_p != '"' && *m_p != '\\' && (unsigned char)*m_p >= 0x20) {
+            ++m_p;
+        }
+        if (m_p == m_end || (unsigned char)*m_p < 0x20) {
+            return false;
+        }
+        if (*m_p == '"') {
+            out = std::string_view(start, m_p - start);
+            ++m_p;
+            return true;
+        }
+
+        size_t begin = m_scratch.size();
+        m_scratch.append(start, m_p - start);
+        while (m_p < m_end && *m_p != '"') {
+            if ((unsigned char)*m_p < 0x20) {
+                return false;
+            }
+            if (*m_p != '\\') {
+                m_scratch.push_back(*m_p++);
+                continue;
+            }
+            if (++m_p == m_end) {
+                return false;
+            }
+            char c = *m_p++;
+            switch (c) {
+                case '"':
+                case '\\':
+                case '/':
+                    m_scratch.push_back(c);
+                    break;
+                case 'b':
+                    m_scratch.push_back('\b');
+                    break;
+                case 'f':
+                    m_scratch.push_back('\f');
+                    break;
+                case 'n':
+                    m_scratch.push_back('\n');
+                    break;
+                case 'r':
+                    m_scratch.push_back('\r');
+                    break;
+                case 't':
+                    m_scratch.push_back('\t');
+                    break;
+                case 'u': {
+                    uint32_t cp = 0;
+                    if (!ReadHex4(m_p, m_end, cp)) {
+                        return false;
+                    }
+                    if (cp >= 0xD800 && cp <= 0xDBFF) {
+                        uint32_t lo = 0;
+                        if (m_end - m_p < 6 || m_p[0] != '\\' || m_p[1] != 'u') {
+                            return false;
+                        }
+                        m_p += 2;
+                        if (!ReadHex4(m_p, m_end, lo) || lo < 0xDC00 || lo > 0xDFFF) {
+                            return false;
+                        }
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                        // 单独出现的低位代理
+                        return false;
+                    }
+                    AppendUtf8(m_scratch, cp);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        if (m_p == m_end) {
+            return false;
+        }
+        ++m_p;
+        out = std::string_view(m_scratch.data() + begin, m_scratch.size() - begin);
+        return true;
+    }
+
+    bool skipComposite() {
+        int depth = 0;
+        while (m_p < m_end) {
+            char c = *m_p;
+            if (c == '"') {
+                ++m_p;
+                while (m_p < m_end && *m_p != '"') {
+                    if (*m_p == '\\') {
+                        ++m_p;
+                    }
+                    ++m_p;
+                }
+                if (m_p >= m_end) {
+                    return false;
+                }
+            } else if (c == '{' || c == '[') {
+                ++depth;
+            } else if (c == '}' || c == ']') {
+                if (--depth == 0) {
+                    ++m_p;
+                    return true;
+                }
+            }
+            ++m_p;
+        }
+        return false;
+    }
+private:
+    const char* m_p;
+    const char* m_end;
+    std::string& m_scratch;
+    JsonHandler& m_handler;
+    int m_maxDepth;
+};
+
+}
+
+bool JsonReader::Parse(std::string_view in, std::string& scratch
+                       ,JsonHandler& handler, int max_depth) {
+    // 反转义结果不会比原文长, 预留后 scratch 不会重新分配, 已回调的视图保持有效
+    if (memchr(in.data(), '\\', in.size())
+            && scratch.capacity() < scratch.size() + in.size()) {
+        scratch.reserve(scratch.size() + in.size());
+    }
+    return JsonParser(in, scratch, handler, max_depth).parse();
+}
+
+JsonWriter::JsonWriter(std::string& out)
+    :m_out(out) {
+}
+
+void JsonWriter::separator() {
+    if (m_afterKey) {
+        m_afterKey = false;
+        return;
+    }
+    uint64_t bit = 1ull << (m_depth & 63);
+    if (m_hasElem & bit) {
+        m_out.push_back(',');
+    }
+    m_hasElem |= bit;
+}
+
+JsonWriter& JsonWriter::startObject() {
+    separator();
+    m_out.push_back('{');
+    ++m_depth;
+    m_hasElem &= ~(1ull << (m_depth & 63));
+    return *this;
+}
+
+JsonWriter& JsonWriter::endObject() {
+    m_out.push_back('}');
+    --m_depth;
+    return *this;
+}
+
+JsonWriter& JsonWriter::startArray() {
+    separator();
+    m_out.push_back('[');
+    ++m_depth;
+    m_hasElem &= ~(1ull << (m_depth & 63));
+    return *this;
+}
+
+JsonWriter& JsonWriter::endArray() {
+    m_out.push_back(']');
+    --m_depth;
+    return *this;
+}
+
+JsonWriter& JsonWriter::key(std::string_view k) {
+    separator();
+    AppendEscaped(m_out, k);
+    m_out.push_back(':');
+    m_afterKey = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(std::string_view v) {
+    separator();
+    AppendEscaped(m_out, v);
+    return *this;
+}
+
+JsonWriter& JsonWriter::raw(std::string_view json) {
+    separator();
+    m_out.append(json.data(), json.size());
+    return *this;
+}
+
+void JsonWriter::AppendEscaped(std::string& out, std::string_view v) {
+    static const char* s_hex = "0123456789abcdef";
+    out.push_back('"');
+    size_t last = 0;
+    for (size_t i = 0; i < v.size(); ++i) {
+        unsigned char c = v[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        out.append(v.data() + last, i - last);
+        last = i + 1;
+        switch (c) {
+            case '"':
+                out.append("\\\"", 2);
+                break;
+            case '\\':
+                out.append("\\\\", 2);
+                break;
+            case '\n':
+                out.append("\\n", 2);
+                break;
+            case '\r':
+                out.append("\\r", 2);
+                break;
+            case '\t':
+                out.append("\\t", 2);
+                break;
+            default: {
+                char buf[6] = {'\\', 'u', '0', '0', s_hex[c >> 4], s_hex[c & 0xF]};
+                out.append(buf, sizeof(buf));
+                break;
+            }
+        }
+    }
+    out.append(v.data() + last, v.size() - last);
+    out.push_back('"');
+}
+
+}
+}
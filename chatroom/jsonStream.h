@@ -0,0 +1,69 @@
+#ifndef __CHAT_JSON_STREAM_H__
+#define __CHAT_JSON_STREAM_H__
+
+#include <string>
+#include <string_view>
+#include <stdint.h>
+
+namespace chat {
+namespace http {
+
+// SAX 风格 JSON 解析回调, 返回 false 终止解析
+class JsonHandler {
+public:
+    enum ValueType {
+        STRING = 0,
+        NUMBER,
+        BOOL,
+        NULLVAL,
+        // 超过 max_depth 的对象/数组, 以原始 JSON 文本回调
+        RAW
+    };
+
+    virtual ~JsonHandler() {}
+    virtual bool onStartObject() { return true;}
+    virtual bool onEndObject() { return true;}
+    virtual bool onStartArray() { return true;}
+    virtual bool onEndArray() { return true;}
+    virtual bool onKey(std::string_view key) = 0;
+    virtual bool onValue(std::string_view val, ValueType type) = 0;
+};
+
+class JsonReader {
+public:
+    /// 流式解析 in, 不构建 DOM; 回调拿到的视图指向 in 或 scratch(存放反转义后的字符串)
+    /// 嵌套超过 max_depth 层的对象/数组不再展开, 以 RAW 回调原文
+    static bool Parse(std::string_view in, std::string& scratch
+                      ,JsonHandler& handler, int max_depth = 64);
+};
+
+// 直接向调用方的缓冲(通常是 WSFrame::NewBuffer 得到的帧缓冲)追加 JSON 文本
+class JsonWriter {
+public:
+    JsonWriter(std::string& out);
+
+    JsonWriter& startObject();
+    JsonWriter& endObject();
+    JsonWriter& startArray();
+    JsonWriter& endArray();
+    JsonWriter& key(std::string_view k);
+    JsonWriter& value(std::string_view v);
+    JsonWriter& kv(std::string_view k, std::string_view v) { return key(k).value(v);}
+    /// 原样写入一段完整的 JSON(对象/数组等), 调用方保证其合法
+    JsonWriter& raw(std::string_view json);
+
+    static void AppendEscaped(std::string& out, std::string_view v);
+private:
+    void separator();
+private:
+    std::string& m_out;
+    // 每层一位, 该层已写过元素时置 1
+    uint64_t m_hasElem = 0;
+    int m_depth = 0;
+    bool m_afterKey = false;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,665 @@
+#include "messageStore.h"
+#include "metrics.h"
+#include <chat/config.h>
+#include <chat/endian.h>
+#include <chat/iomanager.h>
+#include <chat/log.h>
+#include <chat/util.h>
+#include <chat/worker.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace chat {
+namespace http {
+
+static chat::Logger::ptr g_logger = CHAT_LOG_ROOT();
+
+static chat::ConfigVar<std::string>::ptr g_history_worker =
+    chat::Config::Lookup("chat.history.worker"
+            ,std::string("history")
+            , "worker running the history commit fiber, current iomanager if missing");
+
+static chat::ConfigVar<uint32_t>::ptr g_history_commit_ms =
+    chat::Config::Lookup("chat.history.commit_ms"
+            ,(uint32_t)5
+            , "group commit window in ms, 0 commit as soon as the worker runs");
+
+static chat::ConfigVar<bool>::ptr g_history_fsync =
+    chat::Config::Lookup("chat.history.fsync"
+            ,true
+            , "fdatasync each written segment once per group commit");
+
+static chat::ConfigVar<uint64_t>::ptr g_history_segment_bytes =
+    chat::Config::Lookup("chat.history.segment_bytes"
+            ,(uint64_t)(64 * 1024 * 1024)
+            , "roll to a new segment file after bytes, at most 4GB");
+
+static chat::ConfigVar<uint32_t>::ptr g_history_index_interval =
+    chat::Config::Lookup("chat.history.index_interval"
+            ,(uint32_t)4096
+            , "bytes of log between sparse index entries");
+
+static chat::ConfigVar<uint32_t>::ptr g_history_max_open =
+    chat::Config::Lookup("chat.history.max_open"
+            ,(uint32_t)1024
+            , "conversations kept open, least recently used idle ones beyond this are closed, 0 unlimited");
+
+static chat::Counter::ptr s_records = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_history_records_total", "messages written to the history log");
+static chat::Counter::ptr s_write_errors = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_history_write_errors_total", "messages lost by failed history writes");
+static chat::Histogram::ptr s_commit_batch = chat::MetricsMgr::GetInstance()->getHistogram(
+        "chat_history_commit_batch", "messages per history group commit");
+static chat::Counter::ptr s_evictions = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_history_evictions_total", "idle conversations closed to stay within chat.history.max_open");
+
+template<class T>
+static void AppendInt(std::string& out, T v) {
+    v = chat::byteswapOnLittleEndian(v);
+    out.append((const char*)&v, sizeof(v));
+}
+
+template<class T>
+static T ReadInt(const char* p) {
+    T v;
+    memcpy(&v, p, sizeof(v));
+    return chat::byteswapOnLittleEndian(v);
+}
+
+// CRC-32(IEEE 802.3), 结果与 zlib 的 crc32 相同
+static uint32_t Crc32(uint32_t crc, const char* data, size_t len) {
+    static const std::vector<uint32_t> s_table = [](){
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc = s_table[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// head 为完整记录头, 校验范围从 offset 开始
+static bool CheckRecord(const char* head, const std::string& data) {
+    uint32_t crc = Crc32(0, head + 8, LogSegment::HEADER_SIZE - 8);
+    crc = Crc32(crc, data.data(), data.size());
+    return crc == ReadInt<uint32_t>(head + 4);
+}
+
+static bool PWriteAll(int fd, const char* data, size_t len, uint64_t pos) {
+    while (len > 0) {
+        ssize_t rt = ::pwrite(fd, data, len, pos);
+        if (rt < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += rt;
+        len -= rt;
+        pos += rt;
+    }
+    return true;
+}
+
+static bool PReadAll(int fd, char* data, size_t len, uint64_t pos) {
+    while (len > 0) {
+        ssize_t rt = ::pread(fd, data, len, pos);
+        if (rt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rt <= 0) {
+            return false;
+        }
+        data += rt;
+        len -= rt;
+        pos += rt;
+    }
+    return true;
+}
+
+static uint64_t FileSize(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 ? st.st_size : 0;
+}
+
+// 会话 key 含用户输入, 按十六进制作为目录名
+static std::string DirName(const std::string& key) {
+    static const char* s_hex = "0123456789abcdef";
+    std::string rt;
+    rt.reserve(key.size() * 2);
+    for (unsigned char c : key) {
+        rt.push_back(s_hex[c >> 4]);
+        rt.push_back(s_hex[c & 0xf]);
+    }
+    return rt;
+}
+
+static std::string SegmentName(uint64_t base) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%020lu", (unsigned long)base);
+    return buf;
+}
+
+LogFile::ptr LogFile::Open(const std::string& path, int flags) {
+    int fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+    return fd < 0 ? nullptr : LogFile::ptr(new LogFile(fd));
+}
+
+LogFile::~LogFile() {
+    ::close(m_fd);
+}
+
+LogSegment::LogSegment(const std::string& dir, uint64_t base)
+    :m_dir(dir)
+    ,m_base(base)
+    ,m_next(base) {
+}
+
+std::string LogSegment::getName() const {
+    return m_dir + "/" + SegmentName(m_base);
+}
+
+void LogSegment::Encode(std::string& out, uint64_t offset, uint64_t time, const std::string& data) {
+    size_t start = out.size();
+    AppendInt(out, (uint32_t)data.size());
+    AppendInt(out, (uint32_t)0);
+    AppendInt(out, offset);
+    AppendInt(out, time);
+    out.append(data);
+    uint32_t crc = Crc32(0, &out[start + 8], out.size() - start - 8);
+    crc = chat::byteswapOnLittleEndian(crc);
+    memcpy(&out[start + 4], &crc, sizeof(crc));
+}
+
+bool LogSegment::open(bool active) {
+    std::string name = getName();
+    m_log = LogFile::Open(name + ".log", O_RDWR | O_CREAT);
+    m_idx = m_log ? LogFile::Open(name + ".idx", O_RDWR | O_CREAT) : nullptr;
+    if (!m_log || !m_idx) {
+        CHAT_LOG_ERROR(g_logger) << "open history segment " << name << " fail, errno="
+            << errno << " errstr=" << strerror(errno);
+        return false;
+    }
+
+    uint64_t file_size = FileSize(m_log->getFd());
+    uint64_t idx_size = FileSize(m_idx->getFd());
+    std::string buf(idx_size, '\0');
+    if (idx_size && !PReadAll(m_idx->getFd(), &buf[0], idx_size, 0)) {
+        return false;
+    }
+    // 索引晚于日志写入, 崩溃后可能少几项, 指向日志尾部之外或不递增的项丢弃
+    for (size_t i = 0; i + 8 <= buf.size(); i += 8) {
+        uint32_t rel = ReadInt<uint32_t>(&buf[i]);
+        uint32_t pos = ReadInt<uint32_t>(&buf[i + 4]);
+        if (pos >= file_size || (!m_index.empty()
+                    && (rel <= m_index.back().first || pos <= m_index.back().second))) {
+            break;
+        }
+        m_index.push_back({rel, pos});
+    }
+    if (m_index.size() * 8 != idx_size) {
+        if (ftruncate(m_idx->getFd(), m_index.size() * 8) != 0) {
+            return false;
+        }
+    }
+
+    if (!active) {
+        m_size = file_size;
+        seal();
+        return true;
+    }
+    return scan(m_index.empty() ? 0 : m_index.back().second, file_size);
+}
+
+// 从 pos 起逐条校验, 得到下一条的 offset, 从第一条写了一半或校验失败的记录起截掉
+bool LogSegment::scan(uint64_t pos, uint64_t file_size) {
+    uint64_t next = m_base + (m_index.empty() ? 0 : m_index.back().first);
+    char head[HEADER_SIZE];
+    std::string data;
+    while (pos + HEADER_SIZE <= file_size) {
+        if (!PReadAll(m_log->getFd(), head, HEADER_SIZE, pos)) {
+            return false;
+        }
+        uint32_t len = ReadInt<uint32_t>(head);
+        uint64_t offset = ReadInt<uint64_t>(head + 8);
+        if (offset != next || pos + HEADER_SIZE + len > file_size) {
+            break;
+        }
+        data.resize(len);
+        if (len && !PReadAll(m_log->getFd(), &data[0], len, pos + HEADER_SIZE)) {
+            return false;
+        }
+        if (!CheckRecord(head, data)) {
+            break;
+        }
+        pos += HEADER_SIZE + len;
+        ++next;
+    }
+    if (pos < file_size) {
+        CHAT_LOG_WARN(g_logger) << "history segment " << getName()
+            << " truncate torn or corrupt tail from " << file_size << " to " << pos;
+        if (ftruncate(m_log->getFd(), pos) != 0) {
+            return false;
+        }
+    }
+    m_size = pos;
+    m_next = next;
+    return true;
+}
+
+bool LogSegment::append(const std::string& records
+                        ,const std::vector<std::pair<uint32_t, uint32_t> >& index) {
+    if (!m_log || !PWriteAll(m_log->getFd(), records.data(), records.size(), m_size)) {
+        CHAT_LOG_ERROR(g_logger) << "write history segment " << getName()
+            << " fail, errno=" << errno << " errstr=" << strerror(errno);
+        return false;
+    }
+    m_dirty = true;
+    if (index.empty()) {
+        return true;
+    }
+    std::string buf;
+    buf.reserve(index.size() * 8);
+    for (auto& i : index) {
+        AppendInt(buf, i.first);
+        AppendInt(buf, i.second);
+    }
+    // 索引写失败只影响查找速度, 重启时按日志恢复
+    if (!PWriteAll(m_idx->getFd(), buf.data(), buf.size(), m_index.size() * 8)) {
+        CHAT_LOG_WARN(g_logger) << "write history index " << getName()
+            << " fail, errno=" << errno << " errstr=" << strerror(errno);
+    }
+    return true;
+}
+
+bool LogSegment::sync() {
+    if (!m_dirty || !m_log) {
+        return true;
+    }
+    if (fdatasync(m_log->getFd()) != 0) {
+        CHAT_LOG_ERROR(g_logger) << "fdatasync history segment " << getName()
+            << " fail, errno=" << errno << " errstr=" << strerror(errno);
+        return false;
+    }
+    m_dirty = false;
+    return true;
+}
+
+void LogSegment::seal() {
+    // 正在读取的读者各自持有文件, 读完后才真正关闭
+    m_log.reset();
+    m_idx.reset();
+}
+
+LogFile::ptr LogSegment::openFile() const {
+    auto file = LogFile::Open(getName() + ".log", O_RDONLY);
+    if (!file) {
+        CHAT_LOG_ERROR(g_logger) << "open history segment " << getName() << " fail, errno="
+            << errno << " errstr=" << strerror(errno);
+    }
+    return file;
+}
+
+void LogSegment::commit(uint64_t count, uint64_t bytes
+                        ,const std::vector<std::pair<uint32_t, uint32_t> >& index) {
+    m_next += count;
+    m_size += bytes;
+    m_index.insert(m_index.end(), index.begin(), index.end());
+}
+
+uint64_t LogSegment::seek(uint64_t offset) const {
+    if (offset <= m_base) {
+        return 0;
+    }
+    uint32_t rel = offset - m_base;
+    auto it = std::upper_bound(m_index.begin(), m_index.end(), rel
+            ,[](uint32_t v, const std::pair<uint32_t, uint32_t>& e) {
+                return v < e.first;
+            });
+    return it == m_index.begin() ? 0 : (it - 1)->second;
+}
+
+bool LogSegment::read(LogFile::ptr file, uint64_t pos, uint64_t size, uint64_t from, uint64_t to
+                      ,std::vector<HistoryRecord>& out) const {
+    char head[HEADER_SIZE];
+    while (pos + HEADER_SIZE <= size) {
+        if (!PReadAll(file->getFd(), head, HEADER_SIZE, pos)) {
+            return false;
+        }
+        uint32_t len = ReadInt<uint32_t>(head);
+        uint64_t offset = ReadInt<uint64_t>(head + 8);
+        if (offset >= to) {
+            break;
+        }
+        if (offset >= from) {
+            HistoryRecord rec;
+            rec.offset = offset;
+            rec.time = ReadInt<uint64_t>(head + 16);
+            rec.data.resize(len);
+            if (len && !PReadAll(file->getFd(), &rec.data[0], len, pos + HEADER_SIZE)) {
+                return false;
+            }
+            if (!CheckRecord(head, rec.data)) {
+                CHAT_LOG_ERROR(g_logger) << "history segment " << getName()
+                    << " crc mismatch at " << pos << " offset=" << offset;
+                return false;
+            }
+            out.push_back(std::move(rec));
+        }
+        pos += HEADER_SIZE + len;
+    }
+    return true;
+}
+
+MessageStore::MessageStore(const std::string& path)
+    :m_path(path) {
+}
+
+std::string MessageStore::PairKey(const std::string& a, const std::string& b) {
+    return a < b ? "pair:" + a + "|" + b : "pair:" + b + "|" + a;
+}
+
+void MessageStore::append(const std::string& key, std::string data) {
+    chat::Mutex::Lock lock(m_mutex);
+    m_pending.push_back({key, chat::GetCurrentMS(), std::move(data)});
+    if (m_stopped) {
+        lock.unlock();
+        commit();
+        return;
+    }
+    if (m_armed) {
+        return;
+    }
+    m_armed = true;
+    lock.unlock();
+
+    auto worker = chat::WorkerMgr::GetInstance()->getAsIOManager(g_history_worker->getValue());
+    chat::IOManager* iom = worker ? worker.get() : chat::IOManager::GetThis();
+    uint32_t commit_ms = g_history_commit_ms->getValue();
+    if (!iom) {
+        commit();
+    } else if (commit_ms == 0) {
+        iom->schedule(std::bind(&MessageStore::commit, this));
+    } else {
+        iom->addTimer(commit_ms, std::bind(&MessageStore::commit, this));
+    }
+}
+
+void MessageStore::flush() {
+    commit();
+}
+
+void MessageStore::stop() {
+    {
+        chat::Mutex::Lock lock(m_mutex);
+        m_stopped = true;
+    }
+    commit();
+
+    // chat.history.fsync 关闭时分段只写到页缓存, 退出前统一落盘
+    std::vector<Conversation::ptr> convs;
+    {
+        chat::RWMutex::ReadLock lock(m_convMutex);
+        for (auto& i : m_convs) {
+            convs.push_back(i.second);
+        }
+    }
+    chat::Mutex::Lock commit_lock(m_commitMutex);
+    for (auto& conv : convs) {
+        for (auto& seg : conv->segments) {
+            seg->sync();
+        }
+    }
+}
+
+void MessageStore::commit() {
+    chat::Mutex::Lock commit_lock(m_commitMutex);
+    std::vector<Pending> pending;
+    {
+        chat::Mutex::Lock lock(m_mutex);
+        pending.swap(m_pending);
+        m_armed = false;
+    }
+    if (pending.empty()) {
+        return;
+    }
+    s_commit_batch->record(pending.size());
+
+    // 按会话分组, 组内保持到达顺序
+    std::vector<std::pair<std::string, std::vector<Pending*> > > groups;
+    std::unordered_map<std::string, size_t> idx;
+    for (auto& i : pending) {
+        auto it = idx.emplace(i.key, groups.size());
+        if (it.second) {
+            groups.push_back({i.key, {}});
+        }
+        groups[it.first->second].second.push_back(&i);
+    }
+    for (auto& i : groups) {
+        auto conv = getConversation(i.first, true);
+        if (conv && write(conv, i.second)) {
+            s_records->inc(i.second.size());
+        } else {
+            s_write_errors->inc(i.second.size());
+        }
+    }
+}
+
+bool MessageStore::write(Conversation::ptr conv, const std::vector<Pending*>& items) {
+    uint64_t segment_bytes = std::min<uint64_t>(g_history_segment_bytes->getValue(), UINT32_MAX);
+    uint64_t interval = g_history_index_interval->getValue();
+    bool fsync = g_history_fsync->getValue();
+
+    // 只有提交协程修改分段, 这里读取不加锁
+    LogSegment::ptr seg = conv->segments.empty() ? nullptr : conv->segments.back();
+    std::string buf;
+    std::vector<std::pair<uint32_t, uint32_t> > index;
+    uint64_t count = 0;
+    // 写成功后才提交到 conv, 失败时下一批从上次成功的状态重新计算
+    uint64_t last_index_pos = conv->lastIndexPos;
+    auto flush_chunk = [&]() {
+        if (count == 0) {
+            return true;
+        }
+        if (!seg->append(buf, index) || (fsync && !seg->sync())) {
+            return false;
+        }
+        chat::Mutex::Lock lock(conv->mutex);
+        seg->commit(count, buf.size(), index);
+        conv->lastIndexPos = last_index_pos;
+        buf.clear();
+        index.clear();
+        count = 0;
+        return true;
+    };
+
+    for (auto i : items) {
+        uint64_t rec_size = LogSegment::HEADER_SIZE + i->data.size();
+        if (!seg || (seg->getSize() + buf.size() > 0
+                    && seg->getSize() + buf.size() + rec_size > segment_bytes)) {
+            if (seg && !flush_chunk()) {
+                return false;
+            }
+            auto next = std::make_shared<LogSegment>(conv->dir, seg ? seg->getNext() : 0);
+            if (!next->open(true)) {
+                return false;
+            }
+            // 旧分段不再追加, 落盘后关闭, 之后的读取临时打开
+            if (seg) {
+                seg->sync();
+            }
+            // 新分段为空, 还没有索引项
+            chat::Mutex::Lock lock(conv->mutex);
+            if (seg) {
+                seg->seal();
+            }
+            conv->segments.push_back(next);
+            conv->lastIndexPos = 0;
+            last_index_pos = 0;
+            seg = next;
+        }
+        uint64_t pos = seg->getSize() + buf.size();
+        uint64_t offset = seg->getNext() + count;
+        if (pos == 0 || pos - last_index_pos >= interval) {
+            index.push_back({(uint32_t)(offset - seg->getBase()), (uint32_t)pos});
+            last_index_pos = pos;
+        }
+        LogSegment::Encode(buf, offset, i->time, i->data);
+        ++count;
+    }
+    return flush_chunk();
+}
+
+Conversation::ptr MessageStore::getConversation(const std::string& key, bool create) {
+    {
+        chat::RWMutex::ReadLock lock(m_convMutex);
+        auto it = m_convs.find(key);
+        if (it != m_convs.end()) {
+            it->second->lastUse.store(++m_useTick, std::memory_order_relaxed);
+            return it->second;
+        }
+    }
+
+    chat::RWMutex::WriteLock lock(m_convMutex);
+    auto it = m_convs.find(key);
+    if (it != m_convs.end()) {
+        it->second->lastUse.store(++m_useTick, std::memory_order_relaxed);
+        return it->second;
+    }
+    std::string dir = m_path + "/" + DirName(key);
+    if (!create && access(dir.c_str(), F_OK) != 0) {
+        return nullptr;
+    }
+    if (!chat::FSUtil::Mkdir(dir)) {
+        CHAT_LOG_ERROR(g_logger) << "mkdir history dir " << dir << " fail, errno="
+            << errno << " errstr=" << strerror(errno);
+        return nullptr;
+    }
+
+    Conversation::ptr conv = std::make_shared<Conversation>();
+    conv->key = key;
+    conv->dir = dir;
+    conv->lastUse = ++m_useTick;
+    std::vector<std::string> files;
+    chat::FSUtil::ListAllFile(files, dir, ".log");
+    std::vector<uint64_t> bases;
+    for (auto& i : files) {
+        auto name = i.substr(i.rfind('/') + 1);
+        bases.push_back(strtoull(name.c_str(), nullptr, 10));
+    }
+    std::sort(bases.begin(), bases.end());
+    for (size_t i = 0; i < bases.size(); ++i) {
+        // 只有最后一个分段可能有未写完的尾部
+        auto seg = std::make_shared<LogSegment>(dir, bases[i]);
+        if (!seg->open(i + 1 == bases.size())) {
+            return nullptr;
+        }
+        conv->segments.push_back(seg);
+    }
+    if (!conv->segments.empty()) {
+        // 恢复后从最后一个索引项继续计算间隔
+        auto& last = conv->segments.back();
+        conv->lastIndexPos = last->seek(last->getNext());
+    }
+    m_convs[key] = conv;
+
+    std::vector<Conversation::ptr> evicted;
+    evictLocked(g_history_max_open->getValue(), evicted);
+    lock.unlock();
+    // 移出表后只有这里持有, 提交协程和读者都拿不到, 落盘后随 evicted 释放关闭文件
+    for (auto& i : evicted) {
+        chat::Mutex::Lock conv_lock(i->mutex);
+        if (!i->segments.empty()) {
+            i->segments.back()->sync();
+        }
+    }
+    s_evictions->inc(evicted.size());
+    return conv;
+}
+
+void MessageStore::evictLocked(size_t max_open, std::vector<Conversation::ptr>& evicted) {
+    if (max_open == 0 || m_convs.size() <= max_open) {
+        return;
+    }
+    typedef std::unordered_map<std::string, Conversation::ptr>::iterator Iterator;
+    // 只有表中持有的会话是空闲的, 提交协程或读者正在用的不关闭, 表可以暂时超过上限
+    std::vector<Iterator> idle;
+    for (auto it = m_convs.begin(); it != m_convs.end(); ++it) {
+        if (it->second.use_count() == 1) {
+            idle.push_back(it);
+        }
+    }
+    size_t n = std::min(idle.size(), m_convs.size() - max_open);
+    std::nth_element(idle.begin(), idle.begin() + n, idle.end()
+            ,[](const Iterator& a, const Iterator& b) {
+                return a->second->lastUse.load(std::memory_order_relaxed)
+                    < b->second->lastUse.load(std::memory_order_relaxed);
+            });
+    for (size_t i = 0; i < n; ++i) {
+        evicted.push_back(idle[i]->second);
+        m_convs.erase(idle[i]);
+    }
+}
+
+bool MessageStore::read(const std::string& key, uint64_t before, uint32_t limit
+                        ,std::vector<HistoryRecord>& out) {
+    auto conv = getConversation(key, false);
+    if (!conv || limit == 0) {
+        return true;
+    }
+
+    struct Range {
+        LogSegment::ptr seg;
+        LogFile::ptr file;
+        uint64_t pos;
+        uint64_t size;
+    };
+    std::vector<Range> ranges;
+    uint64_t from = 0;
+    {
+        chat::Mutex::Lock lock(conv->mutex);
+        auto& segs = conv->segments;
+        if (segs.empty()) {
+            return true;
+        }
+        uint64_t end = segs.back()->getNext();
+        uint64_t first = segs.front()->getBase();
+        if (before == 0 || before > end) {
+            before = end;
+        }
+        from = before > first + limit ? before - limit : first;
+        for (size_t i = 0; i < segs.size() && from < before; ++i) {
+            uint64_t seg_end = i + 1 < segs.size() ? segs[i + 1]->getBase() : end;
+            if (seg_end <= from || segs[i]->getBase() >= before) {
+                continue;
+            }
+            ranges.push_back({segs[i], segs[i]->getFile(), segs[i]->seek(from), segs[i]->getSize()});
+        }
+    }
+    // 已提交的部分只追加不修改, 读文件不持锁; 已封存的分段在锁外打开
+    for (auto& i : ranges) {
+        if (!i.file) {
+            i.file = i.seg->openFile();
+        }
+        if (!i.file || !i.seg->read(i.file, i.pos, i.size, from, before, out)) {
+            CHAT_LOG_ERROR(g_logger) << "read history " << key << " fail, errno="
+                << errno << " errstr=" << strerror(errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+}
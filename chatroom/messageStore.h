@@ -0,0 +1,158 @@
+#ifndef __CHAT_MESSAGE_STORE_H__
+#define __CHAT_MESSAGE_STORE_H__
+
+#include "protocol.h"
+#include <chat/mutex.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace chat {
+namespace http {
+
+// 打开的文件, 最后一个持有者释放时关闭
+// 读者持有它读文件, 期间分段被封存或会话被关闭也不影响
+class LogFile {
+public:
+    typedef std::shared_ptr<LogFile> ptr;
+    /// 打开失败返回 nullptr, errno 为失败原因
+    static LogFile::ptr Open(const std::string& path, int flags);
+    ~LogFile();
+
+    int getFd() const { return m_fd;}
+private:
+    LogFile(int fd) :m_fd(fd) {}
+private:
+    int m_fd;
+};
+
+// 消息日志的一个分段: <base>.log 存消息记录, <base>.idx 为稀疏索引
+// 记录: u32 payload len | u32 crc | u64 offset | u64 time(ms) | payload, 整数为网络字节序
+// crc 为 CRC-32(IEEE), 覆盖 crc 之后的 offset/time/payload
+// 索引项: u32 offset - base | u32 记录在 .log 中的位置, 每隔 chat.history.index_interval 字节记一项
+// 只有会话的最后一个分段(活动分段)常开文件, 之前的分段已封存, 读取时临时打开
+class LogSegment {
+public:
+    typedef std::shared_ptr<LogSegment> ptr;
+    static const size_t HEADER_SIZE = 24;
+
+    LogSegment(const std::string& dir, uint64_t base);
+
+    /// 编码一条记录追加到 out
+    static void Encode(std::string& out, uint64_t offset, uint64_t time, const std::string& data);
+
+    /// 打开或创建文件并加载索引
+    /// active 为 true 时扫描索引之后的记录, 从第一条不完整或校验失败的记录起截掉, 并保持文件打开供追加;
+    /// 否则加载完即关闭文件
+    bool open(bool active);
+
+    uint64_t getBase() const { return m_base;}
+    /// 以下两项由 Conversation 的锁保护
+    uint64_t getNext() const { return m_next;}
+    uint64_t getSize() const { return m_size;}
+
+    /// 写入已编码好的连续记录, 只由提交协程调用; 写成功后才对读者可见
+    bool append(const std::string& records
+                ,const std::vector<std::pair<uint32_t, uint32_t> >& index);
+    /// 有写入时才 fdatasync
+    bool sync();
+    /// 不再追加, 关闭文件, 调用方需先 sync 并持有 Conversation 的锁
+    void seal();
+    /// 活动分段的文件, 已封存时返回 nullptr, 调用方需持有 Conversation 的锁
+    LogFile::ptr getFile() const { return m_log;}
+    /// 只读打开 .log, 用于读取已封存的分段
+    LogFile::ptr openFile() const;
+    /// 已提交状态, 调用方需持有 Conversation 的锁
+    void commit(uint64_t count, uint64_t bytes
+                ,const std::vector<std::pair<uint32_t, uint32_t> >& index);
+
+    /// 不晚于 offset 的记录位置, 调用方需持有 Conversation 的锁
+    uint64_t seek(uint64_t offset) const;
+    /// 从 file 的 pos 开始读取 [from, to) 范围内的记录, 不超过 size, 校验失败返回 false
+    bool read(LogFile::ptr file, uint64_t pos, uint64_t size, uint64_t from, uint64_t to
+              ,std::vector<HistoryRecord>& out) const;
+private:
+    std::string getName() const;
+    bool scan(uint64_t pos, uint64_t file_size);
+private:
+    std::string m_dir;
+    uint64_t m_base;
+    LogFile::ptr m_log;
+    LogFile::ptr m_idx;
+    uint64_t m_next;
+    uint64_t m_size = 0;
+    // 上次 sync 之后有写入, 只由提交协程访问
+    bool m_dirty = false;
+    std::vector<std::pair<uint32_t, uint32_t> > m_index;
+};
+
+// 一个会话(房间/群聊/两人私聊)的消息日志, 目录下按 offset 分段
+struct Conversation {
+    typedef std::shared_ptr<Conversation> ptr;
+    std::string key;
+    std::string dir;
+    // 保护分段列表和各分段的已提交状态
+    chat::Mutex mutex;
+    std::vector<LogSegment::ptr> segments;
+    // 最后一个分段内, 上一个已写入的索引项的位置, 只由提交协程访问
+    uint64_t lastIndexPos = 0;
+    // 最近一次使用的序号, 超过 chat.history.max_open 时关闭最久未用的会话
+    std::atomic<uint64_t> lastUse{0};
+};
+
+// 追加写的消息历史
+// append 只入队, 由 chat.history.worker 上的提交协程每 chat.history.commit_ms 合并写一次,
+// 同一批内每个会话一次 write, 开启 chat.history.fsync 时每个会话一次 fdatasync
+class MessageStore {
+public:
+    typedef std::shared_ptr<MessageStore> ptr;
+
+    MessageStore(const std::string& path);
+
+    static std::string GroupKey() { return "group";}
+    /// 按房间的创建序号区分, 删除后重建的同名房间看不到之前的历史
+    static std::string RoomKey(const std::string& room, uint64_t incarnation) {
+        return "room:" + room + "#" + std::to_string(incarnation);
+    }
+    /// 两人私聊, 与参数顺序无关
+    static std::string PairKey(const std::string& a, const std::string& b);
+
+    void append(const std::string& key, std::string data);
+    /// 读取 offset < before 的最多 limit 条, before 为 0 表示从最新一条开始, 结果按 offset 升序
+    bool read(const std::string& key, uint64_t before, uint32_t limit
+              ,std::vector<HistoryRecord>& out);
+    /// 立即写出队列中的消息
+    void flush();
+    /// 关闭前调用: 写出队列中的消息并 fdatasync 所有有写入的分段, 之后的 append 直接写入
+    void stop();
+private:
+    struct Pending {
+        std::string key;
+        uint64_t time;
+        std::string data;
+    };
+
+    Conversation::ptr getConversation(const std::string& key, bool create);
+    /// 从表中移除最久未用的空闲会话, 直到不超过 max_open, 调用方需持有 m_convMutex 写锁
+    void evictLocked(size_t max_open, std::vector<Conversation::ptr>& evicted);
+    void commit();
+    bool write(Conversation::ptr conv, const std::vector<Pending*>& items);
+private:
+    std::string m_path;
+    chat::Mutex m_mutex;
+    std::vector<Pending> m_pending;
+    bool m_armed = false;
+    bool m_stopped = false;
+    chat::RWMutex m_convMutex;
+    std::unordered_map<std::string, Conversation::ptr> m_convs;
+    std::atomic<uint64_t> m_useTick{0};
+    // 定时提交与 flush 可能同时到来, 写文件串行进行
+    chat::Mutex m_commitMutex;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,98 @@
+#include "messageTrace.h"
+#include <chat/config.h>
+
+namespace chat {
+namespace http {
+
+static chat::ConfigVar<uint32_t>::ptr g_latency_sample_every =
+    chat::Config::Lookup("chat.latency.sample_every"
+            ,(uint32_t)1
+            , "trace 1 of every N messages, 0 disable");
+
+static std::atomic<uint32_t> s_sample_every{1};
+static std::atomic<uint64_t> s_sample_count{0};
+static chat::Histogram::ptr s_phases[MessageType::TYPE_COUNT][MessageTrace::PHASE_COUNT];
+
+struct _MessageTraceIniter {
+    _MessageTraceIniter() {
+        s_sample_every.store(g_latency_sample_every->getValue(), std::memory_order_relaxed);
+        g_latency_sample_every->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            s_sample_every.store(new_value, std::memory_order_relaxed);
+        });
+    }
+};
+
+static _MessageTraceIniter s_message_trace_initer;
+
+const char* MessageTrace::PhaseToString(Phase p) {
+    switch (p) {
+#define XX(name, str) \
+        case name: \
+            return #str;
+        XX(PARSE, parse);
+        XX(DISPATCH, dispatch);
+        XX(FANOUT, fanout);
+        XX(WRITE, write);
+        XX(TOTAL, total);
+#undef XX
+        default:
+            return "unknown";
+    }
+}
+
+void MessageTrace::Enable(MessageType::Type type) {
+    if (type <= MessageType::UNKNOWN || type >= MessageType::TYPE_COUNT) {
+        return;
+    }
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        if (s_phases[type][i]) {
+            continue;
+        }
+        s_phases[type][i] = chat::MetricsMgr::GetInstance()->getHistogram("chat_message_latency_ns"
+                , "message latency from frame receipt to the last recipient write, by phase"
+                , std::string("type=\"") + MessageType::ToString(type)
+                    + "\",phase=\"" + PhaseToString((Phase)i) + "\"");
+    }
+}
+
+MessageTrace::ptr MessageTrace::Create(MessageType::Type type, uint64_t start_ns) {
+    uint32_t every = s_sample_every.load(std::memory_order_relaxed);
+    if (!every || !s_phases[type][0]) {
+        return nullptr;
+    }
+    if (every > 1 && s_sample_count.fetch_add(1, std::memory_order_relaxed) % every) {
+        return nullptr;
+    }
+    return std::make_shared<MessageTrace>(type, start_ns);
+}
+
+MessageTrace::MessageTrace(MessageType::Type type, uint64_t start_ns)
+    :m_type(type)
+    ,m_start(start_ns)
+    ,m_last(start_ns) {
+}
+
+MessageTrace::~MessageTrace() {
+    uint64_t last_write = m_lastWrite.load(std::memory_order_relaxed);
+    // 没有任何接收者写出时(无接收者或全部丢弃)不计入
+    if (last_write == 0) {
+        return;
+    }
+    s_phases[m_type][WRITE]->record(last_write > m_last ? last_write - m_last : 0);
+    s_phases[m_type][TOTAL]->record(last_write - m_start);
+}
+
+void MessageTrace::mark(Phase phase) {
+    uint64_t now = chat::MonotonicNs();
+    s_phases[m_type][phase]->record(now - m_last);
+    m_last = now;
+}
+
+void MessageTrace::onWrite(uint64_t now_ns) {
+    uint64_t v = m_lastWrite.load(std::memory_order_relaxed);
+    while (now_ns > v && !m_lastWrite.compare_exchange_weak(v, now_ns, std::memory_order_relaxed)) {
+    }
+}
+
+}
+}
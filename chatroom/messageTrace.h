@@ -0,0 +1,54 @@
+#ifndef __CHAT_MESSAGE_TRACE_H__
+#define __CHAT_MESSAGE_TRACE_H__
+
+#include "protocol.h"
+#include "metrics.h"
+#include <atomic>
+#include <memory>
+
+namespace chat {
+namespace http {
+
+// 一条消息从收到帧到最后一个接收者写出 socket 的分阶段耗时(纳秒)
+// 随 ChatMessage 传给编码出的 WSFrame, 最后一个引用释放时(帧已写出或被丢弃)记录写出阶段和总耗时
+class MessageTrace {
+public:
+    typedef std::shared_ptr<MessageTrace> ptr;
+
+    enum Phase {
+        // 收到帧到 ChatMessage 解码完成
+        PARSE = 0,
+        // 处理函数开始到开始分发
+        DISPATCH,
+        // 所有接收者入队
+        FANOUT,
+        // 分发结束到最后一个接收者写出
+        WRITE,
+        TOTAL,
+        PHASE_COUNT
+    };
+
+    /// 为该类型建立各阶段直方图, 在开始处理消息前调用
+    static void Enable(MessageType::Type type);
+    /// 按 chat.latency.sample_every 采样, 未启用或未采中返回 nullptr
+    static MessageTrace::ptr Create(MessageType::Type type, uint64_t start_ns);
+    static const char* PhaseToString(Phase p);
+
+    MessageTrace(MessageType::Type type, uint64_t start_ns);
+    ~MessageTrace();
+
+    /// 结束 phase 阶段, 记录距上一阶段结束的耗时
+    void mark(Phase phase);
+    /// socket 写出完成, 可在多个线程调用
+    void onWrite(uint64_t now_ns);
+private:
+    MessageType::Type m_type;
+    uint64_t m_start;
+    uint64_t m_last;
+    std::atomic<uint64_t> m_lastWrite{0};
+};
+
+}
+}
+
+#endif
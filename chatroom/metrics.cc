@@ -0,0 +1,180 @@
+#include "metrics.h"
+#include <algorithm>
+#include <sstream>
+
+namespace chat {
+
+uint32_t MetricStripe::Get() {
+    static std::atomic<uint32_t> s_next{0};
+    static thread_local uint32_t t_stripe = s_next.fetch_add(1, std::memory_order_relaxed) % COUNT;
+    return t_stripe;
+}
+
+uint64_t Counter::value() const {
+    uint64_t v = 0;
+    for (auto& i : m_cells) {
+        v += i.v.load(std::memory_order_relaxed);
+    }
+    return v;
+}
+
+uint32_t Histogram::BucketIndex(uint64_t v) {
+    if (v < LINEAR) {
+        return v;
+    }
+    uint32_t e = 63 - __builtin_clzll(v);
+    if (e > MAX_EXP) {
+        return BUCKETS - 1;
+    }
+    uint32_t m = (v >> (e - SUB_BITS)) & (SUB_COUNT - 1);
+    return LINEAR + (e - SUB_BITS - 1) * SUB_COUNT + m;
+}
+
+uint64_t Histogram::BucketUpper(uint32_t idx) {
+    if (idx < LINEAR) {
+        return idx;
+    }
+    uint32_t e = (idx - LINEAR) / SUB_COUNT + SUB_BITS + 1;
+    uint64_t m = (idx - LINEAR) % SUB_COUNT + SUB_COUNT;
+    uint32_t shift = e - SUB_BITS;
+    return ((m + 1) << shift) - 1;
+}
+
+void Histogram::record(uint64_t v) {
+    auto& s = m_stripes[MetricStripe::Get() % STRIPES];
+    s.buckets[BucketIndex(v)].fetch_add(1, std::memory_order_relaxed);
+    s.count.fetch_add(1, std::memory_order_relaxed);
+    s.sum.fetch_add(v, std::memory_order_relaxed);
+    uint64_t max = s.max.load(std::memory_order_relaxed);
+    while (v > max && !s.max.compare_exchange_weak(max, v, std::memory_order_relaxed)) {
+    }
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+    Snapshot snap;
+    snap.buckets.resize(BUCKETS);
+    for (auto& s : m_stripes) {
+        snap.count += s.count.load(std::memory_order_relaxed);
+        snap.sum += s.sum.load(std::memory_order_relaxed);
+        snap.max = std::max(snap.max, s.max.load(std::memory_order_relaxed));
+        for (uint32_t i = 0; i < BUCKETS; ++i) {
+            snap.buckets[i] += s.buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+    return snap;
+}
+
+uint64_t Histogram::Snapshot::percentile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+    // 各条带分别读取, count 与桶计数可能略有出入, 以桶计数为准
+    uint64_t total = 0;
+    for (auto& i : buckets) {
+        total += i;
+    }
+    uint64_t target = (uint64_t)(q * total + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < buckets.size(); ++i) {
+        n += buckets[i];
+        if (n >= target) {
+            return std::min(BucketUpper(i), max);
+        }
+    }
+    return max;
+}
+
+MetricsRegistry::Family& MetricsRegistry::getFamily(const std::string& name
+                                                    ,const std::string& help, Type type) {
+    auto it = m_families.find(name);
+    if (it == m_families.end()) {
+        auto& f = m_families[name];
+        f.type = type;
+        f.help = help;
+        return f;
+    }
+    return it->second;
+}
+
+Counter::ptr MetricsRegistry::getCounter(const std::string& name, const std::string& help
+                                         ,const std::string& labels) {
+    MutexType::Lock lock(m_mutex);
+    auto& v = getFamily(name, help, COUNTER).counters[labels];
+    if (!v) {
+        v = std::make_shared<Counter>();
+    }
+    return v;
+}
+
+Gauge::ptr MetricsRegistry::getGauge(const std::string& name, const std::string& help
+                                     ,const std::string& labels) {
+    MutexType::Lock lock(m_mutex);
+    auto& v = getFamily(name, help, GAUGE).gauges[labels];
+    if (!v) {
+        v = std::make_shared<Gauge>();
+    }
+    return v;
+}
+
+Histogram::ptr MetricsRegistry::getHistogram(const std::string& name, const std::string& help
+                                             ,const std::string& labels) {
+    MutexType::Lock lock(m_mutex);
+    auto& v = getFamily(name, help, HISTOGRAM).histograms[labels];
+    if (!v) {
+        v = std::make_shared<Histogram>();
+    }
+    return v;
+}
+
+static std::string Labels(const std::string& labels, const std::string& extra = "") {
+    if (labels.empty() && extra.empty()) {
+        return "";
+    }
+    if (labels.empty() || extra.empty()) {
+        return "{" + labels + extra + "}";
+    }
+    return "{" + labels + "," + extra + "}";
+}
+
+std::string MetricsRegistry::toPrometheus() {
+    static const double s_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    std::stringstream ss;
+    MutexType::Lock lock(m_mutex);
+    for (auto& i : m_families) {
+        auto& f = i.second;
+        ss << "# HELP " << i.first << " " << f.help << "\n";
+        switch (f.type) {
+            case COUNTER:
+                ss << "# TYPE " << i.first << " counter\n";
+                for (auto& c : f.counters) {
+                    ss << i.first << Labels(c.first) << " " << c.second->value() << "\n";
+                }
+                break;
+            case GAUGE:
+                ss << "# TYPE " << i.first << " gauge\n";
+                for (auto& g : f.gauges) {
+                    ss << i.first << Labels(g.first) << " " << g.second->value() << "\n";
+                }
+                break;
+            case HISTOGRAM:
+                ss << "# TYPE " << i.first << " summary\n";
+                for (auto& h : f.histograms) {
+                    auto snap = h.second->snapshot();
+                    for (auto q : s_quantiles) {
+                        std::stringstream qs;
+                        qs << "quantile=\"" << q << "\"";
+                        ss << i.first << Labels(h.first, qs.str()) << " " << snap.percentile(q) << "\n";
+                    }
+                    ss << i.first << "_sum" << Labels(h.first) << " " << snap.sum << "\n";
+                    ss << i.first << "_count" << Labels(h.first) << " " << snap.count << "\n";
+                }
+                break;
+        }
+    }
+    return ss.str();
+}
+
+}
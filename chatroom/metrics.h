@@ -0,0 +1,135 @@
+#ifndef __CHAT_METRICS_H__
+#define __CHAT_METRICS_H__
+
+#include <chat/mutex.h>
+#include <chat/singleton.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <time.h>
+
+namespace chat {
+
+// 单调时钟, 纳秒
+inline uint64_t MonotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 写入按线程分散到多个条带, 各线程更新不同的缓存行, 读取时再求和
+class MetricStripe {
+public:
+    static const uint32_t COUNT = 16;
+    /// 当前线程的条带下标, 线程首次调用时分配
+    static uint32_t Get();
+};
+
+class Counter {
+public:
+    typedef std::shared_ptr<Counter> ptr;
+
+    void inc(uint64_t v = 1) {
+        m_cells[MetricStripe::Get()].v.fetch_add(v, std::memory_order_relaxed);
+    }
+    uint64_t value() const;
+private:
+    struct alignas(64) Cell {
+        std::atomic<uint64_t> v{0};
+    };
+    Cell m_cells[MetricStripe::COUNT];
+};
+
+class Gauge {
+public:
+    typedef std::shared_ptr<Gauge> ptr;
+
+    void set(int64_t v) { m_value.store(v, std::memory_order_relaxed);}
+    void add(int64_t v) { m_value.fetch_add(v, std::memory_order_relaxed);}
+    int64_t value() const { return m_value.load(std::memory_order_relaxed);}
+private:
+    std::atomic<int64_t> m_value{0};
+};
+
+// HDR 风格的对数-线性直方图: 小于 32 的值精确计数,
+// 更大的值每个 2 的幂区间再均分 16 个桶, 相对误差不超过 1/16
+class Histogram {
+public:
+    typedef std::shared_ptr<Histogram> ptr;
+    static const uint32_t SUB_BITS = 4;
+    static const uint32_t SUB_COUNT = 1 << SUB_BITS;
+    static const uint32_t LINEAR = SUB_COUNT * 2;
+    static const uint32_t MAX_EXP = 40;
+    static const uint32_t BUCKETS = LINEAR + (MAX_EXP - SUB_BITS) * SUB_COUNT;
+    static const uint32_t STRIPES = 8;
+
+    struct Snapshot {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        std::vector<uint64_t> buckets;
+
+        /// q 取 [0, 1], 返回所在桶的上界
+        uint64_t percentile(double q) const;
+        double mean() const { return count ? (double)sum / count : 0;}
+    };
+
+    void record(uint64_t v);
+    Snapshot snapshot() const;
+
+    static uint32_t BucketIndex(uint64_t v);
+    static uint64_t BucketUpper(uint32_t idx);
+private:
+    struct alignas(64) Stripe {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> sum{0};
+        std::atomic<uint64_t> max{0};
+        std::atomic<uint64_t> buckets[BUCKETS] = {};
+    };
+    Stripe m_stripes[STRIPES];
+};
+
+// 进程内指标表, 启动时注册, 之后调用点持有指针直接更新
+// 同名指标按 labels 区分, 如 labels = "type=\"chat_request\""
+class MetricsRegistry {
+public:
+    typedef chat::Mutex MutexType;
+
+    Counter::ptr getCounter(const std::string& name, const std::string& help
+                            ,const std::string& labels = "");
+    Gauge::ptr getGauge(const std::string& name, const std::string& help
+                        ,const std::string& labels = "");
+    /// 以 summary 输出 p50/p90/p99/p999
+    Histogram::ptr getHistogram(const std::string& name, const std::string& help
+                                ,const std::string& labels = "");
+
+    /// Prometheus 文本格式
+    std::string toPrometheus();
+private:
+    enum Type {
+        COUNTER = 0,
+        GAUGE = 1,
+        HISTOGRAM = 2
+    };
+
+    struct Family {
+        Type type;
+        std::string help;
+        std::map<std::string, Counter::ptr> counters;
+        std::map<std::string, Gauge::ptr> gauges;
+        std::map<std::string, Histogram::ptr> histograms;
+    };
+
+    Family& getFamily(const std::string& name, const std::string& help, Type type);
+private:
+    MutexType m_mutex;
+    std::map<std::string, Family> m_families;
+};
+
+typedef chat::Singleton<MetricsRegistry> MetricsMgr;
+
+}
+
+#endif
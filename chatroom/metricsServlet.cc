@@ -0,0 +1,20 @@
+#include "metricsServlet.h"
+#include "metrics.h"
+
+namespace chat {
+namespace http {
+
+MetricsServlet::MetricsServlet()
+    :Servlet("MetricsServlet") {
+}
+
+int32_t MetricsServlet::handle(chat::http::HttpRequest::ptr request
+                           , chat::http::HttpResponse::ptr response
+                           , chat::http::HttpSession::ptr session) {
+    response->setBody(chat::MetricsMgr::GetInstance()->toPrometheus());
+    response->setHeader("content-type", "text/plain; version=0.0.4; charset=utf-8");
+    return 0;
+}
+
+}
+}
@@ -0,0 +1,22 @@
+#ifndef __CHAT_HTTP_METRICS_SERVLET_H__
+#define __CHAT_HTTP_METRICS_SERVLET_H__
+
+#include <chat/http/servlet.h>
+
+namespace chat {
+namespace http {
+
+// 以 Prometheus 文本格式输出 MetricsMgr 中的全部指标
+class MetricsServlet : public chat::http::Servlet {
+public:
+    typedef std::shared_ptr<MetricsServlet> ptr;
+    MetricsServlet();
+    virtual int32_t handle(chat::http::HttpRequest::ptr request
+                   , chat::http::HttpResponse::ptr response
+                   , chat::http::HttpSession::ptr session) override;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef __CHAT_MPSC_QUEUE_H__
+#define __CHAT_MPSC_QUEUE_H__
+
+#include <atomic>
+#include <utility>
+
+namespace chat {
+namespace http {
+
+// 无锁多生产者单消费者队列(Vyukov)
+// push 可在任意线程并发调用, 只需一次原子交换; pop/empty 只能由同一时刻唯一的消费者调用
+// 生产者交换头指针后、链接前的短暂窗口内, 消费者看不到该元素, 调用方需在 push 之后再唤醒消费者
+template<class T>
+class MpscQueue {
+public:
+    MpscQueue()
+        :m_head(new Node)
+        ,m_tail(m_head.load()) {
+    }
+
+    ~MpscQueue() {
+        T v;
+        while (pop(v));
+        delete m_tail;
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T v) {
+        Node* node = new Node;
+        node->value = std::move(v);
+        Node* prev = m_head.exchange(node);
+        prev->next.store(node);
+    }
+
+    bool pop(T& v) {
+        Node* tail = m_tail;
+        Node* next = tail->next.load();
+        if (!next) {
+            return false;
+        }
+        v = std::move(next->value);
+        next->value = T();
+        m_tail = next;
+        delete tail;
+        return true;
+    }
+
+    bool empty() const { return m_tail->next.load() == nullptr;}
+private:
+    struct Node {
+        std::atomic<Node*> next{nullptr};
+        T value;
+    };
+
+    // 生产者端
+    std::atomic<Node*> m_head;
+    // 消费者端, 指向已取出的哨兵节点
+    Node* m_tail;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef __CHAT_PRESENCE_BATCH_H__
+#define __CHAT_PRESENCE_BATCH_H__
+
+#include "protocol.h"
+#include <chat/mutex.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace chat {
+namespace http {
+
+// 一个合并窗口内的用户上下线变化, 同一用户只保留最后一次
+// 窗口由第一条变化打开, take 取走全部变化后关闭
+class PresenceBatch {
+public:
+    /// 记录一次变化, 返回 true 表示打开了新窗口, 调用方需安排一次 take
+    bool add(const std::string& id, uint8_t code, const std::string& name, const std::string& avatar) {
+        chat::Mutex::Lock lock(m_mutex);
+        auto& v = m_pending[id];
+        v.code = code;
+        v.id = id;
+        v.name = name;
+        v.avatar = avatar;
+        if (m_armed) {
+            return false;
+        }
+        m_armed = true;
+        return true;
+    }
+
+    /// 取出窗口内的全部变化并关闭窗口
+    void take(std::vector<RosterChange>& changes) {
+        std::unordered_map<std::string, RosterChange> pending;
+        {
+            chat::Mutex::Lock lock(m_mutex);
+            pending.swap(m_pending);
+            m_armed = false;
+        }
+        changes.reserve(changes.size() + pending.size());
+        for (auto& i : pending) {
+            changes.push_back(std::move(i.second));
+        }
+    }
+private:
+    chat::Mutex m_mutex;
+    std::unordered_map<std::string, RosterChange> m_pending;
+    bool m_armed = false;
+};
+
+}
+}
+
+#endif
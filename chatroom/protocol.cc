@@ -1,18 +1,269 @@
 #include "protocol.h"
-#include <chat/util.h>
+#include "jsonStream.h"
+#include <chat/endian.h>
+#include <string.h>
 
 namespace chat {
 namespace http {
 
-ChatMessage::ptr ChatMessage::Create(const std::string& v) {
-    Json::Value json;
-    if(!chat::JsonUtil::FromString(json, v)) {
+static const std::string_view s_field_names[ChatMessage::FIELD_COUNT] = {
+    "type"
+    ,"id"
+    ,"name"
+    ,"avatar"
+    ,"time"
+    ,"result"
+    ,"msg"
+    ,"code"
+    ,"from"
+    ,"to"
+    ,"content"
+    ,"server"
+    ,"data"
+    ,"version"
+    ,"room"
+};
+
+const char* BinaryProtocol::SUBPROTOCOL = "chat.binary";
+
+MessageType::Type MessageType::FromString(std::string_view v) {
+    switch (Hash(v)) {
+#define XX(num, name, str) \
+        case Hash(#str): \
+            return v == #str ? name : UNKNOWN;
+        CHAT_MESSAGE_TYPE_MAP(XX)
+#undef XX
+        default:
+            return UNKNOWN;
+    }
+}
+
+const char* MessageType::ToString(Type t) {
+    switch (t) {
+#define XX(num, name, str) \
+        case name: \
+            return #str;
+        CHAT_MESSAGE_TYPE_MAP(XX)
+#undef XX
+        default:
+            return "";
+    }
+}
+
+ChatMessage::Field ChatMessage::FieldFromString(std::string_view name) {
+    for (int i = 0; i < FIELD_COUNT; ++i) {
+        if (name == s_field_names[i]) {
+            return (Field)i;
+        }
+    }
+    return FIELD_COUNT;
+}
+
+const char* ChatMessage::FieldToString(Field f) {
+    return f < FIELD_COUNT ? s_field_names[f].data() : "";
+}
+
+template<class T>
+static void AppendInt(std::string& out, T v) {
+    if constexpr (sizeof(T) > 1) {
+        v = chat::byteswapOnLittleEndian(v);
+    }
+    out.append((const char*)&v, sizeof(v));
+}
+
+template<class T>
+static bool ReadInt(std::string_view in, size_t& pos, T& v) {
+    if (pos + sizeof(T) > in.size()) {
+        return false;
+    }
+    memcpy(&v, in.data() + pos, sizeof(T));
+    if constexpr (sizeof(T) > 1) {
+        v = chat::byteswapOnLittleEndian(v);
+    }
+    pos += sizeof(T);
+    return true;
+}
+
+static bool ReadBytes(std::string_view in, size_t& pos, size_t len, std::string_view& v) {
+    if (pos + len > in.size()) {
+        return false;
+    }
+    v = in.substr(pos, len);
+    pos += len;
+    return true;
+}
+
+// 各项的字符串都放得进 u16 长度时才编码该项
+template<class... Args>
+static bool FitString16(const Args&... v) {
+    return ((v.size() <= BinaryProtocol::MAX_STRING_SIZE) && ...);
+}
+
+static void PatchCount(std::string& out, uint32_t count) {
+    count = chat::byteswapOnLittleEndian(count);
+    memcpy(&out[0], &count, sizeof(count));
+}
+
+std::string BinaryProtocol::EncodeUsers(const std::vector<std::pair<std::string
+                                        ,std::pair<std::string, std::string> > >& users) {
+    std::string out;
+    uint32_t count = 0;
+    AppendInt(out, count);
+    for (auto& i : users) {
+        if (!FitString16(i.first, i.second.first, i.second.second)) {
+            continue;
+        }
+        ++count;
+        AppendInt(out, (uint16_t)i.first.size());
+        out.append(i.first);
+        AppendInt(out, (uint16_t)i.second.first.size());
+        out.append(i.second.first);
+        AppendInt(out, (uint16_t)i.second.second.size());
+        out.append(i.second.second);
+    }
+    PatchCount(out, count);
+    return out;
+}
+
+std::string BinaryProtocol::EncodeChanges(const std::vector<RosterChange>& changes) {
+    std::string out;
+    uint32_t count = 0;
+    AppendInt(out, count);
+    for (auto& i : changes) {
+        if (!FitString16(i.id, i.name, i.avatar)) {
+            continue;
+        }
+        ++count;
+        AppendInt(out, i.code);
+        AppendInt(out, (uint16_t)i.id.size());
+        out.append(i.id);
+        AppendInt(out, (uint16_t)i.name.size());
+        out.append(i.name);
+        AppendInt(out, (uint16_t)i.avatar.size());
+        out.append(i.avatar);
+    }
+    PatchCount(out, count);
+    return out;
+}
+
+std::string BinaryProtocol::EncodeRooms(const std::vector<RoomInfo>& rooms) {
+    std::string out;
+    uint32_t count = 0;
+    AppendInt(out, count);
+    for (auto& i : rooms) {
+        if (!FitString16(i.name, i.owner)) {
+            continue;
+        }
+        ++count;
+        AppendInt(out, (uint16_t)i.name.size());
+        out.append(i.name);
+        AppendInt(out, (uint16_t)i.owner.size());
+        out.append(i.owner);
+        AppendInt(out, i.members);
+    }
+    PatchCount(out, count);
+    return out;
+}
+
+std::string BinaryProtocol::EncodeHistory(const std::vector<HistoryRecord>& records) {
+    size_t size = 4;
+    for (auto& i : records) {
+        size += 20 + i.data.size();
+    }
+    std::string out;
+    out.reserve(size);
+    AppendInt(out, (uint32_t)records.size());
+    for (auto& i : records) {
+        AppendInt(out, i.offset);
+        AppendInt(out, i.time);
+        AppendInt(out, (uint32_t)i.data.size());
+        out.append(i.data);
+    }
+    return out;
+}
+
+// 只展开顶层对象, 嵌套的对象/数组以原始 JSON 文本作为字段值
+class ChatMessageJsonHandler : public JsonHandler {
+public:
+    ChatMessageJsonHandler(ChatMessage& msg)
+        :m_msg(msg) {
+    }
+
+    bool onStartObject() override { return ++m_depth == 1;}
+    bool onEndObject() override { --m_depth; return true;}
+    bool onStartArray() override { return false;}
+    bool onKey(std::string_view key) override {
+        m_key = key;
+        return true;
+    }
+    bool onValue(std::string_view val, ValueType type) override {
+        if (m_depth != 1) {
+            return false;
+        }
+        return m_msg.setView(m_key, type == NULLVAL ? std::string_view() : val);
+    }
+private:
+    ChatMessage& m_msg;
+    std::string_view m_key;
+    int m_depth = 0;
+};
+
+// 只找顶层的 "type", 拿到后立即终止解析
+class TypePeekJsonHandler : public JsonHandler {
+public:
+    bool onStartObject() override { return ++m_depth == 1;}
+    bool onEndObject() override { --m_depth; return true;}
+    bool onStartArray() override { return false;}
+    bool onKey(std::string_view key) override {
+        m_isType = key == "type";
+        return true;
+    }
+    bool onValue(std::string_view val, ValueType type) override {
+        if (m_depth == 1 && m_isType) {
+            m_type = type == STRING ? MessageType::FromString(val) : MessageType::UNKNOWN;
+            return false;
+        }
+        return true;
+    }
+
+    MessageType::Type getType() const { return m_type;}
+private:
+    MessageType::Type m_type = MessageType::UNKNOWN;
+    int m_depth = 0;
+    bool m_isType = false;
+};
+
+MessageType::Type ChatMessage::PeekType(std::string_view data, Encoding enc) {
+    if (enc == BINARY) {
+        if (data.size() < 2 || (uint8_t)data[0] != BinaryProtocol::VERSION
+                || (uint8_t)data[1] >= MessageType::TYPE_COUNT) {
+            return MessageType::UNKNOWN;
+        }
+        return (MessageType::Type)(uint8_t)data[1];
+    }
+    std::string scratch;
+    TypePeekJsonHandler handler;
+    JsonReader::Parse(data, scratch, handler, 1);
+    return handler.getType();
+}
+
+ChatMessage::ptr ChatMessage::Create(std::string v, Encoding enc) {
+    if (enc == BINARY) {
+        return CreateBinary(std::move(v));
+    }
+    ChatMessage::ptr rt = std::make_shared<ChatMessage>();
+    rt->m_buf = std::move(v);
+    if (!rt->parseJson()) {
         return nullptr;
     }
-    ChatMessage::ptr rt(new ChatMessage);
-    auto names = json.getMemberNames();
-    for(auto& i : names) {
-        rt->m_datas[i] = json[i].asString();
+    return rt;
+}
+
+ChatMessage::ptr ChatMessage::CreateBinary(std::string v) {
+    ChatMessage::ptr rt = std::make_shared<ChatMessage>();
+    rt->m_buf = std::move(v);
+    if (!rt->parseBinary()) {
+        return nullptr;
     }
     return rt;
 }
@@ -20,22 +271,204 @@ ChatMessage::ptr ChatMessage::Create(const std::string& v) {
 ChatMessage::ChatMessage() {
 }
 
-std::string ChatMessage::get(const std::string& name) {
-    auto it = m_datas.find(name);
-    return it == m_datas.end() ? "" : it->second;
+bool ChatMessage::parseJson() {
+    ChatMessageJsonHandler handler(*this);
+    return JsonReader::Parse(m_buf, m_scratch, handler, 1);
+}
+
+bool ChatMessage::parseBinary() {
+    std::string_view in(m_buf);
+    size_t pos = 0;
+    uint8_t version = 0;
+    uint8_t type = 0;
+    uint16_t count = 0;
+    if (!ReadInt(in, pos, version) || version != BinaryProtocol::VERSION
+            || !ReadInt(in, pos, type) || !ReadInt(in, pos, count)) {
+        return false;
+    }
+    if (type) {
+        if (type >= MessageType::TYPE_COUNT) {
+            return false;
+        }
+        setView(s_field_names[TYPE], MessageType::ToString((MessageType::Type)type));
+    }
+    for (uint16_t i = 0; i < count; ++i) {
+        uint8_t code = 0;
+        uint32_t len = 0;
+        std::string_view key;
+        std::string_view val;
+        if (!ReadInt(in, pos, code)) {
+            return false;
+        }
+        if (code) {
+            if (code > FIELD_COUNT) {
+                return false;
+            }
+            key = s_field_names[code - 1];
+        } else {
+            uint8_t klen = 0;
+            if (!ReadInt(in, pos, klen) || !ReadBytes(in, pos, klen, key)) {
+                return false;
+            }
+        }
+        if (!ReadInt(in, pos, len) || !ReadBytes(in, pos, len, val)
+                || !setView(key, val)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 二进制编码的 key 长度为 u8, 字段数为 u16, 超出的消息无法转发给二进制客户端
+bool ChatMessage::addExtra(std::string_view name, std::string_view val) {
+    auto it = m_extras.find(name);
+    if (it != m_extras.end()) {
+        it->second.assign(val.data(), val.size());
+        return true;
+    }
+    if (name.size() > BinaryProtocol::MAX_KEY_SIZE
+            || m_extras.size() + FIELD_COUNT >= BinaryProtocol::MAX_FIELDS) {
+        return false;
+    }
+    m_extras.emplace(std::string(name), std::string(val));
+    return true;
+}
+
+bool ChatMessage::setView(std::string_view name, std::string_view val) {
+    Field f = FieldFromString(name);
+    if (f == FIELD_COUNT) {
+        return addExtra(name, val);
+    }
+    auto& slot = m_slots[f];
+    slot.view = val;
+    slot.owned = false;
+    slot.present = true;
+    if (f == TYPE) {
+        m_type = MessageType::FromString(val);
+    }
+    return true;
+}
+
+std::string_view ChatMessage::get(Field f) const {
+    auto& slot = m_slots[f];
+    if (!slot.present) {
+        return std::string_view();
+    }
+    return slot.owned ? std::string_view(slot.value) : slot.view;
+}
+
+std::string_view ChatMessage::get(std::string_view name) const {
+    Field f = FieldFromString(name);
+    if (f != FIELD_COUNT) {
+        return get(f);
+    }
+    auto it = m_extras.find(name);
+    return it == m_extras.end() ? std::string_view() : std::string_view(it->second);
+}
+
+void ChatMessage::set(Field f, std::string_view val) {
+    auto& slot = m_slots[f];
+    slot.value.assign(val.data(), val.size());
+    slot.owned = true;
+    slot.present = true;
+    if (f == TYPE) {
+        m_type = MessageType::FromString(val);
+    }
 }
 
-void ChatMessage::set(const std::string& name, const std::string& val) {
-    m_datas[name] = val;
+bool ChatMessage::set(std::string_view name, std::string_view val) {
+    Field f = FieldFromString(name);
+    if (f != FIELD_COUNT) {
+        set(f, val);
+        return true;
+    }
+    return addExtra(name, val);
+}
+
+size_t ChatMessage::estimateSize() const {
+    size_t size = 4;
+    for (int i = 0; i < FIELD_COUNT; ++i) {
+        if (m_slots[i].present) {
+            size += s_field_names[i].size() + get((Field)i).size() + 6;
+        }
+    }
+    for (auto& i : m_extras) {
+        size += i.first.size() + i.second.size() + 6;
+    }
+    return size;
+}
+
+void ChatMessage::encodeJson(std::string& out) const {
+    JsonWriter w(out);
+    w.startObject();
+    for (int i = 0; i < FIELD_COUNT; ++i) {
+        if (m_slots[i].present) {
+            w.kv(s_field_names[i], get((Field)i));
+        }
+    }
+    for (auto& i : m_extras) {
+        w.kv(i.first, i.second);
+    }
+    w.endObject();
+}
+
+void ChatMessage::encodeBinary(std::string& out) const {
+    uint8_t type = m_type;
+    uint16_t count = m_extras.size();
+    for (int i = 0; i < FIELD_COUNT; ++i) {
+        if (m_slots[i].present && !(i == TYPE && type)) {
+            ++count;
+        }
+    }
+
+    AppendInt(out, BinaryProtocol::VERSION);
+    AppendInt(out, type);
+    AppendInt(out, count);
+    for (int i = 0; i < FIELD_COUNT; ++i) {
+        if (!m_slots[i].present || (i == TYPE && type)) {
+            continue;
+        }
+        auto v = get((Field)i);
+        AppendInt(out, (uint8_t)(i + 1));
+        AppendInt(out, (uint32_t)v.size());
+        out.append(v.data(), v.size());
+    }
+    for (auto& i : m_extras) {
+        AppendInt(out, (uint8_t)0);
+        AppendInt(out, (uint8_t)i.first.size());
+        out.append(i.first);
+        AppendInt(out, (uint32_t)i.second.size());
+        out.append(i.second);
+    }
 }
 
 std::string ChatMessage::toString() const {
-    Json::Value json;
-    for(auto& i : m_datas) {
-        json[i.first] = i.second;
+    std::string out;
+    out.reserve(estimateSize());
+    encodeJson(out);
+    return out;
+}
+
+std::string ChatMessage::toBinary() const {
+    std::string out;
+    out.reserve(estimateSize());
+    encodeBinary(out);
+    return out;
+}
+
+std::string ChatMessage::encode(Encoding enc) const {
+    return enc == BINARY ? toBinary() : toString();
+}
+
+WSFrame::ptr ChatMessage::toFrame(Encoding enc, const std::string& key) const {
+    std::string buf = WSFrame::NewBuffer(estimateSize());
+    if (enc == BINARY) {
+        encodeBinary(buf);
+        return WSFrame::CreateFromBuffer(std::move(buf), WSFrameHead::BIN_FRAME, key, m_trace);
     }
-    return chat::JsonUtil::ToString(json);
+    encodeJson(buf);
+    return WSFrame::CreateFromBuffer(std::move(buf), WSFrameHead::TEXT_FRAME, key, m_trace);
 }
 
 }
-}
\ No newline at end of file
+}
@@ -1,27 +1,204 @@
 #ifndef __PROTOCOL_H__
 #define __PROTOCOL_H__
 
+#include "wsFrame.h"
 #include <string>
+#include <string_view>
 #include <map>
 #include <memory>
+#include <vector>
 
 namespace chat {
 namespace http {
 
+class MessageTrace;
+
+// 消息类型, 编号即二进制协议的 type code, 需连续; 新增类型在末尾追加
+#define CHAT_MESSAGE_TYPE_MAP(XX) \
+    XX(1, LOGIN_REQUEST,        login_request) \
+    XX(2, LOGIN_RESPONSE,       login_response) \
+    XX(3, CHAT_INIT_REQUEST,    chat_init_request) \
+    XX(4, CHAT_INIT_RESPONSE,   chat_init_response) \
+    XX(5, CHAT_REQUEST,         chat_request) \
+    XX(6, CHAT_RESPONSE,        chat_response) \
+    XX(7, USER_CHANGE_RESPONSE, user_change_response) \
+    XX(8, ROSTER_DELTA_RESPONSE, roster_delta_response) \
+    XX(9, USER_CHANGE_BATCH,    user_change_batch) \
+    XX(10, ROOM_CREATE_REQUEST,  room_create_request) \
+    XX(11, ROOM_CREATE_RESPONSE, room_create_response) \
+    XX(12, ROOM_JOIN_REQUEST,    room_join_request) \
+    XX(13, ROOM_JOIN_RESPONSE,   room_join_response) \
+    XX(14, ROOM_LEAVE_REQUEST,   room_leave_request) \
+    XX(15, ROOM_LEAVE_RESPONSE,  room_leave_response) \
+    XX(16, ROOM_LIST_REQUEST,    room_list_request) \
+    XX(17, ROOM_LIST_RESPONSE,   room_list_response) \
+    XX(18, ROOM_MEMBER_RESPONSE, room_member_response) \
+    XX(19, HISTORY_REQUEST,      history_request) \
+    XX(20, HISTORY_RESPONSE,     history_response)
+
+class MessageType {
+public:
+    enum Type {
+        UNKNOWN = 0,
+#define XX(num, name, str) name = num,
+        CHAT_MESSAGE_TYPE_MAP(XX)
+#undef XX
+        TYPE_COUNT
+    };
+
+    /// FNV-1a, 编译期对类型名求值后作为 switch 的 case, 哈希冲突会直接编译失败
+    static constexpr uint32_t Hash(std::string_view v) {
+        uint32_t h = 2166136261u;
+        for (char c : v) {
+            h = (h ^ (uint8_t)c) * 16777619u;
+        }
+        return h;
+    }
+
+    static Type FromString(std::string_view v);
+    static const char* ToString(Type t);
+};
+
+// 扁平的聊天消息, 已知字段按枚举下标存放, 取值是指向原始帧缓冲的 string_view,
+// 未知字段放到 map 里; 解析 chat_request 这类常见消息时不需要额外的堆分配
 class ChatMessage {
+friend class ChatMessageJsonHandler;
 public:
     typedef std::shared_ptr<ChatMessage> ptr;
 
-    static ChatMessage::ptr Create(const std::string& v);
+    // 消息编码, JSON 文本给网页客户端, BINARY 由 WebSocket 子协议协商
+    enum Encoding {
+        JSON = 0,
+        BINARY = 1
+    };
+
+    // 已知字段, 二进制协议中的 key code 为 Field + 1
+    enum Field {
+        TYPE = 0,
+        ID,
+        NAME,
+        AVATAR,
+        TIME,
+        RESULT,
+        MSG,
+        CODE,
+        FROM,
+        TO,
+        CONTENT,
+        SERVER,
+        DATA,
+        VERSION,
+        ROOM,
+        FIELD_COUNT
+    };
+
+    /// 未知字段返回 FIELD_COUNT
+    static Field FieldFromString(std::string_view name);
+    static const char* FieldToString(Field f);
+
+    /// 接管帧缓冲 v, 调用方传入 std::move 的字符串可避免拷贝
+    static ChatMessage::ptr Create(std::string v, Encoding enc = JSON);
+    static ChatMessage::ptr CreateBinary(std::string v);
+    /// 不解码整条消息, 只取出类型: 二进制看头部的 type code, JSON 扫到顶层 "type" 即停止
+    static MessageType::Type PeekType(std::string_view data, Encoding enc);
+
     ChatMessage();
-    std::string get(const std::string& name);
-    void set(const std::string& name, const std::string& val);
+    ChatMessage(const ChatMessage&) = delete;
+    ChatMessage& operator=(const ChatMessage&) = delete;
+
+    /// 返回的 string_view 在消息存活且该字段未被再次 set 期间有效
+    std::string_view get(Field f) const;
+    std::string_view get(std::string_view name) const;
+    bool has(Field f) const { return m_slots[f].present;}
+    MessageType::Type getType() const { return m_type;}
+    /// 延迟追踪, 编码出的帧会带上同一个 trace
+    const std::shared_ptr<MessageTrace>& getTrace() const { return m_trace;}
+    void setTrace(std::shared_ptr<MessageTrace> v) { m_trace = std::move(v);}
+    void set(Field f, std::string_view val);
+    /// 扩展字段的 key 超过 BinaryProtocol::MAX_KEY_SIZE 或字段数超过上限时不设置, 返回 false
+    bool set(std::string_view name, std::string_view val);
+
     std::string toString() const;
+    std::string toBinary() const;
+    std::string encode(Encoding enc) const;
+    /// 直接编码进帧缓冲, 省去负载的再次拷贝
+    WSFrame::ptr toFrame(Encoding enc, const std::string& key = "") const;
 private:
-    std::map<std::string, std::string> m_datas;
+    size_t estimateSize() const;
+    void encodeJson(std::string& out) const;
+    void encodeBinary(std::string& out) const;
+    bool parseJson();
+    bool parseBinary();
+    bool setView(std::string_view name, std::string_view val);
+    bool addExtra(std::string_view name, std::string_view val);
+private:
+    struct Slot {
+        std::string_view view;
+        std::string value;
+        bool owned = false;
+        bool present = false;
+    };
+
+    // 原始帧
+    std::string m_buf;
+    // 含转义字符的 JSON 字符串反转义后存放于此, 预留足够空间, 不会重新分配
+    std::string m_scratch;
+    Slot m_slots[FIELD_COUNT];
+    // TYPE 字段对应的类型, 随 TYPE 一起更新
+    MessageType::Type m_type = MessageType::UNKNOWN;
+    std::map<std::string, std::string, std::less<> > m_extras;
+    std::shared_ptr<MessageTrace> m_trace;
+};
+
+// 用户列表的一次变化, code 与 user_change_response 相同: 1 上线, 2 下线
+struct RosterChange {
+    uint64_t version = 0;
+    uint8_t code = 0;
+    std::string id;
+    std::string name;
+    std::string avatar;
+};
+
+// room_list_response 中的一个房间
+struct RoomInfo {
+    std::string name;
+    std::string owner;
+    uint32_t members = 0;
+};
+
+// 消息历史中的一条, data 为当时转发的 chat_response(JSON)
+struct HistoryRecord {
+    uint64_t offset = 0;
+    uint64_t time = 0;
+    std::string data;
+};
+
+// 二进制协议, 整数均为网络字节序
+// 消息: u8 version | u8 type code | u16 field count | field...
+// 字段: u8 key code | [key code == 0 时: u8 key len | key] | u32 value len | value
+// type code 即 MessageType, 为 0 时类型名作为普通字段 "type" 携带
+class BinaryProtocol {
+public:
+    static const uint8_t VERSION = 1;
+    static const char* SUBPROTOCOL;
+    /// 长度字段的上限, 超出的消息在解析/设置时拒绝, 编码时不会截断
+    static const size_t MAX_KEY_SIZE = UINT8_MAX;
+    static const size_t MAX_FIELDS = UINT16_MAX;
+    /// data 字段中 u16 长度的字符串, 超长的项编码时跳过
+    static const size_t MAX_STRING_SIZE = UINT16_MAX;
+
+    // chat_init_response 的 data 字段: u32 count | (u16 len | id, u16 len | name, u16 len | avatar)...
+    static std::string EncodeUsers(const std::vector<std::pair<std::string
+                                   ,std::pair<std::string, std::string> > >& users);
+    // roster_delta_response/user_change_batch 的 data 字段: u32 count | (u8 code, u16 len | id, u16 len | name, u16 len | avatar)...
+    static std::string EncodeChanges(const std::vector<RosterChange>& changes);
+    // room_list_response 的 data 字段: u32 count | (u16 len | room, u16 len | owner, u32 members)...
+    static std::string EncodeRooms(const std::vector<RoomInfo>& rooms);
+    // history_response 的 data 字段: u32 count | (u64 offset, u64 time(ms), u32 len | chat_response JSON)...
+    static std::string EncodeHistory(const std::vector<HistoryRecord>& records);
 };
 
 }
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,285 @@
+#include "pubSub.h"
+#include "metrics.h"
+#include <chat/config.h>
+#include <algorithm>
+#include <functional>
+
+namespace chat {
+namespace http {
+
+static chat::ConfigVar<uint32_t>::ptr g_fanout_threshold =
+    chat::Config::Lookup("chat.fanout.parallel_threshold"
+            ,(uint32_t)4096
+            , "topics with at least this many subscribers fan out in parallel, 0 disable");
+
+static chat::Counter::ptr s_send_failures = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_send_failures_total", "SendMessage calls on closed sessions or failed writes");
+static chat::Histogram::ptr s_fanout = chat::MetricsMgr::GetInstance()->getHistogram(
+        "chat_broadcast_fanout", "recipients per publish");
+static chat::Counter::ptr s_rebuilds = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_topic_rebuilds_total", "subscriber array rebuilds after subscription changes");
+static chat::Counter::ptr s_parallel = chat::MetricsMgr::GetInstance()->getCounter(
+        "chat_fanout_parallel_total", "publishes split across owning io threads");
+
+// queued 为 true 时已在归属线程的任务队列中, 直接入队
+static uint64_t SendAll(const std::vector<ChatSession::ptr>& conns, const WSFrame::ptr (&frames)[2]
+                        ,WSSession::ptr exclude, bool queued = false) {
+    uint64_t fanout = 0;
+    for (auto& conn : conns) {
+        if (conn->getSession() == exclude) {
+            continue;
+        }
+        auto& frame = frames[conn->getEncoding()];
+        if ((queued ? conn->enqueue(frame) : conn->send(frame)) == -1) {
+            s_send_failures->inc();
+        }
+        ++fanout;
+    }
+    return fanout;
+}
+
+// 分块投递时在发布线程计数, 与 SendAll 的返回值一致
+static uint64_t CountTargets(const std::vector<ChatSession::ptr>& conns, WSSession::ptr exclude) {
+    if (!exclude) {
+        return conns.size();
+    }
+    uint64_t fanout = 0;
+    for (auto& conn : conns) {
+        if (conn->getSession() != exclude) {
+            ++fanout;
+        }
+    }
+    return fanout;
+}
+
+Topic::Topic(const std::string& name, bool persistent)
+    :m_name(name)
+    ,m_persistent(persistent)
+    ,m_subscribers(std::make_shared<Subscribers>()) {
+}
+
+Topic::Subscribers::ptr Topic::getSubscribers() const {
+    if (m_dirty.load(std::memory_order_acquire)) {
+        MutexType::Lock lock(m_mutex);
+        // 等锁期间可能已被其他线程重建
+        if (m_dirty.load(std::memory_order_relaxed)) {
+            std::shared_ptr<Subscribers> subs = std::make_shared<Subscribers>();
+            subs->conns.reserve(m_members.size());
+            for (auto& i : m_members) {
+                subs->conns.push_back(i.second);
+            }
+            uint32_t threshold = g_fanout_threshold->getValue();
+            if (threshold && subs->conns.size() >= threshold) {
+                std::unordered_map<OwnerQueue*, size_t> idx;
+                for (auto& i : subs->conns) {
+                    auto it = idx.emplace(i->getOwner(), subs->chunks.size()).first;
+                    if (it->second == subs->chunks.size()) {
+                        subs->chunks.emplace_back();
+                        subs->chunks.back().owner = i->getOwner();
+                    }
+                    subs->chunks[it->second].conns.push_back(i);
+                }
+            }
+            std::atomic_store(&m_subscribers, Subscribers::ptr(subs));
+            m_dirty.store(false, std::memory_order_relaxed);
+            s_rebuilds->inc();
+        }
+    }
+    return std::atomic_load(&m_subscribers);
+}
+
+bool Topic::has(const std::string& id) {
+    MutexType::Lock lock(m_mutex);
+    return m_members.find(id) != m_members.end();
+}
+
+bool Topic::add(const std::string& id, ChatSession::ptr conn) {
+    MutexType::Lock lock(m_mutex);
+    auto& v = m_members[id];
+    bool added = !v;
+    if (v == conn) {
+        return false;
+    }
+    v = conn;
+    m_size.store(m_members.size(), std::memory_order_relaxed);
+    m_dirty.store(true, std::memory_order_release);
+    return added;
+}
+
+bool Topic::del(const std::string& id) {
+    MutexType::Lock lock(m_mutex);
+    if (!m_members.erase(id)) {
+        return false;
+    }
+    m_size.store(m_members.size(), std::memory_order_relaxed);
+    m_dirty.store(true, std::memory_order_release);
+    return true;
+}
+
+PubSub::PubSub(uint32_t shard_count) {
+    if (shard_count == 0) {
+        shard_count = 1;
+    }
+    m_shards.reserve(shard_count);
+    for (uint32_t i = 0; i < shard_count; ++i) {
+        m_shards.emplace_back(new Shard);
+    }
+}
+
+PubSub::Shard& PubSub::getShard(const std::string& key) {
+    return *m_shards[std::hash<std::string>()(key) % m_shards.size()];
+}
+
+Topic::ptr PubSub::getTopic(const std::string& name, bool create, bool persistent) {
+    auto& shard = getShard(name);
+    {
+        RWMutexType::ReadLock lock(shard.mutex);
+        auto it = shard.topics.find(name);
+        if (it != shard.topics.end() || !create) {
+            return it == shard.topics.end() ? nullptr : it->second;
+        }
+    }
+    RWMutexType::WriteLock lock(shard.mutex);
+    auto& v = shard.topics[name];
+    if (!v) {
+        v = std::make_shared<Topic>(name, persistent);
+    }
+    return v;
+}
+
+bool PubSub::subscribe(const std::string& topic, const std::string& id, ChatSession::ptr conn) {
+    bool added = false;
+    {
+        auto& shard = getShard(topic);
+        RWMutexType::WriteLock lock(shard.mutex);
+        auto& v = shard.topics[topic];
+        if (!v) {
+            v = std::make_shared<Topic>(topic, false);
+        }
+        added = v->add(id, conn);
+    }
+    if (added) {
+        auto& shard = getShard(id);
+        RWMutexType::WriteLock lock(shard.mutex);
+        shard.subscriptions[id].push_back(topic);
+    }
+    return added;
+}
+
+bool PubSub::unsubscribe(const std::string& topic, const std::string& id) {
+    {
+        auto& shard = getShard(topic);
+        RWMutexType::WriteLock lock(shard.mutex);
+        auto it = shard.topics.find(topic);
+        if (it == shard.topics.end() || !it->second->del(id)) {
+            return false;
+        }
+        if (it->second->size() == 0 && !it->second->isPersistent()) {
+            shard.topics.erase(it);
+        }
+    }
+    auto& shard = getShard(id);
+    RWMutexType::WriteLock lock(shard.mutex);
+    auto it = shard.subscriptions.find(id);
+    if (it != shard.subscriptions.end()) {
+        auto& v = it->second;
+        v.erase(std::remove(v.begin(), v.end(), topic), v.end());
+        if (v.empty()) {
+            shard.subscriptions.erase(it);
+        }
+    }
+    return true;
+}
+
+std::vector<std::string> PubSub::unsubscribeAll(const std::string& id) {
+    std::vector<std::string> topics;
+    {
+        auto& shard = getShard(id);
+        RWMutexType::WriteLock lock(shard.mutex);
+        auto it = shard.subscriptions.find(id);
+        if (it == shard.subscriptions.end()) {
+            return topics;
+        }
+        topics.swap(it->second);
+        shard.subscriptions.erase(it);
+    }
+    for (auto& name : topics) {
+        auto& shard = getShard(name);
+        RWMutexType::WriteLock lock(shard.mutex);
+        auto it = shard.topics.find(name);
+        if (it == shard.topics.end()) {
+            continue;
+        }
+        it->second->del(id);
+        if (it->second->size() == 0 && !it->second->isPersistent()) {
+            shard.topics.erase(it);
+        }
+    }
+    return topics;
+}
+
+uint64_t PubSub::publish(Topic::ptr topic, ChatMessage::ptr msg, WSSession::ptr exclude
+                         ,const std::string& key) {
+    auto subs = topic->getSubscribers();
+    WSFrame::ptr frames[2];
+    if (!subs->chunks.empty()) {
+        // 分块并行时各线程共享帧, 两种编码都先编好
+        frames[ChatMessage::JSON] = msg->toFrame(ChatMessage::JSON, key);
+        frames[ChatMessage::BINARY] = msg->toFrame(ChatMessage::BINARY, key);
+        return publish(topic, frames, exclude);
+    }
+    uint64_t fanout = 0;
+    for (auto& conn : subs->conns) {
+        if (conn->getSession() == exclude) {
+            continue;
+        }
+        auto& frame = frames[conn->getEncoding()];
+        if (!frame) {
+            frame = msg->toFrame(conn->getEncoding(), key);
+        }
+        if (conn->send(frame) == -1) {
+            s_send_failures->inc();
+        }
+        ++fanout;
+    }
+    s_fanout->record(fanout);
+    return fanout;
+}
+
+uint64_t PubSub::publish(Topic::ptr topic, const WSFrame::ptr (&frames)[2], WSSession::ptr exclude) {
+    auto subs = topic->getSubscribers();
+    uint64_t fanout = 0;
+    if (subs->chunks.empty()) {
+        fanout = SendAll(subs->conns, frames, exclude);
+        s_fanout->record(fanout);
+        return fanout;
+    }
+
+    s_parallel->inc();
+    WSFrame::ptr json = frames[ChatMessage::JSON];
+    WSFrame::ptr binary = frames[ChatMessage::BINARY];
+    for (size_t i = 0; i < subs->chunks.size(); ++i) {
+        auto& chunk = subs->chunks[i];
+        if (!chunk.owner) {
+            fanout += SendAll(chunk.conns, frames, exclude);
+            continue;
+        }
+        fanout += CountTargets(chunk.conns, exclude);
+        // 快照随任务一起持有, 发布期间订阅变化不影响已投递的块
+        chunk.owner->post([subs, i, json, binary, exclude](){
+            const WSFrame::ptr frames[2] = {json, binary};
+            SendAll(subs->chunks[i].conns, frames, exclude, true);
+        });
+    }
+    s_fanout->record(fanout);
+    return fanout;
+}
+
+uint64_t PubSub::publish(const std::string& topic, ChatMessage::ptr msg, WSSession::ptr exclude
+                         ,const std::string& key) {
+    auto t = getTopic(topic);
+    return t ? publish(t, msg, exclude, key) : 0;
+}
+
+}
+}
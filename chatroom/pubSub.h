@@ -0,0 +1,101 @@
+#ifndef __CHAT_PUB_SUB_H__
+#define __CHAT_PUB_SUB_H__
+
+#include "chatSession.h"
+#include <chat/mutex.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace chat {
+namespace http {
+
+// 一个主题及其订阅者, 订阅者按 id 唯一
+// 订阅变化只改成员表并标记过期, 发布时取订阅者数组快照:
+// 没有变化时只是一次原子加载, 变化后首次发布重建一次
+class Topic {
+public:
+    typedef std::shared_ptr<Topic> ptr;
+    typedef chat::Mutex MutexType;
+    struct Subscribers {
+        typedef std::shared_ptr<const Subscribers> ptr;
+        std::vector<ChatSession::ptr> conns;
+        // 归属同一 IO 线程的订阅者
+        struct Chunk {
+            OwnerQueue* owner = nullptr;
+            std::vector<ChatSession::ptr> conns;
+        };
+        // 订阅者数达到 chat.fanout.parallel_threshold 时按归属线程分块, 否则为空
+        // 每块投递到该线程的任务队列, 各线程并行入队, 块内和同线程的其他发送按提交顺序执行
+        std::vector<Chunk> chunks;
+    };
+
+    Topic(const std::string& name, bool persistent);
+
+    const std::string& getName() const { return m_name;}
+    /// 常驻主题没有订阅者时也不删除, 调用方可以长期持有
+    bool isPersistent() const { return m_persistent;}
+    Subscribers::ptr getSubscribers() const;
+    bool has(const std::string& id);
+    size_t size() const { return m_size.load(std::memory_order_relaxed);}
+private:
+    friend class PubSub;
+    bool add(const std::string& id, ChatSession::ptr conn);
+    bool del(const std::string& id);
+private:
+    std::string m_name;
+    bool m_persistent;
+    mutable MutexType m_mutex;
+    std::unordered_map<std::string, ChatSession::ptr> m_members;
+    mutable Subscribers::ptr m_subscribers;
+    mutable std::atomic<bool> m_dirty{false};
+    std::atomic<size_t> m_size{0};
+};
+
+// 主题 -> 订阅者, 广播/私聊/上下线/房间都经由这里分发
+// 主题名约定: all 全部在线用户, presence 上下线通知, user:<id> 私聊, room:<name> 房间
+class PubSub {
+public:
+    typedef std::shared_ptr<PubSub> ptr;
+    typedef chat::RWMutex RWMutexType;
+
+    PubSub(uint32_t shard_count = 16);
+
+    /// create 为 true 时不存在则创建
+    Topic::ptr getTopic(const std::string& name, bool create = false, bool persistent = false);
+    /// 返回是否新订阅, 主题不存在时创建
+    bool subscribe(const std::string& topic, const std::string& id, ChatSession::ptr conn);
+    /// 返回是否取消了订阅, 非常驻主题最后一个订阅者取消后删除主题
+    bool unsubscribe(const std::string& topic, const std::string& id);
+    /// 取消该订阅者的全部订阅, 返回取消的主题名
+    std::vector<std::string> unsubscribeAll(const std::string& id);
+
+    /// 每种编码只编码一次, 同编码的订阅者共享帧缓冲, 跳过 exclude, 返回接收者数
+    uint64_t publish(Topic::ptr topic, ChatMessage::ptr msg, WSSession::ptr exclude = nullptr
+                     ,const std::string& key = "");
+    /// 发布已编码好的帧, frames 按 ChatMessage::Encoding 下标, 两种编码都不能为空
+    /// 大主题按接收者的归属线程分块投递, 各线程并行入队, 返回时各接收者可能尚未入队
+    /// 返回不含 exclude 的接收者数
+    uint64_t publish(Topic::ptr topic, const WSFrame::ptr (&frames)[2], WSSession::ptr exclude = nullptr);
+    /// 主题不存在时返回 0
+    uint64_t publish(const std::string& topic, ChatMessage::ptr msg, WSSession::ptr exclude = nullptr
+                     ,const std::string& key = "");
+private:
+    struct alignas(64) Shard {
+        RWMutexType mutex;
+        std::unordered_map<std::string, Topic::ptr> topics;
+        // 按订阅者 id 分片: id -> 订阅的主题名
+        std::unordered_map<std::string, std::vector<std::string> > subscriptions;
+    };
+
+    Shard& getShard(const std::string& key);
+private:
+    std::vector<std::unique_ptr<Shard> > m_shards;
+};
+
+}
+}
+
+#endif
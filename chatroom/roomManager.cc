@@ -0,0 +1,125 @@
+#include "roomManager.h"
+#include <chat/util.h>
+#include <algorithm>
+#include <atomic>
+
+namespace chat {
+namespace http {
+
+// 取当前时间(微秒)与上一个值加 1 中的较大者, 进程内递增, 重启后仍大于之前分配的值
+static uint64_t NextIncarnation() {
+    static std::atomic<uint64_t> s_last{0};
+    uint64_t now = chat::GetCurrentUS();
+    uint64_t last = s_last.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+        next = std::max(now, last + 1);
+    } while (!s_last.compare_exchange_weak(last, next, std::memory_order_relaxed));
+    return next;
+}
+
+Room::Room(const std::string& name, const std::string& owner, Topic::ptr topic, uint64_t incarnation)
+    :m_name(name)
+    ,m_owner(owner)
+    ,m_topic(topic)
+    ,m_incarnation(incarnation) {
+}
+
+RoomManager::RoomManager(PubSub::ptr pubsub)
+    :m_pubsub(pubsub) {
+}
+
+Room::ptr RoomManager::create(const std::string& name, const std::string& id, ChatSession::ptr conn) {
+    RWMutexType::WriteLock lock(m_mutex);
+    auto& room = m_rooms[name];
+    if (room) {
+        return nullptr;
+    }
+    auto topic = Room::TopicName(name);
+    m_pubsub->subscribe(topic, id, conn);
+    room = std::make_shared<Room>(name, id, m_pubsub->getTopic(topic), NextIncarnation());
+    m_userRooms[id].push_back(name);
+    return room;
+}
+
+Room::ptr RoomManager::get(const std::string& name) {
+    RWMutexType::ReadLock lock(m_mutex);
+    auto it = m_rooms.find(name);
+    return it == m_rooms.end() ? nullptr : it->second;
+}
+
+Room::ptr RoomManager::join(const std::string& name, const std::string& id, ChatSession::ptr conn, bool& joined) {
+    RWMutexType::WriteLock lock(m_mutex);
+    auto it = m_rooms.find(name);
+    if (it == m_rooms.end()) {
+        return nullptr;
+    }
+    joined = m_pubsub->subscribe(Room::TopicName(name), id, conn);
+    if (joined) {
+        m_userRooms[id].push_back(name);
+    }
+    return it->second;
+}
+
+void RoomManager::leaveLocked(Room::ptr room, const std::string& id) {
+    // 房间主题不是常驻的, 最后一个成员离开时随房间一起删除
+    m_pubsub->unsubscribe(Room::TopicName(room->getName()), id);
+    if (room->size() == 0) {
+        m_rooms.erase(room->getName());
+    }
+}
+
+Room::ptr RoomManager::leave(const std::string& name, const std::string& id) {
+    RWMutexType::WriteLock lock(m_mutex);
+    auto it = m_rooms.find(name);
+    if (it == m_rooms.end() || !it->second->has(id)) {
+        return nullptr;
+    }
+    auto room = it->second;
+    leaveLocked(room, id);
+    auto uit = m_userRooms.find(id);
+    if (uit != m_userRooms.end()) {
+        auto& v = uit->second;
+        v.erase(std::remove(v.begin(), v.end(), name), v.end());
+        if (v.empty()) {
+            m_userRooms.erase(uit);
+        }
+    }
+    return room;
+}
+
+std::vector<Room::ptr> RoomManager::leaveAll(const std::string& id) {
+    std::vector<Room::ptr> rooms;
+    RWMutexType::WriteLock lock(m_mutex);
+    auto uit = m_userRooms.find(id);
+    if (uit == m_userRooms.end()) {
+        return rooms;
+    }
+    for (auto& name : uit->second) {
+        auto it = m_rooms.find(name);
+        if (it == m_rooms.end()) {
+            continue;
+        }
+        auto room = it->second;
+        leaveLocked(room, id);
+        rooms.push_back(room);
+    }
+    m_userRooms.erase(uit);
+    return rooms;
+}
+
+void RoomManager::list(std::vector<Room::ptr>& rooms) {
+    RWMutexType::ReadLock lock(m_mutex);
+    rooms.reserve(m_rooms.size());
+    for (auto& i : m_rooms) {
+        rooms.push_back(i.second);
+    }
+}
+
+size_t RoomManager::size() {
+    RWMutexType::ReadLock lock(m_mutex);
+    return m_rooms.size();
+}
+
+}
+}
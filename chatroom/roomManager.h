@@ -0,0 +1,70 @@
+#ifndef __CHAT_ROOM_MANAGER_H__
+#define __CHAT_ROOM_MANAGER_H__
+
+#include "pubSub.h"
+#include <chat/mutex.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace chat {
+namespace http {
+
+// 聊天室, 成员即主题 room:<name> 的订阅者, 断开时自动离开
+class Room {
+public:
+    typedef std::shared_ptr<Room> ptr;
+
+    Room(const std::string& name, const std::string& owner, Topic::ptr topic, uint64_t incarnation);
+
+    const std::string& getName() const { return m_name;}
+    const std::string& getOwner() const { return m_owner;}
+    /// 创建时分配, 同名房间删除后重建得到更大的值, 重启后也不重复
+    uint64_t getIncarnation() const { return m_incarnation;}
+    const Topic::ptr& getTopic() const { return m_topic;}
+    bool has(const std::string& id) const { return m_topic->has(id);}
+    size_t size() const { return m_topic->size();}
+
+    static std::string TopicName(const std::string& name) { return "room:" + name;}
+private:
+    std::string m_name;
+    std::string m_owner;
+    Topic::ptr m_topic;
+    uint64_t m_incarnation;
+};
+
+// 房间表, 创建/加入/离开持写锁, 发消息只持读锁查房间
+class RoomManager {
+public:
+    typedef std::shared_ptr<RoomManager> ptr;
+    typedef chat::RWMutex RWMutexType;
+
+    RoomManager(PubSub::ptr pubsub);
+
+    /// 创建房间并加入, 已存在返回 nullptr
+    Room::ptr create(const std::string& name, const std::string& id, ChatSession::ptr conn);
+    Room::ptr get(const std::string& name);
+    /// 加入房间, 房间不存在返回 nullptr, joined 返回是否新加入
+    Room::ptr join(const std::string& name, const std::string& id, ChatSession::ptr conn, bool& joined);
+    /// 离开房间, 不是成员返回 nullptr, 最后一个成员离开后删除房间
+    Room::ptr leave(const std::string& name, const std::string& id);
+    /// 离开该用户加入的全部房间, 返回离开的房间
+    std::vector<Room::ptr> leaveAll(const std::string& id);
+    void list(std::vector<Room::ptr>& rooms);
+    size_t size();
+private:
+    // 调用方需持有写锁
+    void leaveLocked(Room::ptr room, const std::string& id);
+private:
+    PubSub::ptr m_pubsub;
+    RWMutexType m_mutex;
+    std::unordered_map<std::string, Room::ptr> m_rooms;
+    // 用户 -> 加入的房间名, 断开时据此离开
+    std::unordered_map<std::string, std::vector<std::string> > m_userRooms;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,252 @@
+#include "sessionRegistry.h"
+#include "metrics.h"
+#include <chat/config.h>
+#include <chat/util.h>
+#include <algorithm>
+#include <functional>
+#include <unordered_set>
+
+namespace chat {
+namespace http {
+
+static chat::Histogram::ptr s_read_wait = chat::MetricsMgr::GetInstance()->getHistogram(
+        "chat_registry_lock_wait_ns", "session registry lock wait time, read locks sampled 1 in 64", "lock=\"read\"");
+static chat::Histogram::ptr s_write_wait = chat::MetricsMgr::GetInstance()->getHistogram(
+        "chat_registry_lock_wait_ns", "session registry lock wait time, read locks sampled 1 in 64", "lock=\"write\"");
+
+static chat::ConfigVar<uint32_t>::ptr g_roster_changelog_size =
+    chat::Config::Lookup("chat.roster.changelog_size"
+            ,(uint32_t)4096
+            , "user list changes kept for incremental chat_init sync");
+
+static std::atomic<uint32_t> s_changelog_size{0};
+
+struct _RosterIniter {
+    _RosterIniter() {
+        s_changelog_size.store(g_roster_changelog_size->getValue(), std::memory_order_relaxed);
+        g_roster_changelog_size->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            s_changelog_size.store(new_value, std::memory_order_relaxed);
+        });
+    }
+};
+
+static _RosterIniter s_roster_initer;
+
+// 加锁时记录等待时间, start 作为默认参数在基类加锁之前求值
+// 每 Every 次加锁采样一次, 读锁在每次发送的 getConn 路径上, 不逐次计时
+template<class LockType, chat::Histogram::ptr* Hist, uint32_t Every = 1>
+class TimedLock : public LockType {
+public:
+    template<class MutexType>
+    TimedLock(MutexType& mutex, uint64_t start = Sample() ? chat::MonotonicNs() : 0)
+        :LockType(mutex) {
+        if (start) {
+            (*Hist)->record(chat::MonotonicNs() - start);
+        }
+    }
+private:
+    static bool Sample() {
+        if (Every <= 1) {
+            return true;
+        }
+        static thread_local uint32_t s_count = 0;
+        return ++s_count % Every == 0;
+    }
+};
+
+typedef TimedLock<SessionRegistry::RWMutexType::ReadLock, &s_read_wait, 64> ReadLock;
+typedef TimedLock<SessionRegistry::RWMutexType::WriteLock, &s_write_wait> WriteLock;
+
+SessionRegistry::SessionRegistry(uint32_t shard_count)
+    :m_infoVersion(chat::GetCurrentUS())
+    ,m_logBase(m_infoVersion.load()) {
+    if (shard_count == 0) {
+        shard_count = 1;
+    }
+    m_shards.reserve(shard_count);
+    for (uint32_t i = 0; i < shard_count; ++i) {
+        m_shards.emplace_back(new Shard);
+    }
+}
+
+SessionRegistry::Shard& SessionRegistry::getShard(const std::string& id) {
+    return *m_shards[std::hash<std::string>()(id) % m_shards.size()];
+}
+
+SessionRegistry::Shard& SessionRegistry::getShard(WSSession* session) {
+    return *m_shards[((uintptr_t)session >> 4) % m_shards.size()];
+}
+
+ChatSession::ptr SessionRegistry::connect(WSSession::ptr session, chat::IOManager* iom) {
+    ChatSession::ptr conn = std::make_shared<ChatSession>(session, iom);
+    auto& shard = getShard(session.get());
+    WriteLock lock(shard.mutex);
+    shard.conns[session.get()] = conn;
+    return conn;
+}
+
+ChatSession::ptr SessionRegistry::disconnect(WSSession::ptr session) {
+    auto& shard = getShard(session.get());
+    WriteLock lock(shard.mutex);
+    auto it = shard.conns.find(session.get());
+    if (it == shard.conns.end()) {
+        return nullptr;
+    }
+    auto conn = it->second;
+    shard.conns.erase(it);
+    lock.unlock();
+    conn->close();
+    return conn;
+}
+
+ChatSession::ptr SessionRegistry::getConn(WSSession::ptr session) {
+    auto& shard = getShard(session.get());
+    ReadLock lock(shard.mutex);
+    auto it = shard.conns.find(session.get());
+    return it == shard.conns.end() ? nullptr : it->second;
+}
+
+void SessionRegistry::listConns(std::vector<ChatSession::ptr>& conns) {
+    for (auto& shard : m_shards) {
+        ReadLock lock(shard->mutex);
+        for (auto& i : shard->conns) {
+            conns.push_back(i.second);
+        }
+    }
+}
+
+bool SessionRegistry::exists(const std::string& id) {
+    auto& shard = getShard(id);
+    ReadLock lock(shard.mutex);
+    return shard.sessions.find(id) != shard.sessions.end();
+}
+
+ChatSession::ptr SessionRegistry::get(const std::string& id) {
+    auto& shard = getShard(id);
+    ReadLock lock(shard.mutex);
+    auto it = shard.sessions.find(id);
+    return it == shard.sessions.end() ? nullptr : it->second;
+}
+
+std::string SessionRegistry::find(WSSession::ptr session) {
+    auto& shard = getShard(session.get());
+    ReadLock lock(shard.mutex);
+    auto it = shard.ids.find(session.get());
+    return it == shard.ids.end() ? "" : it->second;
+}
+
+void SessionRegistry::add(const std::string& id, WSSession::ptr session) {
+    auto conn = getConn(session);
+    if (!conn) {
+        conn = connect(session, chat::IOManager::GetThis());
+    }
+
+    auto& shard = getShard(id);
+    chat::Mutex::Lock id_lock(shard.idMutex);
+    WriteLock lock(shard.mutex);
+    auto& v = shard.sessions[id];
+    auto old = v;
+    v = conn;
+    lock.unlock();
+
+    if (old && old != conn) {
+        auto& rshard = getShard(old->getSession().get());
+        WriteLock rlock(rshard.mutex);
+        rshard.ids.erase(old->getSession().get());
+    }
+    {
+        auto& rshard = getShard(session.get());
+        WriteLock rlock(rshard.mutex);
+        rshard.ids[session.get()] = id;
+    }
+    if (!old) {
+        m_size.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void SessionRegistry::del(const std::string& id, bool with_info) {
+    auto& shard = getShard(id);
+    chat::Mutex::Lock id_lock(shard.idMutex);
+    WriteLock lock(shard.mutex);
+    ChatSession::ptr old;
+    auto it = shard.sessions.find(id);
+    if (it != shard.sessions.end()) {
+        old = it->second;
+        shard.sessions.erase(it);
+    }
+    if (with_info) {
+        auto uit = shard.users.find(id);
+        if (uit != shard.users.end()) {
+            logChange(2, id, uit->second);
+            shard.users.erase(uit);
+        }
+    }
+    lock.unlock();
+    if (old) {
+        auto& rshard = getShard(old->getSession().get());
+        WriteLock rlock(rshard.mutex);
+        rshard.ids.erase(old->getSession().get());
+        rlock.unlock();
+        m_size.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+SessionRegistry::UserInfo SessionRegistry::getInfo(const std::string& id) {
+    auto& shard = getShard(id);
+    ReadLock lock(shard.mutex);
+    auto it = shard.users.find(id);
+    return it == shard.users.end() ? std::make_pair("", "") : it->second;
+}
+
+void SessionRegistry::addInfo(const std::string& id, const std::string& name, const std::string& avatar) {
+    auto& shard = getShard(id);
+    WriteLock lock(shard.mutex);
+    auto& v = shard.users[id];
+    // 同名重连且信息未变时不必让缓存的用户列表失效
+    if (v.first == name && v.second == avatar && !name.empty()) {
+        return;
+    }
+    v = std::make_pair(name, avatar);
+    logChange(1, id, v);
+}
+
+void SessionRegistry::logChange(uint8_t code, const std::string& id, const UserInfo& info) {
+    chat::Mutex::Lock lock(m_logMutex);
+    uint64_t version = m_infoVersion.load(std::memory_order_relaxed) + 1;
+    m_changes.push_back({version, code, id, info.first, info.second});
+    uint32_t max_size = s_changelog_size.load(std::memory_order_relaxed);
+    while (m_changes.size() > max_size) {
+        m_logBase = m_changes.front().version;
+        m_changes.pop_front();
+    }
+    m_infoVersion.store(version, std::memory_order_release);
+}
+
+bool SessionRegistry::getChanges(uint64_t since, std::vector<RosterChange>& changes, uint64_t& version) {
+    chat::Mutex::Lock lock(m_logMutex);
+    version = m_infoVersion.load(std::memory_order_relaxed);
+    if (since < m_logBase || since > version) {
+        return false;
+    }
+    // 从新到旧, 每个用户只取最后一次变化, 再按版本顺序返回
+    std::unordered_set<std::string_view> seen;
+    for (auto it = m_changes.rbegin(); it != m_changes.rend() && it->version > since; ++it) {
+        if (seen.insert(it->id).second) {
+            changes.push_back(*it);
+        }
+    }
+    std::reverse(changes.begin(), changes.end());
+    return true;
+}
+
+void SessionRegistry::listInfos(std::vector<std::pair<std::string, UserInfo> >& infos) {
+    for (auto& shard : m_shards) {
+        ReadLock lock(shard->mutex);
+        for (auto& i : shard->users) {
+            infos.push_back(i);
+        }
+    }
+}
+
+}
+}
@@ -0,0 +1,83 @@
+#ifndef __CHAT_SESSION_REGISTRY_H__
+#define __CHAT_SESSION_REGISTRY_H__
+
+#include "chatSession.h"
+#include <chat/mutex.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace chat {
+namespace http {
+
+// 按 id 哈希分片的 session/用户信息表, 每个分片独立加锁
+class SessionRegistry {
+public:
+    typedef std::shared_ptr<SessionRegistry> ptr;
+    typedef chat::RWMutex RWMutexType;
+    typedef std::pair<std::string, std::string> UserInfo;   //name, avatar
+
+    SessionRegistry(uint32_t shard_count = 16);
+
+    /// 连接建立/断开, 维护每条连接的 ChatSession
+    ChatSession::ptr connect(WSSession::ptr session, chat::IOManager* iom);
+    ChatSession::ptr disconnect(WSSession::ptr session);
+    ChatSession::ptr getConn(WSSession::ptr session);
+    /// 全部连接, 包括还没有登录的
+    void listConns(std::vector<ChatSession::ptr>& conns);
+
+    bool exists(const std::string& id);
+    ChatSession::ptr get(const std::string& id);
+    std::string find(WSSession::ptr session);
+    void add(const std::string& id, WSSession::ptr session);
+    /// 删除 session, with_info 为 true 时同时删除用户信息
+    void del(const std::string& id, bool with_info = true);
+
+    UserInfo getInfo(const std::string& id);
+    void addInfo(const std::string& id, const std::string& name, const std::string& avatar);
+    void listInfos(std::vector<std::pair<std::string, UserInfo> >& infos);
+    /// 用户列表版本号, 每次增删加 1, 初值为启动时间(微秒), 重启前的版本号总是早于变更日志
+    /// 在 listInfos 之前读取, 用于判断缓存的用户列表是否过期
+    uint64_t getInfoVersion() const { return m_infoVersion.load(std::memory_order_acquire);}
+    /// 取版本 since 之后的变化, 同一用户只保留最后一次, version 返回变化对应的版本号
+    /// since 早于变更日志(chat.roster.changelog_size)或晚于当前版本时返回 false, 需要全量同步
+    bool getChanges(uint64_t since, std::vector<RosterChange>& changes, uint64_t& version);
+
+    /// 在线 session 数
+    size_t size() const { return m_size.load(std::memory_order_relaxed);}
+    uint32_t getShardCount() const { return m_shards.size();}
+private:
+    struct alignas(64) Shard {
+        // 串行化 id 落在本分片的 add/del, 两步更新的反向索引不会交错; 先于各分片的 mutex 加锁
+        chat::Mutex idMutex;
+        RWMutexType mutex;
+        std::map<std::string, ChatSession::ptr> sessions;
+        std::unordered_map<std::string, UserInfo> users;
+        // 以下按 session 指针分片
+        std::unordered_map<WSSession*, ChatSession::ptr> conns;
+        // 反向索引 session -> id
+        std::unordered_map<WSSession*, std::string> ids;
+    };
+
+    Shard& getShard(const std::string& id);
+    Shard& getShard(WSSession* session);
+    // 调用方需持有用户所在分片的写锁, 保证日志顺序与分片内容一致
+    void logChange(uint8_t code, const std::string& id, const UserInfo& info);
+private:
+    std::vector<std::unique_ptr<Shard> > m_shards;
+    std::atomic<size_t> m_size{0};
+    std::atomic<uint64_t> m_infoVersion;
+    chat::Mutex m_logMutex;
+    std::deque<RosterChange> m_changes;
+    // 日志中最早一条之前的版本号, since 不小于它才能增量同步
+    uint64_t m_logBase;
+};
+
+}
+}
+
+#endif
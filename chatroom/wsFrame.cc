@@ -0,0 +1,77 @@
+#include "wsFrame.h"
+#include <chat/endian.h>
+#include <string.h>
+
+namespace chat {
+namespace http {
+
+WSFrame::ptr WSFrame::Create(const std::string& payload, int32_t opcode, const std::string& key) {
+    std::string buf = NewBuffer(payload.size());
+    buf.append(payload);
+    return CreateFromBuffer(std::move(buf), opcode, key);
+}
+
+std::string WSFrame::NewBuffer(size_t payload_hint) {
+    std::string buf;
+    buf.reserve(MAX_HEADER_SIZE + payload_hint);
+    buf.append(MAX_HEADER_SIZE, '\0');
+    return buf;
+}
+
+WSFrame::ptr WSFrame::CreateFromBuffer(std::string&& buf, int32_t opcode, const std::string& key
+                                       ,std::shared_ptr<MessageTrace> trace) {
+    return WSFrame::ptr(new WSFrame(std::move(buf), opcode, key, std::move(trace)));
+}
+
+WSFrame::ptr WSFrame::WithTrace(WSFrame::ptr frame, std::shared_ptr<MessageTrace> trace) {
+    if (frame->m_base) {
+        frame = frame->m_base;
+    }
+    return WSFrame::ptr(new WSFrame(frame, std::move(trace)));
+}
+
+WSFrame::WSFrame(WSFrame::ptr base, std::shared_ptr<MessageTrace> trace)
+    :m_opcode(base->m_opcode)
+    ,m_key(base->m_key)
+    ,m_trace(std::move(trace))
+    ,m_offset(base->m_offset)
+    ,m_base(base) {
+}
+
+WSFrame::WSFrame(std::string&& buf, int32_t opcode, const std::string& key
+                 ,std::shared_ptr<MessageTrace> trace)
+    :m_opcode(opcode)
+    ,m_key(key)
+    ,m_trace(std::move(trace))
+    ,m_buf(std::move(buf)) {
+    uint64_t size = m_buf.size() - MAX_HEADER_SIZE;
+    char head[MAX_HEADER_SIZE];
+    size_t head_size = 2;
+    head[0] = (char)(0x80 | (opcode & 0x0F));   //fin, 服务端帧不加 mask
+    if (size < 126) {
+        head[1] = (char)size;
+    } else if (size < 65536) {
+        head[1] = 126;
+        uint16_t len = chat::byteswapOnLittleEndian((uint16_t)size);
+        memcpy(head + 2, &len, sizeof(len));
+        head_size += sizeof(len);
+    } else {
+        head[1] = 127;
+        uint64_t len = chat::byteswapOnLittleEndian(size);
+        memcpy(head + 2, &len, sizeof(len));
+        head_size += sizeof(len);
+    }
+    m_offset = MAX_HEADER_SIZE - head_size;
+    memcpy(&m_buf[m_offset], head, head_size);
+}
+
+int32_t WSFrame::writeTo(WSSession::ptr session) const {
+    if (session->writeFixSize(data(), size()) <= 0) {
+        session->close();
+        return -1;
+    }
+    return size();
+}
+
+}
+}
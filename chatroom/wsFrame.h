@@ -0,0 +1,68 @@
+#ifndef __CHAT_WS_FRAME_H__
+#define __CHAT_WS_FRAME_H__
+
+#include <chat/http/ws_session.h>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace chat {
+namespace http {
+
+class MessageTrace;
+
+// 编码完成的 WebSocket 帧(帧头 + 负载), 创建后只读, 广播时所有 session 共享
+class WSFrame {
+public:
+    typedef std::shared_ptr<const WSFrame> ptr;
+    static constexpr size_t MAX_HEADER_SIZE = 10;
+
+    /// key 非空时, 同一连接队列中 key 相同的旧帧可被新帧合并(coalesce 策略)
+    static WSFrame::ptr Create(const std::string& payload
+                               ,int32_t opcode = WSFrameHead::TEXT_FRAME
+                               ,const std::string& key = "");
+
+    /// 返回预留了帧头空间的缓冲, 编码器直接把负载追加在后面
+    static std::string NewBuffer(size_t payload_hint = 0);
+    /// 接管 NewBuffer 得到的缓冲, 在预留空间内填写帧头, 负载不再拷贝
+    /// trace 非空时, 帧写出后更新其写出时间
+    static WSFrame::ptr CreateFromBuffer(std::string&& buf
+                                         ,int32_t opcode = WSFrameHead::TEXT_FRAME
+                                         ,const std::string& key = ""
+                                         ,std::shared_ptr<MessageTrace> trace = nullptr);
+    /// 与 frame 共享帧缓冲, 只换上新的 trace, 用于缓存复用的帧
+    static WSFrame::ptr WithTrace(WSFrame::ptr frame, std::shared_ptr<MessageTrace> trace);
+
+    const char* data() const { return bytes().data() + m_offset;}
+    size_t size() const { return bytes().size() - m_offset;}
+    size_t getHeaderSize() const { return MAX_HEADER_SIZE - m_offset;}
+    size_t getPayloadSize() const { return bytes().size() - MAX_HEADER_SIZE;}
+    std::string_view getPayload() const {
+        return std::string_view(bytes().data() + MAX_HEADER_SIZE, getPayloadSize());
+    }
+    int32_t getOpcode() const { return m_opcode;}
+    const std::string& getKey() const { return m_key;}
+    const std::shared_ptr<MessageTrace>& getTrace() const { return m_trace;}
+
+    /// 整帧一次写入 session, 成功返回写入字节数, 失败关闭连接并返回 -1
+    int32_t writeTo(WSSession::ptr session) const;
+private:
+    WSFrame(std::string&& buf, int32_t opcode, const std::string& key
+            ,std::shared_ptr<MessageTrace> trace);
+    WSFrame(WSFrame::ptr base, std::shared_ptr<MessageTrace> trace);
+    const std::string& bytes() const { return m_base ? m_base->m_buf : m_buf;}
+private:
+    int32_t m_opcode;
+    std::string m_key;
+    std::shared_ptr<MessageTrace> m_trace;
+    // 帧头在 m_buf 中的起始位置, 帧头紧贴负载右对齐存放
+    size_t m_offset = 0;
+    std::string m_buf;
+    // 非空时帧缓冲在 m_base 中, m_buf 为空
+    WSFrame::ptr m_base;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,96 @@
+#include "chatroom/asyncLog.h"
+#include "tests/test.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+// 只计数的输出目标, block 为 true 时阻塞后台线程, 用于填满队列
+class CountAppender : public chat::LogAppender {
+public:
+    typedef std::shared_ptr<CountAppender> ptr;
+
+    void log(std::shared_ptr<chat::Logger> logger, chat::LogLevel::Level level
+             ,chat::LogEvent::ptr event) override {
+        while (block.load()) {
+            usleep(100);
+        }
+        count.fetch_add(1);
+    }
+    std::string toYamlString() override { return "{}";}
+
+    std::atomic<uint64_t> count{0};
+    std::atomic<bool> block{false};
+};
+
+static chat::LogEvent::ptr NewEvent(chat::Logger::ptr logger) {
+    return chat::LogEvent::ptr(new chat::LogEvent(logger, chat::LogLevel::INFO
+                , __FILE__, __LINE__, 0, 0, 0, 0, "test"));
+}
+
+// start 之前和 stop 之后都同步写出
+static void TestSyncWhenStopped() {
+    auto logger = CHAT_LOG_NAME("async_log_test");
+    CountAppender::ptr out(new CountAppender);
+    chat::AsyncLogAppender::ptr ap(new chat::AsyncLogAppender(8, 1));
+    ap->addAppender(out);
+    ap->log(logger, chat::LogLevel::INFO, NewEvent(logger));
+    CHAT_CHECK_EQ(out->count.load(), 1u);
+    ap->start("test");
+    ap->stop();
+    ap->log(logger, chat::LogLevel::INFO, NewEvent(logger));
+    CHAT_CHECK_EQ(out->count.load(), 2u);
+    CHAT_CHECK_EQ(ap->getDropped(), 0u);
+}
+
+// 后台线程阻塞时队列满即丢弃并计数, stop 写出队列中剩余的日志
+static void TestDropWhenFull() {
+    auto logger = CHAT_LOG_NAME("async_log_test");
+    CountAppender::ptr out(new CountAppender);
+    chat::AsyncLogAppender::ptr ap(new chat::AsyncLogAppender(4, 1));
+    ap->addAppender(out);
+    out->block = true;
+    ap->start("test");
+    const uint64_t total = 64;
+    for (uint64_t i = 0; i < total; ++i) {
+        ap->log(logger, chat::LogLevel::INFO, NewEvent(logger));
+    }
+    CHAT_CHECK(ap->getDropped() > 0);
+    out->block = false;
+    ap->stop();
+    CHAT_CHECK_EQ(out->count.load() + ap->getDropped(), total);
+}
+
+// 与 stop 并发写入时, 每条日志要么写出要么计入丢弃
+static void TestStopUnderLoad() {
+    auto logger = CHAT_LOG_NAME("async_log_test");
+    for (int round = 0; round < 20; ++round) {
+        CountAppender::ptr out(new CountAppender);
+        chat::AsyncLogAppender::ptr ap(new chat::AsyncLogAppender(64, 1));
+        ap->addAppender(out);
+        ap->start("test");
+        const int threads = 4;
+        const uint64_t per = 2000;
+        std::vector<std::thread> producers;
+        for (int t = 0; t < threads; ++t) {
+            producers.emplace_back([&]() {
+                for (uint64_t i = 0; i < per; ++i) {
+                    ap->log(logger, chat::LogLevel::INFO, NewEvent(logger));
+                }
+            });
+        }
+        usleep(500);
+        ap->stop();
+        for (auto& i : producers) {
+            i.join();
+        }
+        CHAT_CHECK_EQ(out->count.load() + ap->getDropped(), threads * per);
+    }
+}
+
+int main(int argc, char** argv) {
+    TestSyncWhenStopped();
+    TestDropWhenFull();
+    TestStopUnderLoad();
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include "chatroom/binLog.h"
+#include "tests/test.h"
+#include <chat/config.h>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+
+static std::string s_path;
+
+static bool EndsWith(const std::string& s, const std::string& tail) {
+    return s.size() >= tail.size() && s.compare(s.size() - tail.size(), tail.size(), tail) == 0;
+}
+
+// 各类参数写入后按格式串还原
+static void TestRoundTrip() {
+    unlink(s_path.c_str());
+    chat::BinLog::Start();
+    CHAT_CHECK(chat::BinLog::IsEnabled());
+    uint16_t id = chat::BinLog::Register(chat::LogLevel::INFO, __FILE__, __LINE__
+                    , "i={} u={} f={} s={} v={}");
+    chat::BinLog::Write(id, -1, 2u, 0.5, std::string("str"), std::string_view("view"));
+    chat::BinLog::Stop();
+    CHAT_CHECK(!chat::BinLog::IsEnabled());
+
+    std::ifstream ifs(s_path, std::ios::binary);
+    chat::BinLogReader reader(ifs);
+    std::string line;
+    CHAT_CHECK(reader.next(line));
+    CHAT_CHECK(EndsWith(line, "i=-1 u=2 f=0.5 s=str v=view"));
+    CHAT_CHECK(!reader.next(line));
+    CHAT_CHECK(reader.getError().empty());
+}
+
+// 写入线程不断注册新格式并立即写记录, 与后台刷盘并发时格式定义必须先于引用它的记录落盘
+static void TestFormatOrdering() {
+    unlink(s_path.c_str());
+    chat::BinLog::Start();
+    const int threads = 4;
+    const int per = 4000;
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; ++t) {
+        writers.emplace_back([t]() {
+            for (int i = 0; i < per; ++i) {
+                uint16_t id = chat::BinLog::Register(chat::LogLevel::INFO, __FILE__, i, "v={}");
+                chat::BinLog::Write(id, t * per + i);
+                if (i % 256 == 0) {
+                    usleep(100);
+                }
+            }
+        });
+    }
+    for (auto& i : writers) {
+        i.join();
+    }
+    chat::BinLog::Stop();
+
+    std::ifstream ifs(s_path, std::ios::binary);
+    chat::BinLogReader reader(ifs);
+    std::string line;
+    int records = 0;
+    while (reader.next(line)) {
+        CHAT_CHECK(line.find("dropped") == std::string::npos);
+        ++records;
+    }
+    if (!reader.getError().empty()) {
+        fprintf(stderr, "%s\n", reader.getError().c_str());
+    }
+    CHAT_CHECK(reader.getError().empty());
+    CHAT_CHECK_EQ(records, threads * per);
+}
+
+int main(int argc, char** argv) {
+    char dir[] = "/tmp/binlog_test_XXXXXX";
+    CHAT_CHECK(mkdtemp(dir));
+    s_path = std::string(dir) + "/chat.blog";
+    chat::Config::Lookup<bool>("binlog.enable")->setValue(true);
+    chat::Config::Lookup<std::string>("binlog.path")->setValue(s_path);
+    chat::Config::Lookup<uint32_t>("binlog.flush_ms")->setValue(1);
+
+    TestRoundTrip();
+    TestFormatOrdering();
+
+    unlink(s_path.c_str());
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include "chatroom/chatSession.h"
+#include "tests/test.h"
+#include <chat/config.h>
+#include <chat/iomanager.h>
+#include <atomic>
+#include <string>
+#include <unistd.h>
+
+using namespace chat::http;
+
+static chat::IOManager* s_iom = nullptr;
+
+// 在 IO 线程上放一个阻塞任务, 之后调度的写协程要等 open 才运行, 积压留在连接中
+class Gate {
+public:
+    Gate() {
+        s_iom->schedule([this]() {
+            while (!m_open) {
+                usleep(100);
+            }
+        });
+    }
+    ~Gate() { open();}
+    void open() { m_open = true;}
+private:
+    std::atomic<bool> m_open{false};
+};
+
+static void SetPolicy(const std::string& policy, uint32_t max_frames) {
+    chat::Config::Lookup<std::string>("chat.outbound.policy")->setValue(policy);
+    chat::Config::Lookup<uint32_t>("chat.outbound.max_frames")->setValue(max_frames);
+}
+
+static WSFrame::ptr NewFrame(const std::string& key = "") {
+    return WSFrame::Create(std::string(16, 'x'), WSFrameHead::TEXT_FRAME, key);
+}
+
+// 连接已关闭时写协程丢弃全部积压(不碰 socket), 等它运行完
+static OutboundStats CloseAndWait(ChatSession::ptr conn, Gate& gate) {
+    conn->close();
+    gate.open();
+    for (int i = 0; i < 10000 && conn->getStats().backlog_frames; ++i) {
+        usleep(100);
+    }
+    auto stats = conn->getStats();
+    CHAT_CHECK_EQ(stats.backlog_frames, 0u);
+    CHAT_CHECK_EQ(stats.backlog_bytes, 0u);
+    return stats;
+}
+
+// drop_newest: 积压达到上限后新帧直接丢弃
+static void TestDropNewest() {
+    SetPolicy("drop_newest", 4);
+    Gate gate;
+    ChatSession::ptr conn(new ChatSession(nullptr, s_iom));
+    for (int i = 0; i < 4; ++i) {
+        CHAT_CHECK_EQ(conn->send(NewFrame()), 0);
+    }
+    CHAT_CHECK_EQ(conn->send(NewFrame()), -2);
+    auto stats = conn->getStats();
+    CHAT_CHECK_EQ(stats.enqueued, 4u);
+    CHAT_CHECK_EQ(stats.dropped_frames, 1u);
+    CHAT_CHECK_EQ(stats.backlog_frames, 4u);
+    CHAT_CHECK(stats.backlog_peak_bytes >= stats.backlog_bytes);
+
+    stats = CloseAndWait(conn, gate);
+    CHAT_CHECK_EQ(stats.dropped_frames, 5u);
+    CHAT_CHECK_EQ(conn->send(NewFrame()), -1);
+}
+
+// drop_oldest: 旧帧由写协程丢弃, 写协程阻塞时给它留一倍余量, 超出后才丢新帧
+static void TestDropOldest() {
+    SetPolicy("drop_oldest", 4);
+    Gate gate;
+    ChatSession::ptr conn(new ChatSession(nullptr, s_iom));
+    for (int i = 0; i < 8; ++i) {
+        CHAT_CHECK_EQ(conn->send(NewFrame()), 0);
+    }
+    CHAT_CHECK_EQ(conn->send(NewFrame()), -2);
+    auto stats = conn->getStats();
+    CHAT_CHECK_EQ(stats.enqueued, 8u);
+    CHAT_CHECK_EQ(stats.dropped_frames, 1u);
+    CHAT_CHECK_EQ(stats.backlog_frames, 8u);
+
+    stats = CloseAndWait(conn, gate);
+    CHAT_CHECK_EQ(stats.dropped_frames, 9u);
+}
+
+// coalesce: key 相同的旧帧被新帧替换, 无 key 的帧不合并
+static void TestCoalesce() {
+    SetPolicy("coalesce", 16);
+    Gate gate;
+    ChatSession::ptr conn(new ChatSession(nullptr, s_iom));
+    CHAT_CHECK_EQ(conn->send(NewFrame("presence:a")), 0);
+    CHAT_CHECK_EQ(conn->send(NewFrame()), 0);
+    CHAT_CHECK_EQ(conn->send(NewFrame("presence:a")), 0);
+    CHAT_CHECK_EQ(conn->send(NewFrame("presence:b")), 0);
+    CHAT_CHECK_EQ(conn->send(NewFrame("presence:a")), 0);
+    CHAT_CHECK_EQ(conn->getStats().backlog_frames, 5u);
+
+    auto stats = CloseAndWait(conn, gate);
+    CHAT_CHECK_EQ(stats.coalesced, 2u);
+    CHAT_CHECK_EQ(stats.dropped_frames, 3u);
+}
+
+// 积压年龄从积压变为非空时开始计, 写协程没有运行也能读到
+static void TestBacklogAge() {
+    SetPolicy("drop_oldest", 16);
+    Gate gate;
+    ChatSession::ptr conn(new ChatSession(nullptr, s_iom));
+    CHAT_CHECK_EQ(conn->getStats().backlog_age_ms, 0u);
+    CHAT_CHECK_EQ(conn->send(NewFrame()), 0);
+    usleep(30 * 1000);
+    CHAT_CHECK(conn->getStats().backlog_age_ms >= 20);
+    CloseAndWait(conn, gate);
+    CHAT_CHECK_EQ(conn->getStats().backlog_age_ms, 0u);
+}
+
+int main(int argc, char** argv) {
+    chat::Config::Lookup<uint64_t>("chat.outbound.max_bytes")->setValue(1024 * 1024);
+    chat::IOManager iom(1, false, "test");
+    s_iom = &iom;
+    TestDropNewest();
+    TestDropOldest();
+    TestCoalesce();
+    TestBacklogAge();
+    s_iom = nullptr;
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include "chatroom/jsonStream.h"
+#include "tests/test.h"
+#include <string>
+#include <vector>
+
+using namespace chat::http;
+
+// 把回调还原成一串事件, 便于整体比较
+class RecordHandler : public JsonHandler {
+public:
+    bool onStartObject() override { events.push_back("{"); return true;}
+    bool onEndObject() override { events.push_back("}"); return true;}
+    bool onStartArray() override { events.push_back("["); return true;}
+    bool onEndArray() override { events.push_back("]"); return true;}
+    bool onKey(std::string_view key) override {
+        events.push_back("k:" + std::string(key));
+        return true;
+    }
+    bool onValue(std::string_view val, ValueType type) override {
+        events.push_back(std::to_string(type) + ":" + std::string(val));
+        return true;
+    }
+
+    std::vector<std::string> events;
+};
+
+static bool Parse(std::string_view in, int max_depth = 64) {
+    std::string scratch;
+    RecordHandler h;
+    return JsonReader::Parse(in, scratch, h, max_depth);
+}
+
+static std::vector<std::string> Events(std::string_view in, int max_depth = 64) {
+    std::string scratch;
+    RecordHandler h;
+    CHAT_CHECK(JsonReader::Parse(in, scratch, h, max_depth));
+    return h.events;
+}
+
+static void TestNumbers() {
+    const char* good[] = {"0", "-0", "12", "-1.5", "1e5", "1.2E-3", "1E+2", "[0,-1,2.50]"};
+    const char* bad[] = {"-", "+1", ".5", "01", "-01", "1.", "1.2.3", "1e", "1e+", "--1", "1abc", "0x10"};
+    for (auto i : good) {
+        CHAT_CHECK(Parse(i));
+    }
+    for (auto i : bad) {
+        CHAT_CHECK(!Parse(i));
+    }
+}
+
+static void TestStrings() {
+    auto ev = Events("\"a\\\"b\\\\c\\/d\\b\\f\\n\\r\\t\\u0041\\u00e9\\ud83d\\ude00\"");
+    CHAT_CHECK_EQ(ev.size(), 1u);
+    CHAT_CHECK_EQ(ev[0], std::to_string(JsonHandler::STRING) + ":a\"b\\c/d\b\f\n\r\tA\xc3\xa9\xf0\x9f\x98\x80");
+
+    // 控制字符必须转义, 代理项必须成对
+    CHAT_CHECK(!Parse("\"a\x01\""));
+    CHAT_CHECK(!Parse("\"a\\n\x1f\""));
+    CHAT_CHECK(!Parse("\"\\udc00\""));
+    CHAT_CHECK(!Parse("\"\\ud83d\""));
+    CHAT_CHECK(!Parse("\"\\x41\""));
+    CHAT_CHECK(!Parse("\"abc"));
+}
+
+static void TestStructure() {
+    auto ev = Events("{\"a\":[1,true,null,{\"b\":\"c\"}],\"d\":false}");
+    std::vector<std::string> expect = {
+        "{", "k:a", "[", "1:1", "2:true", "3:null", "{", "k:b", "0:c", "}", "]", "k:d", "2:false", "}"
+    };
+    CHAT_CHECK(ev == expect);
+
+    CHAT_CHECK(!Parse("{\"a\":1,}"));
+    CHAT_CHECK(!Parse("[1 2]"));
+    CHAT_CHECK(!Parse("{\"a\" 1}"));
+    CHAT_CHECK(!Parse("{} {}"));
+    CHAT_CHECK(!Parse("[tru]"));
+    CHAT_CHECK(!Parse(""));
+}
+
+static void TestMaxDepth() {
+    // 超过深度的部分以原文回调
+    auto ev = Events("{\"a\":{\"b\":[1,2]},\"c\":\"d\"}", 1);
+    std::vector<std::string> expect = {
+        "{", "k:a", std::to_string(JsonHandler::RAW) + ":{\"b\":[1,2]}", "k:c", "0:d", "}"
+    };
+    CHAT_CHECK(ev == expect);
+    CHAT_CHECK(!Parse("{\"a\":{\"b\":[1,2}}", 1));
+}
+
+static void TestWriterRoundTrip() {
+    std::string value = std::string("quote\" back\\ nl\n tab\t ctl\x01\x1f utf8\xc3\xa9 nul") + '\0';
+    std::string out;
+    JsonWriter w(out);
+    w.startObject()
+        .kv("s", value)
+        .key("list").startArray().value("x").value("").endArray()
+        .key("raw").raw("{\"n\":1}")
+        .endObject();
+
+    auto ev = Events(out);
+    std::vector<std::string> expect = {
+        "{", "k:s", "0:" + value, "k:list", "[", "0:x", "0:", "]", "k:raw", "{", "k:n", "1:1", "}", "}"
+    };
+    CHAT_CHECK(ev == expect);
+
+    std::string escaped;
+    JsonWriter::AppendEscaped(escaped, value);
+    for (unsigned char c : escaped) {
+        CHAT_CHECK(c >= 0x20);
+    }
+}
+
+int main(int argc, char** argv) {
+    TestNumbers();
+    TestStrings();
+    TestStructure();
+    TestMaxDepth();
+    TestWriterRoundTrip();
+    return 0;
+}
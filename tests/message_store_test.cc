@@ -0,0 +1,232 @@
+#include "chatroom/messageStore.h"
+#include "tests/test.h"
+#include <chat/config.h>
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace chat::http;
+
+static std::string s_path;
+
+static std::string Message(uint64_t i) {
+    return "{\"type\":\"chat_response\",\"content\":\"" + std::to_string(i) + "\"}";
+}
+
+// 读出 offset < before 的最多 limit 条, 检查为 [first, first + n) 且内容对应
+static void CheckRead(MessageStore& store, const std::string& key, uint64_t before, uint32_t limit
+                      ,uint64_t first, size_t n) {
+    std::vector<HistoryRecord> records;
+    CHAT_CHECK(store.read(key, before, limit, records));
+    CHAT_CHECK_EQ(records.size(), n);
+    for (size_t i = 0; i < records.size(); ++i) {
+        CHAT_CHECK_EQ(records[i].offset, first + i);
+        CHAT_CHECK_EQ(records[i].data, Message(first + i));
+        CHAT_CHECK(records[i].time > 0);
+    }
+}
+
+static void Append(MessageStore& store, const std::string& key, uint64_t from, uint64_t to) {
+    for (uint64_t i = from; i < to; ++i) {
+        store.append(key, Message(i));
+        if (i % 7 == 0) {
+            store.flush();
+        }
+    }
+    store.flush();
+}
+
+// 会话目录名为 key 的十六进制, 返回按名字排序后最后一个分段的 .log
+static std::string LastSegment(const std::string& key) {
+    static const char* s_hex = "0123456789abcdef";
+    std::string dir = s_path + "/";
+    for (unsigned char c : key) {
+        dir.push_back(s_hex[c >> 4]);
+        dir.push_back(s_hex[c & 0xf]);
+    }
+    std::vector<std::string> logs;
+    DIR* d = opendir(dir.c_str());
+    CHAT_CHECK(d);
+    while (struct dirent* e = readdir(d)) {
+        std::string name = e->d_name;
+        if (name.size() > 4 && name.substr(name.size() - 4) == ".log") {
+            logs.push_back(name);
+        }
+    }
+    closedir(d);
+    CHAT_CHECK(logs.size() > 1);
+    std::sort(logs.begin(), logs.end());
+    return dir + "/" + logs.back();
+}
+
+static uint64_t FileSize(const std::string& file) {
+    struct stat st;
+    CHAT_CHECK_EQ(stat(file.c_str(), &st), 0);
+    return st.st_size;
+}
+
+static void TestAppendRead() {
+    const std::string key = MessageStore::RoomKey("lobby", 1);
+    MessageStore store(s_path);
+    Append(store, key, 0, 500);
+
+    CheckRead(store, key, 0, 50, 450, 50);
+    CheckRead(store, key, 450, 50, 400, 50);
+    CheckRead(store, key, 30, 50, 0, 30);
+    CheckRead(store, key, 1, 10, 0, 1);
+    CheckRead(store, key, 0, 1000, 0, 500);
+    CheckRead(store, key, 10000, 5, 495, 5);
+    CheckRead(store, MessageStore::RoomKey("nobody", 1), 0, 10, 0, 0);
+    // 同名房间重建后是新的会话
+    CheckRead(store, MessageStore::RoomKey("lobby", 2), 0, 10, 0, 0);
+
+    CHAT_CHECK_EQ(MessageStore::PairKey("alice", "bob"), MessageStore::PairKey("bob", "alice"));
+    store.append(MessageStore::PairKey("bob", "alice"), Message(0));
+    store.flush();
+    CheckRead(store, MessageStore::PairKey("alice", "bob"), 0, 10, 0, 1);
+}
+
+static void TestReopen() {
+    const std::string key = MessageStore::RoomKey("lobby", 1);
+    {
+        MessageStore store(s_path);
+        CheckRead(store, key, 0, 1000, 0, 500);
+        Append(store, key, 500, 520);
+        CheckRead(store, key, 505, 3, 502, 3);
+    }
+    MessageStore store(s_path);
+    CheckRead(store, key, 0, 1000, 0, 520);
+}
+
+// 写了一半的尾部在恢复时截掉, 之后的追加接着已提交的 offset
+static void TestTornTail() {
+    const std::string key = MessageStore::RoomKey("lobby", 1);
+    std::string file = LastSegment(key);
+    uint64_t size = FileSize(file);
+    int fd = open(file.c_str(), O_WRONLY | O_APPEND);
+    CHAT_CHECK(fd >= 0);
+    // 像是一条记录头写到一半
+    CHAT_CHECK_EQ(write(fd, "\0\0\0\x10\0\0", 6), 6);
+    close(fd);
+
+    MessageStore store(s_path);
+    CheckRead(store, key, 0, 1000, 0, 520);
+    CHAT_CHECK_EQ(FileSize(file), size);
+    Append(store, key, 520, 530);
+    CheckRead(store, key, 0, 1000, 0, 530);
+}
+
+// 校验失败的记录及其之后的内容在恢复时截掉
+static void TestCorruptRecord() {
+    const std::string key = MessageStore::RoomKey("lobby", 1);
+    std::string file = LastSegment(key);
+    uint64_t size = FileSize(file);
+    int fd = open(file.c_str(), O_WRONLY);
+    CHAT_CHECK(fd >= 0);
+    CHAT_CHECK_EQ(pwrite(fd, "X", 1, size - 2), 1);
+    close(fd);
+
+    {
+        MessageStore store(s_path);
+        CheckRead(store, key, 0, 1000, 0, 529);
+        CHAT_CHECK_EQ(FileSize(file), size - LogSegment::HEADER_SIZE - Message(529).size());
+        Append(store, key, 529, 540);
+        CheckRead(store, key, 0, 1000, 0, 540);
+    }
+    MessageStore store(s_path);
+    CheckRead(store, key, 0, 1000, 0, 540);
+}
+
+// stop 写出还在队列中的消息, 之后的 append 直接写入
+static void TestStop() {
+    const std::string key = MessageStore::GroupKey();
+    {
+        MessageStore store(s_path);
+        store.append(key, Message(0));
+        store.append(key, Message(1));
+        store.stop();
+        store.append(key, Message(2));
+        CheckRead(store, key, 0, 10, 0, 3);
+    }
+    MessageStore store(s_path);
+    CheckRead(store, key, 0, 10, 0, 3);
+}
+
+// 当前进程打开的历史文件数
+static size_t OpenFiles() {
+    size_t n = 0;
+    DIR* d = opendir("/proc/self/fd");
+    CHAT_CHECK(d);
+    while (struct dirent* e = readdir(d)) {
+        char link[PATH_MAX];
+        ssize_t len = readlinkat(dirfd(d), e->d_name, link, sizeof(link) - 1);
+        if (len > 0 && std::string(link, len).compare(0, s_path.size(), s_path) == 0) {
+            ++n;
+        }
+    }
+    closedir(d);
+    return n;
+}
+
+// 只有活动分段常开文件; 会话超过 chat.history.max_open 时关闭最久未用的, 再次访问时重新加载
+static void TestOpenFiles() {
+    auto max_open = chat::Config::Lookup<uint32_t>("chat.history.max_open");
+    CHAT_CHECK(max_open);
+    uint32_t old_max_open = max_open->getValue();
+    max_open->setValue(2);
+    {
+        MessageStore store(s_path);
+        const std::string lobby = MessageStore::RoomKey("lobby", 1);
+        CheckRead(store, lobby, 0, 1000, 0, 540);
+        CHAT_CHECK_EQ(OpenFiles(), 2u);
+
+        for (uint64_t i = 0; i < 5; ++i) {
+            auto key = MessageStore::RoomKey("evict", i);
+            for (uint64_t j = 0; j < 100; ++j) {
+                store.append(key, Message(j));
+            }
+            store.flush();
+            CHAT_CHECK(OpenFiles() <= 4);
+        }
+        for (uint64_t i = 0; i < 5; ++i) {
+            CheckRead(store, MessageStore::RoomKey("evict", i), 0, 1000, 0, 100);
+            CHAT_CHECK(OpenFiles() <= 4);
+        }
+        CheckRead(store, lobby, 0, 1000, 0, 540);
+        Append(store, MessageStore::RoomKey("evict", 0), 100, 120);
+        CheckRead(store, MessageStore::RoomKey("evict", 0), 0, 1000, 0, 120);
+        CHAT_CHECK(OpenFiles() <= 4);
+    }
+    CHAT_CHECK_EQ(OpenFiles(), 0u);
+    max_open->setValue(old_max_open);
+}
+
+int main(int argc, char** argv) {
+    char tmpl[] = "/tmp/chat_history_test_XXXXXX";
+    CHAT_CHECK(mkdtemp(tmpl));
+    s_path = tmpl;
+
+    // 小分段、密索引, 几百条消息就能覆盖分段切换和索引查找
+    auto segment_bytes = chat::Config::Lookup<uint64_t>("chat.history.segment_bytes");
+    auto index_interval = chat::Config::Lookup<uint32_t>("chat.history.index_interval");
+    auto fsync = chat::Config::Lookup<bool>("chat.history.fsync");
+    CHAT_CHECK(segment_bytes && index_interval && fsync);
+    segment_bytes->setValue(4096);
+    index_interval->setValue(300);
+    fsync->setValue(false);
+
+    TestAppendRead();
+    TestReopen();
+    TestTornTail();
+    TestCorruptRecord();
+    TestStop();
+    TestOpenFiles();
+
+    CHAT_CHECK_EQ(system(("rm -rf " + s_path).c_str()), 0);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "chatroom/mpscQueue.h"
+#include "tests/test.h"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace chat::http;
+
+static void TestFifo() {
+    MpscQueue<std::string> q;
+    std::string v;
+    CHAT_CHECK(q.empty());
+    CHAT_CHECK(!q.pop(v));
+    for (int i = 0; i < 100; ++i) {
+        q.push(std::to_string(i));
+    }
+    CHAT_CHECK(!q.empty());
+    for (int i = 0; i < 100; ++i) {
+        CHAT_CHECK(q.pop(v));
+        CHAT_CHECK_EQ(v, std::to_string(i));
+    }
+    CHAT_CHECK(q.empty());
+    CHAT_CHECK(!q.pop(v));
+}
+
+// 取出的元素不再被队列持有, 析构时释放剩余元素
+static void TestOwnership() {
+    auto p = std::make_shared<int>(1);
+    {
+        MpscQueue<std::shared_ptr<int> > q;
+        q.push(p);
+        q.push(p);
+        CHAT_CHECK_EQ(p.use_count(), 3);
+        std::shared_ptr<int> v;
+        CHAT_CHECK(q.pop(v));
+        v.reset();
+        CHAT_CHECK_EQ(p.use_count(), 2);
+    }
+    CHAT_CHECK_EQ(p.use_count(), 1);
+}
+
+// 多个生产者并发 push, 消费者同时 pop: 不丢不重, 每个生产者内部保持顺序
+static void TestProducers() {
+    const int producers = 4;
+    const int count = 100000;
+    MpscQueue<std::pair<int, int> > q;
+    std::atomic<int> done{0};
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&q, &done, p, count](){
+            for (int i = 0; i < count; ++i) {
+                q.push({p, i});
+            }
+            ++done;
+        });
+    }
+
+    std::vector<int> next(producers, 0);
+    int total = 0;
+    std::pair<int, int> v;
+    while (total < producers * count) {
+        if (!q.pop(v)) {
+            if (done < producers) {
+                std::this_thread::yield();
+                continue;
+            }
+            // 生产者都已结束, 剩下的元素必须都能取到
+            CHAT_CHECK(q.pop(v));
+        }
+        CHAT_CHECK(v.first >= 0 && v.first < producers);
+        CHAT_CHECK_EQ(v.second, next[v.first]);
+        ++next[v.first];
+        ++total;
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    CHAT_CHECK(q.empty());
+    for (int p = 0; p < producers; ++p) {
+        CHAT_CHECK_EQ(next[p], count);
+    }
+}
+
+int main(int argc, char** argv) {
+    TestFifo();
+    TestOwnership();
+    TestProducers();
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include "chatroom/presenceBatch.h"
+#include "tests/test.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace chat::http;
+
+static const RosterChange* Find(const std::vector<RosterChange>& changes, const std::string& id) {
+    for (auto& i : changes) {
+        if (i.id == id) {
+            return &i;
+        }
+    }
+    return nullptr;
+}
+
+// 窗口内同一用户只保留最后一次变化, 只有第一条变化打开窗口
+static void TestMerge() {
+    PresenceBatch batch;
+    CHAT_CHECK(batch.add("a", 1, "alice", "a.png"));
+    CHAT_CHECK(!batch.add("b", 1, "bob", ""));
+    CHAT_CHECK(!batch.add("a", 2, "alice", ""));
+
+    std::vector<RosterChange> changes;
+    batch.take(changes);
+    CHAT_CHECK_EQ(changes.size(), 2u);
+    auto a = Find(changes, "a");
+    CHAT_CHECK(a);
+    CHAT_CHECK_EQ(a->code, 2);
+    CHAT_CHECK(a->avatar.empty());
+    auto b = Find(changes, "b");
+    CHAT_CHECK(b);
+    CHAT_CHECK_EQ(b->code, 1);
+    CHAT_CHECK_EQ(b->name, "bob");
+
+    // take 之后窗口关闭, 下一条变化重新打开
+    changes.clear();
+    batch.take(changes);
+    CHAT_CHECK(changes.empty());
+    CHAT_CHECK(batch.add("c", 1, "carol", ""));
+    batch.take(changes);
+    CHAT_CHECK_EQ(changes.size(), 1u);
+    CHAT_CHECK_EQ(changes[0].id, "c");
+}
+
+// 并发 add/take 时每个用户的最后一次变化都被某次 take 取到, 每个窗口只打开一次
+static void TestConcurrent() {
+    PresenceBatch batch;
+    const int threads = 4;
+    const int per = 2000;
+    std::atomic<int> armed{0};
+    std::atomic<bool> done{false};
+    std::vector<RosterChange> taken;
+    int takes = 0;
+    std::thread flusher([&]() {
+        while (true) {
+            bool last = done.load();
+            std::vector<RosterChange> changes;
+            batch.take(changes);
+            taken.insert(taken.end(), changes.begin(), changes.end());
+            ++takes;
+            if (last) {
+                break;
+            }
+        }
+    });
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; ++t) {
+        writers.emplace_back([&, t]() {
+            for (int i = 0; i < per; ++i) {
+                if (batch.add(std::to_string(t), i + 1 == per ? 2 : 1, "", "")) {
+                    armed.fetch_add(1);
+                }
+            }
+        });
+    }
+    for (auto& i : writers) {
+        i.join();
+    }
+    done = true;
+    flusher.join();
+
+    CHAT_CHECK(armed.load() >= 1);
+    CHAT_CHECK(armed.load() <= takes);
+    for (int t = 0; t < threads; ++t) {
+        const RosterChange* last = nullptr;
+        for (auto& i : taken) {
+            if (i.id == std::to_string(t)) {
+                last = &i;
+            }
+        }
+        CHAT_CHECK(last);
+        CHAT_CHECK_EQ(last->code, 2);
+    }
+}
+
+int main(int argc, char** argv) {
+    TestMerge();
+    TestConcurrent();
+    return 0;
+}
@@ -0,0 +1,190 @@
+#include "chatroom/protocol.h"
+#include "tests/test.h"
+#include <chat/endian.h>
+#include <string.h>
+
+using namespace chat::http;
+
+static const char* s_json = "{\"type\":\"chat_request\",\"to\":\"bob\",\"content\":\"hi \\\"bob\\\"\\n\\u00e9\\ud83d\\ude00\""
+                            ",\"before\":\"42\",\"time\":\"2024-01-01 00:00:00\"}";
+
+// 已知字段和扩展字段都要原样带过去
+static void CheckFields(ChatMessage::ptr msg) {
+    CHAT_CHECK(msg);
+    CHAT_CHECK_EQ(msg->getType(), MessageType::CHAT_REQUEST);
+    CHAT_CHECK(msg->get(ChatMessage::TYPE) == "chat_request");
+    CHAT_CHECK(msg->get(ChatMessage::TO) == "bob");
+    CHAT_CHECK(msg->get(ChatMessage::CONTENT) == "hi \"bob\"\n\xc3\xa9\xf0\x9f\x98\x80");
+    CHAT_CHECK(msg->get(ChatMessage::TIME) == "2024-01-01 00:00:00");
+    CHAT_CHECK(msg->get("before") == "42");
+    CHAT_CHECK(msg->get("content") == msg->get(ChatMessage::CONTENT));
+    CHAT_CHECK(!msg->has(ChatMessage::ROOM));
+    CHAT_CHECK(msg->get(ChatMessage::ROOM).empty());
+}
+
+static void TestJsonRoundTrip() {
+    auto msg = ChatMessage::Create(s_json);
+    CheckFields(msg);
+    CheckFields(ChatMessage::Create(msg->toString()));
+    CheckFields(ChatMessage::Create(msg->encode(ChatMessage::JSON)));
+
+    msg->set(ChatMessage::CONTENT, "changed");
+    msg->set("limit", "10");
+    auto copy = ChatMessage::Create(msg->toString());
+    CHAT_CHECK(copy);
+    CHAT_CHECK(copy->get(ChatMessage::CONTENT) == "changed");
+    CHAT_CHECK(copy->get("limit") == "10");
+}
+
+static void TestBinaryRoundTrip() {
+    auto msg = ChatMessage::Create(s_json);
+    std::string bin = msg->toBinary();
+    CHAT_CHECK_EQ((uint8_t)bin[0], BinaryProtocol::VERSION);
+    CHAT_CHECK_EQ((uint8_t)bin[1], (uint8_t)MessageType::CHAT_REQUEST);
+    CheckFields(ChatMessage::CreateBinary(bin));
+    CheckFields(ChatMessage::Create(msg->encode(ChatMessage::BINARY), ChatMessage::BINARY));
+
+    // JSON -> 二进制 -> JSON 后仍是同一条消息
+    auto back = ChatMessage::Create(ChatMessage::CreateBinary(bin)->toString());
+    CheckFields(back);
+
+    // 未知类型名作为普通字段携带
+    ChatMessage custom;
+    custom.set(ChatMessage::TYPE, "custom_request");
+    custom.set(ChatMessage::ID, std::string("a\0b", 3));
+    auto parsed = ChatMessage::CreateBinary(custom.toBinary());
+    CHAT_CHECK(parsed);
+    CHAT_CHECK_EQ(parsed->getType(), MessageType::UNKNOWN);
+    CHAT_CHECK(parsed->get(ChatMessage::TYPE) == "custom_request");
+    CHAT_CHECK(parsed->get(ChatMessage::ID) == std::string_view("a\0b", 3));
+}
+
+static void TestMalformed() {
+    CHAT_CHECK(!ChatMessage::Create(""));
+    CHAT_CHECK(!ChatMessage::Create("{\"type\":"));
+    CHAT_CHECK(!ChatMessage::Create("{\"type\":\"chat_request\"} x"));
+    CHAT_CHECK(!ChatMessage::Create("{\"content\":\"a\x01\"}"));
+
+    std::string bin = ChatMessage::Create(s_json)->toBinary();
+    // 任何位置截断都不能越界读, 也不能解析成功
+    for (size_t i = 0; i < bin.size(); ++i) {
+        CHAT_CHECK(!ChatMessage::CreateBinary(bin.substr(0, i)));
+    }
+    std::string bad_version = bin;
+    bad_version[0] = BinaryProtocol::VERSION + 1;
+    CHAT_CHECK(!ChatMessage::CreateBinary(bad_version));
+}
+
+// 长度字段的边界: 刚好放得下的能往返, 放不下的在解析/设置时拒绝, 不会编出截断的长度
+static void TestLengthLimits() {
+    std::string max_key(BinaryProtocol::MAX_KEY_SIZE, 'k');
+    std::string long_key(BinaryProtocol::MAX_KEY_SIZE + 1, 'k');
+
+    auto msg = ChatMessage::Create("{\"type\":\"chat_request\",\"" + max_key + "\":\"v\"}");
+    CHAT_CHECK(msg);
+    auto bin = ChatMessage::CreateBinary(msg->toBinary());
+    CHAT_CHECK(bin);
+    CHAT_CHECK(bin->get(max_key) == "v");
+    CHAT_CHECK(ChatMessage::Create(bin->toString())->get(max_key) == "v");
+
+    CHAT_CHECK(!ChatMessage::Create("{\"type\":\"chat_request\",\"" + long_key + "\":\"v\"}"));
+    ChatMessage m;
+    CHAT_CHECK(!m.set(long_key, "v"));
+    CHAT_CHECK(m.get(long_key).empty());
+    CHAT_CHECK(m.set(max_key, "v"));
+    CHAT_CHECK(m.set(max_key, "w"));
+    CHAT_CHECK(m.get(max_key) == "w");
+
+    // 字段数为 u16
+    ChatMessage many;
+    size_t extras = BinaryProtocol::MAX_FIELDS - ChatMessage::FIELD_COUNT;
+    for (size_t i = 0; i < extras; ++i) {
+        CHAT_CHECK(many.set("x" + std::to_string(i), ""));
+    }
+    CHAT_CHECK(!many.set("overflow", ""));
+    many.set(ChatMessage::TYPE, "chat_request");
+    auto parsed = ChatMessage::CreateBinary(many.toBinary());
+    CHAT_CHECK(parsed);
+    CHAT_CHECK(parsed->has(ChatMessage::TYPE));
+    CHAT_CHECK(parsed->get("x" + std::to_string(extras - 1)).empty());
+    CHAT_CHECK(parsed->toBinary() == many.toBinary());
+
+    // data 字段中的 u16 字符串: 超长的项跳过, 计数与实际项数一致
+    std::string max_str(BinaryProtocol::MAX_STRING_SIZE, 'n');
+    std::string long_str(BinaryProtocol::MAX_STRING_SIZE + 1, 'n');
+    std::vector<RoomInfo> rooms(3);
+    rooms[0].name = max_str;
+    rooms[1].name = long_str;
+    rooms[2].name = "r";
+    rooms[2].owner = "o";
+    std::string data = BinaryProtocol::EncodeRooms(rooms);
+    CHAT_CHECK_EQ(data.size(), 4 + (2 + max_str.size() + 2 + 4) + (2 + 1 + 2 + 1 + 4));
+    CHAT_CHECK_EQ(data.substr(0, 4), std::string("\0\0\0\2", 4));
+
+    std::vector<std::pair<std::string, std::pair<std::string, std::string> > > users;
+    users.push_back({"a", {long_str, ""}});
+    CHAT_CHECK_EQ(BinaryProtocol::EncodeUsers(users), std::string("\0\0\0\0", 4));
+    std::vector<RosterChange> changes(1);
+    changes[0].avatar = long_str;
+    CHAT_CHECK_EQ(BinaryProtocol::EncodeChanges(changes), std::string("\0\0\0\0", 4));
+}
+
+static void TestPeekType() {
+    auto msg = ChatMessage::Create(s_json);
+    CHAT_CHECK_EQ(ChatMessage::PeekType(s_json, ChatMessage::JSON), MessageType::CHAT_REQUEST);
+    CHAT_CHECK_EQ(ChatMessage::PeekType(msg->toBinary(), ChatMessage::BINARY), MessageType::CHAT_REQUEST);
+    CHAT_CHECK_EQ(ChatMessage::PeekType("{\"to\":\"x\",\"type\":\"login_request\"}", ChatMessage::JSON)
+                  , MessageType::LOGIN_REQUEST);
+    CHAT_CHECK_EQ(ChatMessage::PeekType("{\"to\":\"x\"}", ChatMessage::JSON), MessageType::UNKNOWN);
+    CHAT_CHECK_EQ(ChatMessage::PeekType("", ChatMessage::BINARY), MessageType::UNKNOWN);
+}
+
+static void TestMessageType() {
+    for (int i = 1; i < MessageType::TYPE_COUNT; ++i) {
+        auto t = (MessageType::Type)i;
+        CHAT_CHECK_EQ(MessageType::FromString(MessageType::ToString(t)), t);
+    }
+    CHAT_CHECK_EQ(MessageType::FromString("no_such_type"), MessageType::UNKNOWN);
+    for (int i = 0; i < ChatMessage::FIELD_COUNT; ++i) {
+        auto f = (ChatMessage::Field)i;
+        CHAT_CHECK_EQ(ChatMessage::FieldFromString(ChatMessage::FieldToString(f)), f);
+    }
+}
+
+static void TestEncodeHistory() {
+    std::vector<HistoryRecord> records(2);
+    records[0].offset = 7;
+    records[0].time = 1700000000000;
+    records[0].data = "{\"type\":\"chat_response\"}";
+    records[1].offset = 8;
+    std::string data = BinaryProtocol::EncodeHistory(records);
+    CHAT_CHECK_EQ(data.size(), 4 + (8 + 8 + 4 + records[0].data.size()) + (8 + 8 + 4));
+
+    auto read32 = [&](size_t pos) {
+        uint32_t v;
+        memcpy(&v, &data[pos], sizeof(v));
+        return chat::byteswapOnLittleEndian(v);
+    };
+    auto read64 = [&](size_t pos) {
+        uint64_t v;
+        memcpy(&v, &data[pos], sizeof(v));
+        return chat::byteswapOnLittleEndian(v);
+    };
+    CHAT_CHECK_EQ(read32(0), 2u);
+    CHAT_CHECK_EQ(read64(4), 7u);
+    CHAT_CHECK_EQ(read64(12), 1700000000000u);
+    CHAT_CHECK_EQ(read32(20), records[0].data.size());
+    CHAT_CHECK(data.compare(24, records[0].data.size(), records[0].data) == 0);
+    CHAT_CHECK_EQ(read64(24 + records[0].data.size()), 8u);
+}
+
+int main(int argc, char** argv) {
+    TestJsonRoundTrip();
+    TestBinaryRoundTrip();
+    TestMalformed();
+    TestLengthLimits();
+    TestPeekType();
+    TestMessageType();
+    TestEncodeHistory();
+    return 0;
+}
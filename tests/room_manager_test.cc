@@ -0,0 +1,96 @@
+#include "chatroom/roomManager.h"
+#include "tests/test.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace chat::http;
+
+static ChatSession::ptr NewConn() {
+    return std::make_shared<ChatSession>(nullptr, nullptr);
+}
+
+// 创建者即成员, 同名房间不能重复创建, 重复加入不算新加入
+static void TestCreateJoin() {
+    auto pubsub = std::make_shared<PubSub>(4);
+    RoomManager rooms(pubsub);
+    auto room = rooms.create("r", "owner", NewConn());
+    CHAT_CHECK(room);
+    CHAT_CHECK_EQ(room->getOwner(), "owner");
+    CHAT_CHECK(room->has("owner"));
+    CHAT_CHECK(!rooms.create("r", "other", NewConn()));
+    CHAT_CHECK_EQ(rooms.get("r"), room);
+    CHAT_CHECK(!rooms.get("none"));
+
+    bool joined = false;
+    CHAT_CHECK_EQ(rooms.join("r", "a", NewConn(), joined), room);
+    CHAT_CHECK(joined);
+    CHAT_CHECK_EQ(rooms.join("r", "a", NewConn(), joined), room);
+    CHAT_CHECK(!joined);
+    CHAT_CHECK(!rooms.join("none", "a", NewConn(), joined));
+    CHAT_CHECK_EQ(room->size(), 2u);
+    // 成员即房间主题的订阅者, 房间消息只发给成员
+    CHAT_CHECK_EQ(room->getTopic(), pubsub->getTopic(Room::TopicName("r")));
+    CHAT_CHECK_EQ(room->getTopic()->getSubscribers()->conns.size(), 2u);
+    CHAT_CHECK(!room->has("b"));
+}
+
+// 非成员不能离开, 最后一个成员离开后删除房间和主题
+static void TestLeave() {
+    auto pubsub = std::make_shared<PubSub>(4);
+    RoomManager rooms(pubsub);
+    auto room = rooms.create("r", "owner", NewConn());
+    bool joined = false;
+    rooms.join("r", "a", NewConn(), joined);
+    CHAT_CHECK(!rooms.leave("r", "b"));
+    CHAT_CHECK(!rooms.leave("none", "a"));
+    CHAT_CHECK_EQ(rooms.leave("r", "a"), room);
+    CHAT_CHECK(!room->has("a"));
+    CHAT_CHECK(!rooms.leave("r", "a"));
+    CHAT_CHECK_EQ(rooms.size(), 1u);
+    CHAT_CHECK_EQ(rooms.leave("r", "owner"), room);
+    CHAT_CHECK_EQ(rooms.size(), 0u);
+    CHAT_CHECK(!rooms.get("r"));
+    CHAT_CHECK(!pubsub->getTopic(Room::TopicName("r")));
+
+    // 删除后可重新创建, 得到新的房间
+    auto again = rooms.create("r", "b", NewConn());
+    CHAT_CHECK(again);
+    CHAT_CHECK(again != room);
+    // 历史按创建序号保存, 重建的房间读不到之前的记录
+    CHAT_CHECK(again->getIncarnation() > room->getIncarnation());
+    CHAT_CHECK_EQ(again->getOwner(), "b");
+    CHAT_CHECK(!again->has("owner"));
+}
+
+// 断开时离开全部房间, 只剩自己的房间随之删除
+static void TestLeaveAll() {
+    auto pubsub = std::make_shared<PubSub>(4);
+    RoomManager rooms(pubsub);
+    auto conn = NewConn();
+    rooms.create("x", "a", conn);
+    rooms.create("y", "b", NewConn());
+    bool joined = false;
+    rooms.join("y", "a", conn, joined);
+
+    auto left = rooms.leaveAll("a");
+    CHAT_CHECK_EQ(left.size(), 2u);
+    CHAT_CHECK(!rooms.get("x"));
+    auto y = rooms.get("y");
+    CHAT_CHECK(y);
+    CHAT_CHECK(!y->has("a"));
+    CHAT_CHECK(y->has("b"));
+    CHAT_CHECK(rooms.leaveAll("a").empty());
+
+    std::vector<Room::ptr> list;
+    rooms.list(list);
+    CHAT_CHECK_EQ(list.size(), 1u);
+    CHAT_CHECK_EQ(list[0]->getName(), "y");
+}
+
+int main(int argc, char** argv) {
+    TestCreateJoin();
+    TestLeave();
+    TestLeaveAll();
+    return 0;
+}
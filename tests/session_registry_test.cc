@@ -0,0 +1,91 @@
+#include "chatroom/sessionRegistry.h"
+#include "tests/test.h"
+#include <chat/config.h>
+#include <string>
+#include <vector>
+
+using namespace chat::http;
+
+// 增量同步: 同一用户只保留最后一次变化, 按版本顺序返回, 信息未变的 addInfo 不产生变化
+static void TestChanges() {
+    SessionRegistry reg(4);
+    uint64_t v0 = reg.getInfoVersion();
+    reg.addInfo("a", "alice", "a.png");
+    reg.addInfo("b", "bob", "b.png");
+    uint64_t v1 = reg.getInfoVersion();
+    CHAT_CHECK_EQ(v1, v0 + 2);
+
+    reg.addInfo("a", "alice", "a.png");
+    CHAT_CHECK_EQ(reg.getInfoVersion(), v1);
+    reg.addInfo("c", "carol", "c.png");
+    reg.del("a");
+
+    std::vector<RosterChange> changes;
+    uint64_t version = 0;
+    CHAT_CHECK(reg.getChanges(v1, changes, version));
+    CHAT_CHECK_EQ(version, v1 + 2);
+    CHAT_CHECK_EQ(changes.size(), 2u);
+    CHAT_CHECK_EQ(changes[0].id, "c");
+    CHAT_CHECK_EQ(changes[0].code, 1);
+    CHAT_CHECK_EQ(changes[0].name, "carol");
+    CHAT_CHECK_EQ(changes[1].id, "a");
+    CHAT_CHECK_EQ(changes[1].code, 2);
+    CHAT_CHECK(changes[0].version < changes[1].version);
+
+    // 从最初版本同步, a 的新增和删除合并为一次删除
+    changes.clear();
+    CHAT_CHECK(reg.getChanges(v0, changes, version));
+    CHAT_CHECK_EQ(changes.size(), 3u);
+    CHAT_CHECK_EQ(changes[0].id, "b");
+    CHAT_CHECK_EQ(changes[1].id, "c");
+    CHAT_CHECK_EQ(changes[2].id, "a");
+    CHAT_CHECK_EQ(changes[2].code, 2);
+
+    // 已是最新版本
+    changes.clear();
+    CHAT_CHECK(reg.getChanges(version, changes, version));
+    CHAT_CHECK(changes.empty());
+}
+
+// 早于变更日志或晚于当前版本(如重启前缓存的版本号)时退回全量同步
+static void TestFallback() {
+    SessionRegistry reg(4);
+    uint64_t v0 = reg.getInfoVersion();
+    reg.addInfo("a", "alice", "a.png");
+    std::vector<RosterChange> changes;
+    uint64_t version = 0;
+    CHAT_CHECK(!reg.getChanges(v0 - 1, changes, version));
+    CHAT_CHECK(!reg.getChanges(reg.getInfoVersion() + 1, changes, version));
+    CHAT_CHECK_EQ(version, reg.getInfoVersion());
+    CHAT_CHECK(changes.empty());
+}
+
+// 变更日志超过 chat.roster.changelog_size 后丢弃最早的变化, 更早的版本需要全量同步
+static void TestChangelogTrim() {
+    auto size = chat::Config::Lookup<uint32_t>("chat.roster.changelog_size");
+    uint32_t old_size = size->getValue();
+    size->setValue(2);
+
+    SessionRegistry reg(4);
+    uint64_t v0 = reg.getInfoVersion();
+    for (int i = 0; i < 4; ++i) {
+        reg.addInfo(std::to_string(i), "user" + std::to_string(i), "");
+    }
+    std::vector<RosterChange> changes;
+    uint64_t version = 0;
+    CHAT_CHECK(!reg.getChanges(v0, changes, version));
+    CHAT_CHECK(!reg.getChanges(v0 + 1, changes, version));
+    CHAT_CHECK(reg.getChanges(v0 + 2, changes, version));
+    CHAT_CHECK_EQ(changes.size(), 2u);
+    CHAT_CHECK_EQ(changes[0].id, "2");
+    CHAT_CHECK_EQ(changes[1].id, "3");
+
+    size->setValue(old_size);
+}
+
+int main(int argc, char** argv) {
+    TestChanges();
+    TestFallback();
+    TestChangelogTrim();
+    return 0;
+}
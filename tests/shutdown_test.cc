@@ -0,0 +1,95 @@
+#include "chatroom/application.h"
+#include "chatroom/messageStore.h"
+#include "tests/test.h"
+#include <chat/config.h>
+#include <chat/iomanager.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace chat::http;
+
+static const uint64_t COUNT = 100;
+
+static std::string Message(uint64_t i) {
+    return "{\"type\":\"chat_response\",\"content\":\"" + std::to_string(i) + "\"}";
+}
+
+// 与 Application::main 相同的停止流程: 在主 IOManager 上等停止信号, stop 返回后写出消息历史
+static int RunChild(const std::string& path, int ready_fd) {
+    chat::Application::InstallSignalHandler();
+    MessageStore store(path);
+    bool stopped = false;
+    {
+        chat::IOManager iom(1, true, "main");
+        iom.schedule([&store, ready_fd]() {
+            for (uint64_t i = 0; i < COUNT; ++i) {
+                store.append(MessageStore::GroupKey(), Message(i));
+            }
+            CHAT_CHECK_EQ(write(ready_fd, "x", 1), 1);
+        });
+        // 收到信号时的最后一条, 提交定时器还没到期
+        chat::Application::WatchStop(&iom, [&store, &stopped]() {
+            store.append(MessageStore::GroupKey(), Message(COUNT));
+            stopped = true;
+        }, 10);
+        iom.stop();
+    }
+    store.stop();
+    return stopped ? 0 : 1;
+}
+
+// 收到 SIGTERM 后正常退出, 退出前入队的消息都能读回
+static void TestSigterm(const std::string& path) {
+    int fds[2];
+    CHAT_CHECK_EQ(pipe(fds), 0);
+    pid_t pid = fork();
+    CHAT_CHECK(pid >= 0);
+    if (pid == 0) {
+        close(fds[0]);
+        _exit(RunChild(path, fds[1]));
+    }
+    close(fds[1]);
+    char c;
+    CHAT_CHECK_EQ(read(fds[0], &c, 1), 1);
+    close(fds[0]);
+    CHAT_CHECK_EQ(kill(pid, SIGTERM), 0);
+
+    // 10 秒内没有退出视为失败
+    int status = 0;
+    pid_t ret = 0;
+    for (int i = 0; i < 1000 && (ret = waitpid(pid, &status, WNOHANG)) == 0; ++i) {
+        usleep(10 * 1000);
+    }
+    if (ret == 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+    }
+    CHAT_CHECK_EQ(ret, pid);
+    CHAT_CHECK(WIFEXITED(status));
+    CHAT_CHECK_EQ(WEXITSTATUS(status), 0);
+
+    MessageStore store(path);
+    std::vector<HistoryRecord> records;
+    CHAT_CHECK(store.read(MessageStore::GroupKey(), 0, 1000, records));
+    CHAT_CHECK_EQ(records.size(), COUNT + 1);
+    for (size_t i = 0; i < records.size(); ++i) {
+        CHAT_CHECK_EQ(records[i].data, Message(i));
+    }
+}
+
+int main(int argc, char** argv) {
+    char tmpl[] = "/tmp/chat_shutdown_test_XXXXXX";
+    CHAT_CHECK(mkdtemp(tmpl));
+    std::string path = tmpl;
+    // 提交窗口拉长, 信号到达时消息还在队列里
+    chat::Config::Lookup<uint32_t>("chat.history.commit_ms")->setValue(500);
+
+    TestSigterm(path);
+
+    CHAT_CHECK_EQ(system(("rm -rf " + path).c_str()), 0);
+    return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef __CHAT_TEST_H__
+#define __CHAT_TEST_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Release 构建带 -DNDEBUG, 不能用 assert; 失败时打印位置并以非 0 退出, 由 ctest 判定
+#define CHAT_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+#define CHAT_CHECK_EQ(a, b) CHAT_CHECK((a) == (b))
+
+#endif
@@ -0,0 +1,364 @@
+#include "chatroom/protocol.h"
+#include "chatroom/metrics.h"
+#include <chat/iomanager.h>
+#include <chat/socket.h>
+#include <chat/address.h>
+#include <chat/endian.h>
+#include <chat/util.h>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// WebSocket 压测工具: 建立 N 个 /chat 连接, 登录并拉取用户列表后
+// 按给定速率向 group 或随机用户发送 chat_request, 统计送达速率和端到端延迟
+//
+// 用法: loadgen -a 127.0.0.1:8030 -c 100 -r 1000 -d 30 -m group -s 64 -t 4
+//   -a 服务地址, -c 连接数, -r 全部连接合计每秒发送条数, -d 持续秒数
+//   -m group|private, -s 消息内容字节数, -t 工作线程数
+
+using namespace chat::http;
+
+struct Options {
+    std::string address = "127.0.0.1:8030";
+    uint32_t connections = 100;
+    uint32_t rate = 1000;
+    uint32_t duration = 30;
+    bool group = true;
+    uint32_t size = 64;
+    uint32_t threads = 4;
+};
+
+static Options s_opts;
+static std::string s_prefix;
+static std::atomic<uint32_t> s_ready{0};
+static std::atomic<uint32_t> s_failed{0};
+static std::atomic<bool> s_stop{false};
+static chat::Counter s_sent;
+static chat::Counter s_delivered;
+static chat::Counter s_errors;
+static chat::Histogram s_latency;
+
+// 最小的 WebSocket 客户端, 只支持本工具用到的文本帧
+class WSClient {
+public:
+    typedef std::shared_ptr<WSClient> ptr;
+
+    bool connect(chat::Address::ptr addr) {
+        m_sock = chat::Socket::CreateTCP(addr);
+        if (!m_sock->connect(addr, 3000)) {
+            return false;
+        }
+        std::string req = "GET /chat HTTP/1.1\r\n"
+            "Host: " + s_opts.address + "\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+            "Sec-WebSocket-Version: 13\r\n\r\n";
+        if (!writeAll(req.data(), req.size())) {
+            return false;
+        }
+        std::string rsp;
+        char c;
+        while (rsp.size() < 4096) {
+            if (!readAll(&c, 1)) {
+                return false;
+            }
+            rsp.push_back(c);
+            if (rsp.size() >= 4 && rsp.compare(rsp.size() - 4, 4, "\r\n\r\n") == 0) {
+                return rsp.find(" 101 ") != std::string::npos;
+            }
+        }
+        return false;
+    }
+
+    bool send(const std::string& payload) {
+        std::string buf;
+        buf.reserve(payload.size() + 14);
+        buf.push_back((char)(0x80 | WSFrameHead::TEXT_FRAME));
+        if (payload.size() < 126) {
+            buf.push_back((char)(0x80 | payload.size()));
+        } else if (payload.size() < 65536) {
+            buf.push_back((char)(0x80 | 126));
+            uint16_t len = chat::byteswapOnLittleEndian((uint16_t)payload.size());
+            buf.append((const char*)&len, sizeof(len));
+        } else {
+            buf.push_back((char)(0x80 | 127));
+            uint64_t len = chat::byteswapOnLittleEndian((uint64_t)payload.size());
+            buf.append((const char*)&len, sizeof(len));
+        }
+        // 客户端帧必须加 mask
+        uint32_t mask = rand();
+        buf.append((const char*)&mask, sizeof(mask));
+        size_t off = buf.size();
+        buf.append(payload);
+        for (size_t i = 0; i < payload.size(); ++i) {
+            buf[off + i] ^= ((const char*)&mask)[i % 4];
+        }
+        return writeAll(buf.data(), buf.size());
+    }
+
+    /// 读取一条完整的文本/二进制消息, 自动回复 ping
+    bool recv(std::string& payload) {
+        payload.clear();
+        while (true) {
+            uint8_t head[2];
+            if (!readAll(head, 2)) {
+                return false;
+            }
+            uint64_t len = head[1] & 0x7F;
+            if (len == 126) {
+                uint16_t l;
+                if (!readAll(&l, sizeof(l))) {
+                    return false;
+                }
+                len = chat::byteswapOnLittleEndian(l);
+            } else if (len == 127) {
+                uint64_t l;
+                if (!readAll(&l, sizeof(l))) {
+                    return false;
+                }
+                len = chat::byteswapOnLittleEndian(l);
+            }
+            std::string data(len, '\0');
+            if (len && !readAll(&data[0], len)) {
+                return false;
+            }
+            int opcode = head[0] & 0x0F;
+            if (opcode == WSFrameHead::CLOSE) {
+                return false;
+            }
+            if (opcode == WSFrameHead::PING) {
+                continue;
+            }
+            payload.append(data);
+            if (head[0] & 0x80) {
+                return true;
+            }
+        }
+    }
+
+    void close() {
+        if (m_sock) {
+            m_sock->close();
+        }
+    }
+private:
+    bool writeAll(const void* data, size_t len) {
+        const char* p = (const char*)data;
+        while (len > 0) {
+            int rt = m_sock->send(p, len);
+            if (rt <= 0) {
+                return false;
+            }
+            p += rt;
+            len -= rt;
+        }
+        return true;
+    }
+
+    bool readAll(void* data, size_t len) {
+        char* p = (char*)data;
+        while (len > 0) {
+            int rt = m_sock->recv(p, len);
+            if (rt <= 0) {
+                return false;
+            }
+            p += rt;
+            len -= rt;
+        }
+        return true;
+    }
+private:
+    chat::Socket::ptr m_sock;
+};
+
+static std::string UserName(uint32_t idx) {
+    return s_prefix + std::to_string(idx);
+}
+
+// 等待指定类型的响应, 期间收到的其它消息忽略
+static ChatMessage::ptr WaitFor(WSClient::ptr client, MessageType::Type type) {
+    std::string payload;
+    while (client->recv(payload)) {
+        auto msg = ChatMessage::Create(std::move(payload));
+        if (msg && msg->getType() == type) {
+            return msg;
+        }
+    }
+    return nullptr;
+}
+
+static void Reader(WSClient::ptr client) {
+    std::string payload;
+    while (client->recv(payload)) {
+        if (ChatMessage::PeekType(payload, ChatMessage::JSON) != MessageType::CHAT_RESPONSE) {
+            continue;
+        }
+        auto msg = ChatMessage::Create(std::move(payload));
+        if (!msg) {
+            continue;
+        }
+        if (msg->get(ChatMessage::RESULT) != "200") {
+            s_errors.inc();
+            continue;
+        }
+        // content 以发送时刻(纳秒)开头
+        auto content = msg->get(ChatMessage::CONTENT);
+        uint64_t ts = strtoull(std::string(content.substr(0, content.find(' '))).c_str(), nullptr, 10);
+        uint64_t now = chat::MonotonicNs();
+        if (ts && now > ts) {
+            s_latency.record(now - ts);
+        }
+        s_delivered.inc();
+    }
+}
+
+static void Client(chat::Address::ptr addr, uint32_t idx) {
+    WSClient::ptr client = std::make_shared<WSClient>();
+    auto name = UserName(idx);
+    if (!client->connect(addr)) {
+        std::cerr << "connect fail: " << name << std::endl;
+        ++s_failed;
+        return;
+    }
+
+    ChatMessage login;
+    login.set(ChatMessage::TYPE, "login_request");
+    login.set(ChatMessage::NAME, name);
+    login.set(ChatMessage::AVATAR, "./static/avatar/avatar_01.jpg");
+    auto rsp = client->send(login.toString()) ? WaitFor(client, MessageType::LOGIN_RESPONSE) : nullptr;
+    if (!rsp || rsp->get(ChatMessage::RESULT) != "200") {
+        std::cerr << "login fail: " << name << std::endl;
+        ++s_failed;
+        client->close();
+        return;
+    }
+
+    ChatMessage init;
+    init.set(ChatMessage::TYPE, "chat_init_request");
+    if (!client->send(init.toString()) || !WaitFor(client, MessageType::CHAT_INIT_RESPONSE)) {
+        std::cerr << "chat init fail: " << name << std::endl;
+        ++s_failed;
+        client->close();
+        return;
+    }
+
+    chat::IOManager::GetThis()->schedule(std::bind(&Reader, client));
+    ++s_ready;
+    // 所有连接就绪后同时开始发送
+    while (s_ready + s_failed < s_opts.connections && !s_stop) {
+        usleep(10 * 1000);
+    }
+
+    uint64_t interval_us = s_opts.rate ? (uint64_t)s_opts.connections * 1000000 / s_opts.rate : 0;
+    // 错开各连接的第一次发送
+    uint64_t next = chat::GetCurrentUS() + (interval_us ? rand() % interval_us : 0);
+    std::string padding(s_opts.size, 'x');
+    ChatMessage msg;
+    msg.set(ChatMessage::TYPE, "chat_request");
+    msg.set(ChatMessage::FROM, name);
+    msg.set(ChatMessage::NAME, name);
+    msg.set(ChatMessage::AVATAR, "./static/avatar/avatar_01.jpg");
+    while (!s_stop && interval_us) {
+        uint64_t now = chat::GetCurrentUS();
+        if (now < next) {
+            usleep(next - now);
+            continue;
+        }
+        next += interval_us;
+
+        std::string to = "group";
+        if (!s_opts.group && s_opts.connections > 1) {
+            uint32_t peer = rand() % (s_opts.connections - 1);
+            to = UserName(peer >= idx ? peer + 1 : peer);
+        }
+        msg.set(ChatMessage::TO, to);
+        msg.set(ChatMessage::TIME, std::to_string(chat::GetCurrentMS()));
+        msg.set(ChatMessage::CONTENT, std::to_string(chat::MonotonicNs()) + " " + padding);
+        if (!client->send(msg.toString())) {
+            s_errors.inc();
+            break;
+        }
+        s_sent.inc();
+    }
+    client->close();
+}
+
+static void Report(const chat::Histogram::Snapshot& snap, double secs, uint64_t sent, uint64_t delivered) {
+    std::cout << "sent=" << sent << " (" << (uint64_t)(sent / secs) << "/s)"
+        << " delivered=" << delivered << " (" << (uint64_t)(delivered / secs) << "/s)"
+        << " errors=" << s_errors.value()
+        << " latency_us p50=" << snap.percentile(0.5) / 1000
+        << " p99=" << snap.percentile(0.99) / 1000
+        << " p999=" << snap.percentile(0.999) / 1000
+        << " max=" << snap.max / 1000
+        << std::endl;
+}
+
+static void Run() {
+    auto addr = chat::Address::LookupAny(s_opts.address);
+    if (!addr) {
+        std::cerr << "invalid address: " << s_opts.address << std::endl;
+        return;
+    }
+    auto iom = chat::IOManager::GetThis();
+    for (uint32_t i = 0; i < s_opts.connections; ++i) {
+        iom->schedule(std::bind(&Client, addr, i));
+    }
+    while (s_ready + s_failed < s_opts.connections) {
+        usleep(100 * 1000);
+    }
+    std::cout << "ready=" << s_ready << " failed=" << s_failed << std::endl;
+
+    uint64_t start = chat::GetCurrentMS();
+    uint64_t last_sent = 0;
+    uint64_t last_delivered = 0;
+    for (uint32_t i = 0; i < s_opts.duration; ++i) {
+        sleep(1);
+        uint64_t sent = s_sent.value();
+        uint64_t delivered = s_delivered.value();
+        std::cout << "[" << i + 1 << "s] sent/s=" << sent - last_sent
+            << " delivered/s=" << delivered - last_delivered << std::endl;
+        last_sent = sent;
+        last_delivered = delivered;
+    }
+    s_stop = true;
+    double secs = (chat::GetCurrentMS() - start) / 1000.0;
+    Report(s_latency.snapshot(), secs, s_sent.value(), s_delivered.value());
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "a:c:r:d:m:s:t:")) != -1) {
+        switch (opt) {
+            case 'a': s_opts.address = optarg; break;
+            case 'c': s_opts.connections = atoi(optarg); break;
+            case 'r': s_opts.rate = atoi(optarg); break;
+            case 'd': s_opts.duration = atoi(optarg); break;
+            case 'm': s_opts.group = strcmp(optarg, "private") != 0; break;
+            case 's': s_opts.size = atoi(optarg); break;
+            case 't': s_opts.threads = atoi(optarg); break;
+            default:
+                std::cerr << "usage: " << argv[0]
+                    << " [-a host:port] [-c connections] [-r msgs/s] [-d seconds]"
+                    << " [-m group|private] [-s content bytes] [-t threads]" << std::endl;
+                return 1;
+        }
+    }
+    if (s_opts.connections == 0 || s_opts.threads == 0) {
+        std::cerr << "connections and threads must be > 0" << std::endl;
+        return 1;
+    }
+    srand(time(0));
+    // 用户名带 pid, 多个压测进程可以同时连同一个服务
+    s_prefix = "load_" + std::to_string(getpid()) + "_";
+
+    chat::IOManager iom(s_opts.threads, true, "loadgen");
+    iom.schedule(&Run);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#include "chatroom/binLog.h"
+#include <fstream>
+#include <iostream>
+
+// 把 binlog 写出的二进制日志还原成文本
+// 用法: logdecode <file>, 不带参数时从标准输入读取
+int main(int argc, char** argv) {
+    std::ifstream ifs;
+    std::istream* is = &std::cin;
+    if (argc > 1) {
+        ifs.open(argv[1], std::ios::binary);
+        if (!ifs) {
+            std::cerr << "open " << argv[1] << " failed" << std::endl;
+            return 1;
+        }
+        is = &ifs;
+    }
+
+    chat::BinLogReader reader(*is);
+    std::string line;
+    while (reader.next(line)) {
+        std::cout << line << "\n";
+    }
+    if (!reader.getError().empty()) {
+        std::cerr << "decode error: " << reader.getError() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+#!/bin/bash
+# PGO 流程: 插桩构建 -> loadgen 压测采集 profile -> 用 profile 重新构建,
+# 每一步都跑 bench_report, 最后用 Google Benchmark 的 compare.py 输出差异
+# 用法: tools/pgo.sh [压测秒数]
+# 环境变量: CONNS RATE 压测参数, COMPARE compare.py 路径
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+DURATION=${1:-30}
+CONNS=${CONNS:-200}
+RATE=${RATE:-5000}
+PROFILE_DIR=$ROOT/build-pgo/profile
+COMPARE=${COMPARE:-$(command -v compare.py || true)}
+
+# 所有构建目录共用 bin/ 和 lib/ 输出, 各步骤必须顺序执行
+build() {
+    local dir=$1
+    shift
+    cmake -S "$ROOT" -B "$dir" -DCMAKE_CXX_COMPILER="$(which g++)" -DCMAKE_C_COMPILER="$(which gcc)" "$@"
+    cmake --build "$dir" -j"$(nproc)"
+}
+
+bench() {
+    if cmake --build "$1" --target help | grep -q bench_report; then
+        cmake --build "$1" --target bench_report
+    fi
+}
+
+compare() {
+    local a=$1/bench_results
+    local b=$2/bench_results
+    [ -d "$a" ] && [ -d "$b" ] || return 0
+    for f in "$a"/*.json; do
+        echo "==== $(basename "$1") -> $(basename "$2"): $(basename "$f")"
+        if [ -n "$COMPARE" ]; then
+            "$COMPARE" benchmarks "$f" "$b/$(basename "$f")"
+        else
+            echo "compare.py not found, results in $f and $b/$(basename "$f")"
+        fi
+    done
+}
+
+build "$ROOT/build-debug" -DCMAKE_BUILD_TYPE=Debug
+bench "$ROOT/build-debug"
+
+build "$ROOT/build-release" -DCMAKE_BUILD_TYPE=Release
+bench "$ROOT/build-release"
+
+rm -rf "$PROFILE_DIR"
+build "$ROOT/build-pgo-gen" -DCMAKE_BUILD_TYPE=Release -DCHAT_PGO=GENERATE -DCHAT_PGO_DIR="$PROFILE_DIR"
+cd "$ROOT/bin"
+./main -s &
+PID=$!
+sleep 2
+./loadgen -a 127.0.0.1:8030 -c "$CONNS" -r "$RATE" -d "$DURATION" -m group
+./loadgen -a 127.0.0.1:8030 -c "$CONNS" -r "$RATE" -d "$DURATION" -m private
+kill -TERM $PID
+wait $PID || true
+cd "$ROOT"
+
+build "$ROOT/build-pgo" -DCMAKE_BUILD_TYPE=Release -DCHAT_PGO=USE -DCHAT_PGO_DIR="$PROFILE_DIR"
+bench "$ROOT/build-pgo"
+
+compare "$ROOT/build-debug" "$ROOT/build-release"
+compare "$ROOT/build-release" "$ROOT/build-pgo"